@@ -0,0 +1,79 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <cstdio>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "AtomicFile.hpp"
+#include "Errors.hpp"
+
+/// Flush the content of the file or directory at `path` to the disk, so that
+/// it survives a crash of the machine. Returns `false` on error.
+static bool sync_path(const std::string& path) {
+#ifndef _WIN32
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    auto status = ::fsync(fd);
+    ::close(fd);
+    return status == 0;
+#else
+    (void)path;
+    return true;
+#endif
+}
+
+/// Get the directory containing the file at `path`
+static std::string parent_directory(const std::string& path) {
+    auto slash = path.find_last_of('/');
+    if (slash == std::string::npos) {
+        return ".";
+    } else if (slash == 0) {
+        return "/";
+    }
+    return path.substr(0, slash);
+}
+
+AtomicFile::AtomicFile(std::string path, std::ios::openmode mode):
+    path_(std::move(path)), tmp_path_(path_ + ".tmp")
+{
+    this->open(tmp_path_, mode | std::ios::out | std::ios::trunc);
+}
+
+AtomicFile::~AtomicFile() {
+    if (!committed_ && this->is_open()) {
+        this->close();
+        std::remove(tmp_path_.c_str());
+    }
+}
+
+void AtomicFile::commit() {
+    this->close();
+    if (this->fail()) {
+        std::remove(tmp_path_.c_str());
+        throw CFilesError("Could not write to the '" + tmp_path_ + "' file.");
+    }
+    // make sure the data is on disk before the rename, otherwise a crash can
+    // leave an empty file at the final path
+    if (!sync_path(tmp_path_)) {
+        std::remove(tmp_path_.c_str());
+        throw CFilesError("Could not write to the '" + tmp_path_ + "' file.");
+    }
+#ifdef _WIN32
+    // rename does not replace existing files on Windows
+    std::remove(path_.c_str());
+#endif
+    if (std::rename(tmp_path_.c_str(), path_.c_str()) != 0) {
+        throw CFilesError("Could not rename '" + tmp_path_ + "' to '" + path_ + "'.");
+    }
+    committed_ = true;
+    // make the rename itself durable
+    if (!sync_path(parent_directory(path_))) {
+        throw CFilesError("Could not write to the '" + path_ + "' file.");
+    }
+}
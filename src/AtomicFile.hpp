@@ -0,0 +1,31 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_ATOMIC_FILE_HPP
+#define CFILES_ATOMIC_FILE_HPP
+
+#include <fstream>
+#include <string>
+
+/// Output file stream writing to a temporary file, which replaces the file at
+/// the final path in `commit`. Other processes reading the file never see
+/// partially written content. If `commit` is not called, the temporary file
+/// is removed.
+class AtomicFile: public std::ofstream {
+public:
+    explicit AtomicFile(std::string path, std::ios::openmode mode = std::ios::out);
+    ~AtomicFile();
+
+    AtomicFile(const AtomicFile&) = delete;
+    AtomicFile& operator=(const AtomicFile&) = delete;
+
+    /// Close the temporary file and rename it to the final path
+    void commit();
+
+private:
+    std::string path_;
+    std::string tmp_path_;
+    bool committed_ = false;
+};
+
+#endif
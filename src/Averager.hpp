@@ -4,6 +4,11 @@
 #ifndef CFILES_AVERAGER_HPP
 #define CFILES_AVERAGER_HPP
 
+#include <algorithm>
+#include <cassert>
+
+#include "Checkpoint.hpp"
+#include "Errors.hpp"
 #include "Histogram.hpp"
 
 /// Average class, averaging an historgram over multiple steps
@@ -24,9 +29,25 @@ public:
     Averager& operator=(const Averager&) = default;
     Averager& operator=(Averager&&) = default;
 
+    /// Only average the data over the last `window` steps instead of all the
+    /// steps. The data from each step in the window is kept, to be removed
+    /// from the average when it leaves the window. A `window` of 0 averages
+    /// over all steps. This must be called before the first call to `step`.
+    void set_window(size_t window) {
+        assert(nsteps_ == 0);
+        window_ = window;
+        ring_.assign(window * this->size(), 0.0);
+        ring_next_ = 0;
+    }
+
     /// Store the current data for averaging, and clean the current data
     /// (set it to `T()`)
     void step() {
+        if (window_ != 0) {
+            step_window();
+            return;
+        }
+
         for (size_t i=0; i<this->size(); i++) {
             averaged_[i] += (*this)[i];
             (*this)[i] = 0;
@@ -40,11 +61,119 @@ public:
         }
     }
 
+    /// Get a new histogram containing the average of the stored data, without
+    /// modifying this averager
+    Histogram averaged() const {
+        Histogram result = *this;
+        for (size_t i=0; i<this->size(); i++) {
+            result[i] = averaged_[i] / nsteps_;
+        }
+        return result;
+    }
+
+    /// Get the number of steps currently averaged. This is the number of
+    /// time `step` was called, up to the window size when using a window.
+    size_t nsteps() const {
+        return nsteps_;
+    }
+
+    /// Save the accumulated data to a `checkpoint`
+    void save(CheckpointWriter& checkpoint) const {
+        checkpoint.write(static_cast<uint64_t>(nsteps_));
+        checkpoint.write(averaged_);
+        checkpoint.write(static_cast<uint64_t>(window_));
+        if (window_ != 0) {
+            checkpoint.write(static_cast<uint64_t>(ring_next_));
+            checkpoint.write(ring_);
+        }
+    }
+
+    /// Load the accumulated data from a `checkpoint`, replacing the current
+    /// data. The checkpoint must have been created from an averager with the
+    /// same size and window.
+    void load(CheckpointReader& checkpoint) {
+        nsteps_ = static_cast<size_t>(checkpoint.read_u64());
+        checkpoint.read(averaged_);
+        if (checkpoint.read_u64() != window_) {
+            throw CFilesError("the checkpoint was created with a different window size");
+        }
+        if (window_ != 0) {
+            ring_next_ = static_cast<size_t>(checkpoint.read_u64());
+            checkpoint.read(ring_);
+        }
+    }
+
 private:
+    /// Implementation of `step` when using a window
+    void step_window() {
+        auto size = this->size();
+        auto slot = ring_.data() + ring_next_ * size;
+        bool full = (nsteps_ == window_);
+        for (size_t i=0; i<size; i++) {
+            if (full) {
+                averaged_[i] -= slot[i];
+            }
+            slot[i] = (*this)[i];
+            averaged_[i] += slot[i];
+            (*this)[i] = 0;
+        }
+        if (!full) {
+            nsteps_++;
+        }
+
+        ring_next_ = (ring_next_ + 1) % window_;
+        if (ring_next_ == 0) {
+            // Sum the data in the window again once per cycle, to prevent
+            // rounding errors from accumulating in long runs
+            std::fill(averaged_.begin(), averaged_.end(), 0.0);
+            for (size_t step=0; step<nsteps_; step++) {
+                auto data = ring_.data() + step * size;
+                for (size_t i=0; i<size; i++) {
+                    averaged_[i] += data[i];
+                }
+            }
+        }
+    }
+
     /// Accumulating the averaged values
     std::vector<double> averaged_;
-    /// Number of time `step` was called
+    /// Number of steps in the average
     size_t nsteps_ = 0;
+    /// Number of steps in the averaging window, 0 to average over all steps
+    size_t window_ = 0;
+    /// Data for each step in the window, as a ring buffer
+    std::vector<double> ring_;
+    /// Index of the next step to replace in `ring_`
+    size_t ring_next_ = 0;
 };
 
+/// Combine multiple `histograms` with the same bins using the given
+/// `weights`, storing the weighted mean in `mean` and the weighted standard
+/// deviation between histograms in `spread`. Histograms with a zero weight are
+/// ignored. `mean` can be one of the `histograms`.
+inline void combine_histograms(const std::vector<const Histogram*>& histograms, const std::vector<double>& weights, Histogram& mean, Histogram& spread) {
+    assert(histograms.size() == weights.size());
+    auto total = std::accumulate(weights.begin(), weights.end(), 0.0);
+    spread = mean;
+    for (size_t i=0; i<mean.size(); i++) {
+        double sum = 0;
+        for (size_t r=0; r<histograms.size(); r++) {
+            if (weights[r] != 0) {
+                sum += weights[r] * (*histograms[r])[i];
+            }
+        }
+        auto value = total != 0 ? sum / total : 0.0;
+
+        double variance = 0;
+        for (size_t r=0; r<histograms.size(); r++) {
+            if (weights[r] != 0) {
+                auto delta = (*histograms[r])[i] - value;
+                variance += weights[r] * delta * delta;
+            }
+        }
+        mean[i] = value;
+        spread[i] = total != 0 ? std::sqrt(variance / total) : 0.0;
+    }
+}
+
 #endif
@@ -0,0 +1,73 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_BOUNDED_QUEUE_HPP
+#define CFILES_BOUNDED_QUEUE_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/// Thread-safe FIFO queue with a maximal size, used to pass values between
+/// the stages of a pipeline. Producers block while the queue is full and
+/// consumers block while it is empty.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity): capacity_(capacity) {}
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    /// Add `value` at the end of the queue, waiting for some space if the
+    /// queue is full. This returns `false` if the queue was closed, and the
+    /// value was not added.
+    bool push(T value) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this]() {
+            return values_.size() < capacity_ || closed_;
+        });
+        if (closed_) {
+            return false;
+        }
+        values_.push_back(std::move(value));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    /// Remove the first value of the queue and put it in `value`, waiting for
+    /// a value if the queue is empty. This returns `false` if the queue is
+    /// closed and empty.
+    bool pop(T& value) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this]() {
+            return !values_.empty() || closed_;
+        });
+        if (values_.empty()) {
+            return false;
+        }
+        value = std::move(values_.front());
+        values_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    /// Close the queue: all further calls to `push` fail, and `pop` returns
+    /// the remaining values and then fails.
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+private:
+    size_t capacity_;
+    bool closed_ = false;
+    std::deque<T> values_;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
+
+#endif
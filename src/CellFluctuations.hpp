@@ -0,0 +1,127 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_CELL_FLUCTUATIONS_HPP
+#define CFILES_CELL_FLUCTUATIONS_HPP
+
+#include <cstddef>
+
+#include <chemfiles.hpp>
+#include <Eigen/Dense>
+
+using Matrix6 = Eigen::Matrix<double, 6, 6>;
+using Vector6 = Eigen::Matrix<double, 6, 1>;
+
+/// Indexes of the cartesian components for each component in Voigt notation
+static const size_t CARTESIAN_TO_VOIGT[6][2] = {
+    {0, 0}, {1, 1}, {2, 2}, {1, 2}, {0, 2}, {0, 1},
+};
+
+/// Streaming accumulator for the fluctuations of the unit cell during a
+/// simulation.
+///
+/// The strain of a cell `h` relative to the reference `R` (the average of the
+/// inverse cells) is `ε = 1/2 (R^T G R - 1)` with `G = h^T h`. Since `ε` is
+/// linear in `G`, the covariance of the strain can be computed from the
+/// covariance of `G`, which does not depend on the reference. This allows to
+/// compute everything in a single pass over the cells, using Welford's
+/// algorithm for the covariance of the 6 independent components of `G`.
+class CellFluctuations {
+public:
+    /// Add a new `cell` matrix to the accumulator
+    void add(const chemfiles::Matrix3D& cell) {
+        auto inverse = cell.invert();
+        Vector6 metric;
+        for (size_t a=0; a<6; a++) {
+            auto i = CARTESIAN_TO_VOIGT[a][0];
+            auto j = CARTESIAN_TO_VOIGT[a][1];
+            metric(a) = cell[0][i] * cell[0][j] + cell[1][i] * cell[1][j] + cell[2][i] * cell[2][j];
+            inverse_sum_(i, j) += inverse[i][j];
+            if (i != j) {
+                inverse_sum_(j, i) += inverse[j][i];
+            }
+        }
+
+        count_ += 1;
+        Vector6 delta = metric - metric_mean_;
+        metric_mean_ += delta / static_cast<double>(count_);
+        metric_m2_ += delta * (metric - metric_mean_).transpose();
+    }
+
+    /// Merge the data from `other` in this accumulator
+    void merge(const CellFluctuations& other) {
+        if (other.count_ == 0) {
+            return;
+        }
+
+        auto count = count_ + other.count_;
+        auto weight = static_cast<double>(other.count_) / static_cast<double>(count);
+        Vector6 delta = other.metric_mean_ - metric_mean_;
+        metric_mean_ += weight * delta;
+        metric_m2_ += other.metric_m2_ + static_cast<double>(count_) * weight * delta * delta.transpose();
+        inverse_sum_ += other.inverse_sum_;
+        count_ = count;
+    }
+
+    /// Get the number of cells in this accumulator
+    size_t count() const {
+        return count_;
+    }
+
+    /// Compute the compliance matrix in Voigt notation, using the average
+    /// cell as the reference state, for a simulation at `temperature`.
+    Matrix6 compliance(double temperature) const {
+        Eigen::Matrix3d reference = inverse_sum_ / static_cast<double>(count_);
+
+        // Linear map from the components of G to the strain in Voigt
+        // notation, without the factor 1/2
+        Matrix6 map;
+        for (size_t p=0; p<6; p++) {
+            auto i = CARTESIAN_TO_VOIGT[p][0];
+            auto j = CARTESIAN_TO_VOIGT[p][1];
+            for (size_t q=0; q<6; q++) {
+                auto a = CARTESIAN_TO_VOIGT[q][0];
+                auto b = CARTESIAN_TO_VOIGT[q][1];
+                map(p, q) = reference(a, i) * reference(b, j);
+                if (a != b) {
+                    map(p, q) += reference(b, i) * reference(a, j);
+                }
+            }
+        }
+        Matrix6 covariance = 0.25 * map * (metric_m2_ / static_cast<double>(count_)) * map.transpose();
+
+        // in GPa A^2 / K
+        auto BOLTZMANN = 1.38065e-2;
+        auto volume_inv = reference.determinant();
+        auto v_kt = 1.0 / (volume_inv * BOLTZMANN * temperature);
+
+        Matrix6 compliance;
+        for (size_t p=0; p<6; p++) {
+            for (size_t q=0; q<6; q++) {
+                // Multiplicative factors for cross terms yz xz xy
+                double factor = 1.0;
+                if (p >= 3) {
+                    factor *= 2;
+                }
+                if (q >= 3) {
+                    factor *= 2;
+                }
+                compliance(p, q) = factor * v_kt * covariance(p, q);
+            }
+        }
+        return compliance;
+    }
+
+private:
+    /// Number of cells
+    size_t count_ = 0;
+    /// Sum of the inverse of the cell matrices
+    Eigen::Matrix3d inverse_sum_ = Eigen::Matrix3d::Zero();
+    /// Running average of the independent components of `G`
+    Vector6 metric_mean_ = Vector6::Zero();
+    /// Sum of the squared deviations from the average of the independent
+    /// components of `G`
+    Matrix6 metric_m2_ = Matrix6::Zero();
+};
+
+#endif
@@ -0,0 +1,74 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <cstring>
+
+#include "Checkpoint.hpp"
+#include "Errors.hpp"
+
+/// Magic bytes at the start of all checkpoints, including a format version
+static const char MAGIC[8] = {'C', 'F', 'C', 'K', 'P', 'T', '0', '2'};
+/// Value used to check that checkpoints were written with the same byte order
+static const uint64_t ENDIANNESS_CHECK = 0x0102030405060708;
+
+CheckpointWriter::CheckpointWriter(std::string path): file_(path, std::ios::binary) {
+    if (!file_.is_open()) {
+        throw CFilesError("Could not open the '" + path + "' file.");
+    }
+    file_.write(MAGIC, sizeof(MAGIC));
+    write(ENDIANNESS_CHECK);
+}
+
+void CheckpointWriter::write(uint64_t value) {
+    file_.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void CheckpointWriter::write(const std::vector<double>& values) {
+    write(static_cast<uint64_t>(values.size()));
+    file_.write(reinterpret_cast<const char*>(values.data()), static_cast<std::streamsize>(values.size() * sizeof(double)));
+}
+
+void CheckpointWriter::commit() {
+    file_.commit();
+}
+
+CheckpointReader::CheckpointReader(const std::string& path):
+    path_(path), file_(path, std::ios::in | std::ios::binary)
+{
+    if (!file_.is_open()) {
+        throw CFilesError("Could not open the '" + path_ + "' file.");
+    }
+    char magic[sizeof(MAGIC)];
+    read_bytes(magic, sizeof(magic));
+    if (std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+        throw CFilesError("'" + path_ + "' is not a cfiles checkpoint.");
+    }
+    if (read_u64() != ENDIANNESS_CHECK) {
+        throw CFilesError("the checkpoint at '" + path_ + "' was created on a different machine.");
+    }
+}
+
+uint64_t CheckpointReader::read_u64() {
+    uint64_t value = 0;
+    read_bytes(reinterpret_cast<char*>(&value), sizeof(value));
+    return value;
+}
+
+void CheckpointReader::read(std::vector<double>& values) {
+    auto size = read_u64();
+    if (size != values.size()) {
+        throw CFilesError(
+            "the checkpoint at '" + path_ + "' does not match the current " +
+            "options: expected " + std::to_string(values.size()) +
+            " values, got " + std::to_string(size)
+        );
+    }
+    read_bytes(reinterpret_cast<char*>(values.data()), values.size() * sizeof(double));
+}
+
+void CheckpointReader::read_bytes(char* data, size_t size) {
+    file_.read(data, static_cast<std::streamsize>(size));
+    if (static_cast<size_t>(file_.gcount()) != size) {
+        throw CFilesError("the checkpoint at '" + path_ + "' is truncated.");
+    }
+}
@@ -0,0 +1,62 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_CHECKPOINT_HPP
+#define CFILES_CHECKPOINT_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "AtomicFile.hpp"
+
+/// Write a binary checkpoint file, storing the state of a computation to be
+/// able to resume it later. The data is written to a temporary file, which
+/// replaces the checkpoint in `commit`; so that an interrupted write never
+/// leaves a corrupted checkpoint behind.
+///
+/// Checkpoints use the native byte order, and are not meant to be moved
+/// between different machines.
+class CheckpointWriter {
+public:
+    explicit CheckpointWriter(std::string path);
+
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+    /// Write a single integer `value`
+    void write(uint64_t value);
+    /// Write an array of `values`, together with its size
+    void write(const std::vector<double>& values);
+
+    /// Finish writing, and atomically replace the checkpoint file
+    void commit();
+
+private:
+    AtomicFile file_;
+};
+
+/// Read a checkpoint file created with `CheckpointWriter`. Data must be read
+/// in the same order it was written.
+class CheckpointReader {
+public:
+    explicit CheckpointReader(const std::string& path);
+
+    CheckpointReader(const CheckpointReader&) = delete;
+    CheckpointReader& operator=(const CheckpointReader&) = delete;
+
+    /// Read a single integer
+    uint64_t read_u64();
+    /// Read an array of values into `values`. The size of the array must
+    /// match the size of `values`.
+    void read(std::vector<double>& values);
+
+private:
+    void read_bytes(char* data, size_t size);
+
+    std::string path_;
+    std::ifstream file_;
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include "CommandFactory.hpp"
 
 #include "commands/Angles.hpp"
+#include "commands/Batch.hpp"
 #include "commands/Convert.hpp"
 #include "commands/Density.hpp"
 #include "commands/Elastic.hpp"
@@ -18,6 +19,7 @@
 const std::vector<command_creator>& all_commands() {
     static std::vector<command_creator> commands = {
         {"angles", [](){return std::unique_ptr<Command>(new Angles());}},
+        {"batch", [](){return std::unique_ptr<Command>(new Batch());}},
         {"convert", [](){return std::unique_ptr<Command>(new Convert());}},
         {"density", [](){return std::unique_ptr<Command>(new Density());}},
         {"elastic", [](){return std::unique_ptr<Command>(new Elastic());}},
@@ -0,0 +1,416 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+
+#ifdef CFILES_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef CFILES_HAVE_LZMA
+#include <lzma.h>
+#endif
+
+#include "Decompressor.hpp"
+#include "Errors.hpp"
+#include "MemoryMap.hpp"
+#include "parallel.hpp"
+
+/// Size of the decompressed chunks
+static const size_t CHUNK_SIZE = 4 * 1024 * 1024;
+/// Number of chunks in the ring buffer
+static const size_t RING_SIZE = 8;
+/// Number of bgzip blocks to decompress in parallel per thread
+static const size_t BLOCKS_PER_THREAD = 16;
+
+enum class Compression {
+    None,
+    Gzip,
+    Bgzf,
+    Xz,
+};
+
+static const unsigned char* bytes(const char* data) {
+    return reinterpret_cast<const unsigned char*>(data);
+}
+
+/// Read a little-endian unsigned integer of `size` bytes
+static uint32_t read_le(const unsigned char* data, size_t size) {
+    uint32_t value = 0;
+    for (size_t i=0; i<size; i++) {
+        value |= static_cast<uint32_t>(data[i]) << (8 * i);
+    }
+    return value;
+}
+
+/// Check if `data` starts with a bgzip block header, i.e. a gzip header with
+/// a 'BC' extra field containing the size of the block
+static bool is_bgzf_block(const unsigned char* data, size_t size) {
+    return size >= 18 && data[0] == 0x1f && data[1] == 0x8b && data[2] == 8 &&
+           (data[3] & 4) != 0 && data[12] == 'B' && data[13] == 'C' &&
+           data[14] == 2 && data[15] == 0;
+}
+
+/// Guess the compression method from the first bytes of a file
+static Compression compression(const unsigned char* data, size_t size) {
+    static const unsigned char XZ_MAGIC[] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+    if (is_bgzf_block(data, size)) {
+        return Compression::Bgzf;
+    } else if (size >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+        return Compression::Gzip;
+    } else if (size >= 6 && std::memcmp(data, XZ_MAGIC, 6) == 0) {
+        return Compression::Xz;
+    } else {
+        return Compression::None;
+    }
+}
+
+static bool supported(Compression compression) {
+    switch (compression) {
+    case Compression::Gzip:
+    case Compression::Bgzf:
+#ifdef CFILES_HAVE_ZLIB
+        return true;
+#else
+        return false;
+#endif
+    case Compression::Xz:
+#ifdef CFILES_HAVE_LZMA
+        return true;
+#else
+        return false;
+#endif
+    case Compression::None:
+        return false;
+    }
+    return false;
+}
+
+bool can_decompress(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    char header[18] = {0};
+    file.read(header, sizeof(header));
+    auto size = static_cast<size_t>(file.gcount());
+    return supported(compression(bytes(header), size));
+}
+
+#ifdef CFILES_HAVE_ZLIB
+/// Sequential decompression of gzip files, including files with multiple
+/// concatenated gzip members
+class GzipSource final: public Decompressor::Source {
+public:
+    explicit GzipSource(const std::string& path): file_(path) {
+        std::memset(&stream_, 0, sizeof(stream_));
+        // 15 + 32: maximal window size, and automatic gzip header detection
+        if (inflateInit2(&stream_, 15 + 32) != Z_OK) {
+            throw CFilesError("could not initialize zlib");
+        }
+    }
+
+    ~GzipSource() {
+        inflateEnd(&stream_);
+    }
+
+    bool fill(std::vector<char>& chunk) override {
+        chunk.resize(CHUNK_SIZE);
+        stream_.next_out = reinterpret_cast<Bytef*>(chunk.data());
+        stream_.avail_out = static_cast<uInt>(CHUNK_SIZE);
+
+        while (stream_.avail_out != 0 && !finished_) {
+            if (stream_.avail_in == 0) {
+                feed();
+            }
+
+            auto status = inflate(&stream_, Z_NO_FLUSH);
+            if (status == Z_STREAM_END) {
+                feed();
+                if (stream_.avail_in == 0) {
+                    finished_ = true;
+                } else {
+                    // start of the next gzip member
+                    inflateReset(&stream_);
+                }
+            } else if (status == Z_BUF_ERROR && stream_.avail_in == 0) {
+                throw CFilesError("unexpected end of gzip compressed file");
+            } else if (status != Z_OK && status != Z_BUF_ERROR) {
+                throw CFilesError(
+                    std::string("error while decompressing gzip data: ") +
+                    (stream_.msg != nullptr ? stream_.msg : "unknown error")
+                );
+            }
+        }
+
+        chunk.resize(CHUNK_SIZE - stream_.avail_out);
+        return !chunk.empty();
+    }
+
+private:
+    /// Give more compressed data to zlib, if there is any left
+    void feed() {
+        if (stream_.avail_in != 0) {
+            return;
+        }
+        // avail_in is an unsigned int, so we give at most 1 GiB at once
+        auto size = std::min(file_.size() - position_, static_cast<size_t>(1) << 30);
+        stream_.next_in = const_cast<Bytef*>(bytes(file_.data() + position_));
+        stream_.avail_in = static_cast<uInt>(size);
+        position_ += size;
+    }
+
+    MemoryMap file_;
+    size_t position_ = 0;
+    z_stream stream_;
+    bool finished_ = false;
+};
+
+/// Parallel decompression of bgzip files, made of independent gzip blocks
+/// with at most 64 KiB of data each
+class BgzfSource final: public Decompressor::Source {
+public:
+    explicit BgzfSource(const std::string& path): file_(path) {}
+
+    bool fill(std::vector<char>& chunk) override {
+        auto data = bytes(file_.data());
+        auto n_threads = default_threads();
+
+        // find the next blocks from their headers, without decompressing them
+        blocks_.clear();
+        size_t total_size = 0;
+        while (position_ < file_.size() && blocks_.size() < BLOCKS_PER_THREAD * n_threads) {
+            auto header = data + position_;
+            auto remaining = file_.size() - position_;
+            if (!is_bgzf_block(header, remaining)) {
+                throw CFilesError("invalid block header in bgzip compressed file");
+            }
+            auto extra_size = read_le(header + 10, 2);
+            auto block_size = static_cast<size_t>(read_le(header + 16, 2)) + 1;
+            if (block_size > remaining || block_size < 12 + extra_size + 8) {
+                throw CFilesError("unexpected end of bgzip compressed file");
+            }
+
+            auto block = block_t();
+            block.input = header + 12 + extra_size;
+            block.input_size = block_size - 12 - extra_size - 8;
+            block.crc = read_le(header + block_size - 8, 4);
+            block.output_size = read_le(header + block_size - 4, 4);
+            block.output = total_size;
+            total_size += block.output_size;
+            blocks_.push_back(block);
+
+            position_ += block_size;
+        }
+
+        chunk.resize(total_size);
+        parallel_for(blocks_.size(), [&](size_t i) {
+            decompress(blocks_[i], chunk.data() + blocks_[i].output);
+        }, n_threads);
+
+        return !blocks_.empty();
+    }
+
+private:
+    struct block_t {
+        /// Start of the raw deflate data
+        const unsigned char* input;
+        size_t input_size;
+        /// Offset of the decompressed data in the chunk
+        size_t output;
+        size_t output_size;
+        /// Expected CRC32 of the decompressed data
+        uint32_t crc;
+    };
+
+    static void decompress(const block_t& block, char* output) {
+        if (block.output_size == 0) {
+            // this is the empty block marking the end of the file
+            return;
+        }
+
+        z_stream stream;
+        std::memset(&stream, 0, sizeof(stream));
+        // negative window size: raw deflate data without header
+        if (inflateInit2(&stream, -15) != Z_OK) {
+            throw CFilesError("could not initialize zlib");
+        }
+        stream.next_in = const_cast<Bytef*>(block.input);
+        stream.avail_in = static_cast<uInt>(block.input_size);
+        stream.next_out = reinterpret_cast<Bytef*>(output);
+        stream.avail_out = static_cast<uInt>(block.output_size);
+        auto status = inflate(&stream, Z_FINISH);
+        auto produced = stream.total_out;
+        inflateEnd(&stream);
+
+        if (status != Z_STREAM_END || produced != block.output_size) {
+            throw CFilesError("error while decompressing bgzip block");
+        }
+        auto crc = crc32(0, reinterpret_cast<const Bytef*>(output), static_cast<uInt>(block.output_size));
+        if (crc != block.crc) {
+            throw CFilesError("invalid checksum in bgzip block");
+        }
+    }
+
+    MemoryMap file_;
+    size_t position_ = 0;
+    std::vector<block_t> blocks_;
+};
+#endif
+
+#ifdef CFILES_HAVE_LZMA
+/// Decompression of xz files. Files containing multiple blocks are
+/// decompressed in parallel when using liblzma 5.4 or later.
+class XzSource final: public Decompressor::Source {
+public:
+    explicit XzSource(const std::string& path): file_(path) {
+        stream_ = LZMA_STREAM_INIT;
+#if LZMA_VERSION >= 50040002
+        lzma_mt options;
+        std::memset(&options, 0, sizeof(options));
+        options.flags = LZMA_CONCATENATED;
+        options.threads = static_cast<uint32_t>(default_threads());
+        options.memlimit_threading = UINT64_MAX;
+        options.memlimit_stop = UINT64_MAX;
+        auto status = lzma_stream_decoder_mt(&stream_, &options);
+#else
+        auto status = lzma_stream_decoder(&stream_, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+        if (status != LZMA_OK) {
+            throw CFilesError("could not initialize lzma decoder");
+        }
+        stream_.next_in = bytes(file_.data());
+        stream_.avail_in = file_.size();
+    }
+
+    ~XzSource() {
+        lzma_end(&stream_);
+    }
+
+    bool fill(std::vector<char>& chunk) override {
+        chunk.resize(CHUNK_SIZE);
+        stream_.next_out = reinterpret_cast<uint8_t*>(chunk.data());
+        stream_.avail_out = CHUNK_SIZE;
+
+        while (stream_.avail_out != 0 && !finished_) {
+            // all the input is already available
+            auto status = lzma_code(&stream_, LZMA_FINISH);
+            if (status == LZMA_STREAM_END) {
+                finished_ = true;
+            } else if (status == LZMA_BUF_ERROR) {
+                throw CFilesError("unexpected end of xz compressed file");
+            } else if (status != LZMA_OK) {
+                throw CFilesError("error while decompressing xz data (lzma error " + std::to_string(status) + ")");
+            }
+        }
+
+        chunk.resize(CHUNK_SIZE - stream_.avail_out);
+        return !chunk.empty();
+    }
+
+private:
+    MemoryMap file_;
+    lzma_stream stream_;
+    bool finished_ = false;
+};
+#endif
+
+static std::unique_ptr<Decompressor::Source> open_source(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw CFilesError("Could not open the '" + path + "' file.");
+    }
+    char header[18] = {0};
+    file.read(header, sizeof(header));
+    auto kind = compression(bytes(header), static_cast<size_t>(file.gcount()));
+
+    switch (kind) {
+#ifdef CFILES_HAVE_ZLIB
+    case Compression::Gzip:
+        return std::unique_ptr<Decompressor::Source>(new GzipSource(path));
+    case Compression::Bgzf:
+        return std::unique_ptr<Decompressor::Source>(new BgzfSource(path));
+#endif
+#ifdef CFILES_HAVE_LZMA
+    case Compression::Xz:
+        return std::unique_ptr<Decompressor::Source>(new XzSource(path));
+#endif
+    default:
+        throw CFilesError("unsupported compression method for '" + path + "'");
+    }
+}
+
+Decompressor::Decompressor(const std::string& path):
+    source_(open_source(path)),
+    chunks_(RING_SIZE)
+{
+    thread_ = std::thread(&Decompressor::run, this);
+}
+
+Decompressor::~Decompressor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    not_full_.notify_one();
+    thread_.join();
+}
+
+void Decompressor::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    try {
+        while (true) {
+            not_full_.wait(lock, [this]() {
+                return filled_ < chunks_.size() || stop_;
+            });
+            if (stop_) {
+                break;
+            }
+
+            // the chunk at head_ is not visible to the consumer until
+            // filled_ is updated, so it can be filled without the lock
+            auto& chunk = chunks_[head_];
+            lock.unlock();
+            auto more = source_->fill(chunk);
+            lock.lock();
+
+            if (!more) {
+                break;
+            }
+            head_ = (head_ + 1) % chunks_.size();
+            filled_++;
+            not_empty_.notify_one();
+        }
+    } catch (...) {
+        if (!lock.owns_lock()) {
+            lock.lock();
+        }
+        error_ = std::current_exception();
+    }
+    done_ = true;
+    not_empty_.notify_one();
+}
+
+bool Decompressor::read(std::vector<char>& output) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this]() {
+        return filled_ != 0 || done_;
+    });
+
+    if (filled_ == 0) {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        return false;
+    }
+
+    auto& chunk = chunks_[tail_];
+    lock.unlock();
+    output.insert(output.end(), chunk.begin(), chunk.end());
+    lock.lock();
+
+    tail_ = (tail_ + 1) % chunks_.size();
+    filled_--;
+    not_full_.notify_one();
+    return true;
+}
@@ -0,0 +1,75 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_DECOMPRESSOR_HPP
+#define CFILES_DECOMPRESSOR_HPP
+
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Check if the file at `path` is compressed with a compression method
+/// supported by `Decompressor` in this build of cfiles
+bool can_decompress(const std::string& path);
+
+/// Decompress a gzip or xz file in a background thread. The decompressed data
+/// is written in a ring of fixed-size chunks, which are handed out to the
+/// consumer in order and then given back to the decompression thread.
+///
+/// Files made of independent gzip blocks (as created by bgzip) are
+/// decompressed in parallel, as well as multi-block xz files when supported by
+/// liblzma.
+class Decompressor {
+public:
+    /// Start decompressing the file at `path`
+    explicit Decompressor(const std::string& path);
+    ~Decompressor();
+
+    Decompressor(const Decompressor&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+
+    /// Append the next chunk of decompressed data to `output`. This returns
+    /// `false` when all the data has been read. Errors in the decompression
+    /// thread are re-thrown here.
+    bool read(std::vector<char>& output);
+
+    /// Source of compressed data, producing decompressed chunks
+    class Source {
+    public:
+        virtual ~Source() = default;
+        /// Replace the content of `chunk` with the next decompressed data.
+        /// This returns `false` once all the data has been decompressed.
+        virtual bool fill(std::vector<char>& chunk) = 0;
+    };
+
+private:
+    /// Main function of the decompression thread
+    void run();
+
+    std::unique_ptr<Source> source_;
+    /// Ring of decompressed chunks
+    std::vector<std::vector<char>> chunks_;
+    /// Index of the next chunk to be filled by the decompression thread
+    size_t head_ = 0;
+    /// Index of the next chunk to be read by the consumer
+    size_t tail_ = 0;
+    /// Number of filled chunks not yet read
+    size_t filled_ = 0;
+    /// Did the decompression thread finish?
+    bool done_ = false;
+    /// Should the decompression thread stop early?
+    bool stop_ = false;
+    /// Error in the decompression thread, if any
+    std::exception_ptr error_;
+
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::thread thread_;
+};
+
+#endif
@@ -4,12 +4,14 @@
 #ifndef CFILES_HISTOGRAM_HPP
 #define CFILES_HISTOGRAM_HPP
 
+#include <algorithm>
+#include <cassert>
 #include <vector>
 #include <cmath>
 #include <numeric>
-#include <functional>
 
 #include <fmt/format.h>
+#include "Timings.hpp"
 #include "warnings.hpp"
 
 /// Histogram class
@@ -90,6 +92,7 @@ public:
         auto bin1 = std::floor((x - first_.start) / first_.width);
         auto bin2 = std::floor((y - second_.start) / second_.width);
         if (bin1 >= first_.nbins or bin1 < 0) {
+            Timings::count(Counter::OutOfRange);
             warn_once(fmt::format(
                 "point {} is out of histogram boundaries ({}:{})",
                 x, first_.start, first_.stop()
@@ -97,6 +100,7 @@ public:
             return;
         }
         if (bin2 >= second_.nbins or bin2 < 0) {
+            Timings::count(Counter::OutOfRange);
             warn_once(fmt::format(
                 "point {} is out of histogram boundaries ({}:{})",
                 y, second_.start, second_.stop()
@@ -106,10 +110,25 @@ public:
         data_[bin2 + bin1 * second_.nbins] += 1;
     }
 
+    /// Set all the values in this histogram to zero
+    void clear() {
+        std::fill(data_.begin(), data_.end(), 0.0);
+    }
+
+    /// Add the values from `other` to this histogram. Both histograms must
+    /// have the same dimensions.
+    void add(const Histogram& other) {
+        assert(other.size() == this->size());
+        for (size_t i = 0; i < this->size(); i++){
+            data_[i] += other.data_[i];
+        }
+    }
+
     /// Normalize the data with a `function` callback, which will be called for
     /// each value. The function should take two arguments being the current
     /// bin index and the data, and return the new data.
-    void normalize(std::function<double(size_t, double)> function) {
+    template <typename Function>
+    void normalize(Function function) {
         for (size_t i = 0; i < this->size(); i++){
             data_[i] = function(i, data_[i]);
         }
@@ -0,0 +1,67 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <fstream>
+#include <iterator>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "MemoryMap.hpp"
+#include "Errors.hpp"
+
+#ifndef _WIN32
+MemoryMap::MemoryMap(const std::string& path) {
+    auto fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw CFilesError("Could not open the '" + path + "' file.");
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+        close(fd);
+        throw CFilesError("Could not get the size of the '" + path + "' file.");
+    }
+
+    size_ = static_cast<size_t>(status.st_size);
+    inode_ = static_cast<uint64_t>(status.st_ino);
+#ifdef __APPLE__
+    auto& mtime = status.st_mtimespec;
+#else
+    auto& mtime = status.st_mtim;
+#endif
+    modification_time_ = static_cast<uint64_t>(mtime.tv_sec) * 1000000000 + static_cast<uint64_t>(mtime.tv_nsec);
+
+    if (size_ != 0) {
+        auto data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            throw CFilesError("Could not memory-map the '" + path + "' file.");
+        }
+        data_ = static_cast<const char*>(data);
+    }
+    close(fd);
+}
+
+MemoryMap::~MemoryMap() {
+    if (data_ != nullptr && buffer_.empty()) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+}
+#else
+MemoryMap::MemoryMap(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw CFilesError("Could not open the '" + path + "' file.");
+    }
+    buffer_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+}
+
+MemoryMap::~MemoryMap() {}
+#endif
@@ -0,0 +1,39 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_MEMORY_MAP_HPP
+#define CFILES_MEMORY_MAP_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// Read-only memory map of a whole file
+class MemoryMap {
+public:
+    explicit MemoryMap(const std::string& path);
+    ~MemoryMap();
+
+    MemoryMap(const MemoryMap&) = delete;
+    MemoryMap& operator=(const MemoryMap&) = delete;
+
+    /// Get a pointer to the start of the file content
+    const char* data() const {return data_;}
+    /// Get the size of the file, in bytes
+    size_t size() const {return size_;}
+    /// Get the last modification time of the file, in nanoseconds since the
+    /// epoch, or 0 if it is not available
+    uint64_t modification_time() const {return modification_time_;}
+    /// Get the inode number of the file, or 0 if it is not available
+    uint64_t inode() const {return inode_;}
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    uint64_t modification_time_ = 0;
+    uint64_t inode_ = 0;
+    /// Used instead of the memory map on systems without mmap
+    std::vector<char> buffer_;
+};
+
+#endif
@@ -0,0 +1,277 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+
+#include "NeighborList.hpp"
+#include "Timings.hpp"
+#include "parallel.hpp"
+
+using namespace chemfiles;
+
+/// Minimal number of atoms for each thread when building the list
+static const size_t MIN_ATOMS_PER_THREAD = 4096;
+
+NeighborList::NeighborList(double cutoff, double skin): cutoff_(cutoff), skin_(skin) {}
+
+bool NeighborList::update(const Frame& frame, const std::vector<size_t>& atoms, size_t n_threads) {
+    if (!needs_rebuild(frame, atoms)) {
+        return false;
+    }
+    build(frame, atoms, n_threads);
+    rebuilds_ += 1;
+    Timings::count(Counter::NeighborsRebuilds);
+    return true;
+}
+
+bool NeighborList::needs_rebuild(const Frame& frame, const std::vector<size_t>& atoms) const {
+    if (!built_ || frame.size() != natoms_ || frame.cell() != cell_ || atoms != atoms_) {
+        return true;
+    }
+
+    auto& cell = frame.cell();
+    auto& positions = frame.positions();
+    auto max_displacement = current_skin_ / 2;
+    for (size_t k=0; k<atoms_.size(); k++) {
+        auto displacement = cell.wrap(positions[atoms_[k]] - reference_[k]);
+        if (displacement.norm2() > max_displacement * max_displacement) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void NeighborList::build(const Frame& frame, const std::vector<size_t>& atoms, size_t n_threads) {
+    assert(std::is_sorted(atoms.begin(), atoms.end()));
+    auto& cell = frame.cell();
+    auto& positions = frame.positions();
+
+    built_ = true;
+    natoms_ = frame.size();
+    atoms_ = atoms;
+    cell_ = cell;
+    reference_.clear();
+    for (auto i: atoms_) {
+        reference_.push_back(positions[i]);
+    }
+
+    // Compute the grid coordinates of all atoms in [0, 1)^3. For periodic
+    // cells, these are the wrapped fractional coordinates, and otherwise the
+    // coordinates in the bounding box of the atoms.
+    periodic_ = cell.shape() != UnitCell::INFINITE;
+    auto coordinates = std::vector<Vector3D>();
+    coordinates.reserve(atoms_.size());
+    auto widths = Vector3D();
+    current_skin_ = skin_;
+    if (periodic_) {
+        auto matrix = cell.matrix();
+        auto a = Vector3D(matrix[0][0], matrix[1][0], matrix[2][0]);
+        auto b = Vector3D(matrix[0][1], matrix[1][1], matrix[2][1]);
+        auto c = Vector3D(matrix[0][2], matrix[1][2], matrix[2][2]);
+        auto volume = std::abs(dot(a, cross(b, c)));
+        widths = Vector3D(
+            volume / cross(b, c).norm(),
+            volume / cross(c, a).norm(),
+            volume / cross(a, b).norm()
+        );
+
+        // The minimum image convention only gives all the pairs if the list
+        // radius is smaller than half of the cell width. Reduce the skin if
+        // this is not the case, or include all pairs in the list if even the
+        // cutoff is too large.
+        auto half_width = std::min(widths[0], std::min(widths[1], widths[2])) / 2;
+        if (cutoff_ >= half_width) {
+            current_skin_ = std::numeric_limits<double>::infinity();
+        } else if (cutoff_ + skin_ > half_width) {
+            current_skin_ = half_width - cutoff_;
+        }
+
+        auto inverse = matrix.invert();
+        for (auto i: atoms_) {
+            auto fractional = inverse * positions[i];
+            for (size_t k=0; k<3; k++) {
+                fractional[k] -= std::floor(fractional[k]);
+            }
+            coordinates.push_back(fractional);
+        }
+    } else {
+        auto min = Vector3D(HUGE_VAL, HUGE_VAL, HUGE_VAL);
+        auto max = Vector3D(-HUGE_VAL, -HUGE_VAL, -HUGE_VAL);
+        for (auto i: atoms_) {
+            for (size_t k=0; k<3; k++) {
+                min[k] = std::min(min[k], positions[i][k]);
+                max[k] = std::max(max[k], positions[i][k]);
+            }
+        }
+        for (size_t k=0; k<3; k++) {
+            widths[k] = atoms_.empty() ? 0 : max[k] - min[k];
+        }
+        for (auto i: atoms_) {
+            auto scaled = Vector3D();
+            for (size_t k=0; k<3; k++) {
+                scaled[k] = widths[k] > 0 ? (positions[i][k] - min[k]) / widths[k] : 0;
+            }
+            coordinates.push_back(scaled);
+        }
+    }
+
+    all_pairs_ = std::isinf(current_skin_);
+    auto radius = cutoff_ + current_skin_;
+
+    // Use grid cells larger than the list radius, so that all the neighbors
+    // of an atom are in the 27 cells around it. The number of cells is
+    // limited to about twice the number of atoms.
+    auto& n_cells = n_cells_;
+    n_cells = {{1, 1, 1}};
+    if (!all_pairs_ && radius > 0) {
+        double total = 1;
+        for (size_t k=0; k<3; k++) {
+            n_cells[k] = std::max(static_cast<size_t>(std::floor(widths[k] / radius)), static_cast<size_t>(1));
+            total *= static_cast<double>(n_cells[k]);
+        }
+        auto max_cells = 2.0 * static_cast<double>(atoms_.size()) + 1.0;
+        if (total > max_cells) {
+            auto factor = std::cbrt(max_cells / total);
+            for (size_t k=0; k<3; k++) {
+                auto scaled = std::floor(static_cast<double>(n_cells[k]) * factor);
+                n_cells[k] = std::max(static_cast<size_t>(scaled), static_cast<size_t>(1));
+            }
+        }
+    }
+
+    // Sort the atoms by grid cell
+    auto cell_index = [&n_cells](size_t a, size_t b, size_t c) {
+        return (a * n_cells[1] + b) * n_cells[2] + c;
+    };
+    auto grid_size = n_cells[0] * n_cells[1] * n_cells[2];
+    atoms_cell_.resize(atoms_.size());
+    grid_start_.assign(grid_size + 1, 0);
+    for (size_t k=0; k<atoms_.size(); k++) {
+        size_t index[3];
+        for (size_t d=0; d<3; d++) {
+            auto scaled = static_cast<size_t>(coordinates[k][d] * static_cast<double>(n_cells[d]));
+            index[d] = std::min(scaled, n_cells[d] - 1);
+        }
+        atoms_cell_[k] = cell_index(index[0], index[1], index[2]);
+        grid_start_[atoms_cell_[k] + 1] += 1;
+    }
+    for (size_t c=0; c<grid_size; c++) {
+        grid_start_[c + 1] += grid_start_[c];
+    }
+    grid_atoms_.resize(atoms_.size());
+    {
+        auto position = std::vector<size_t>(grid_start_.begin(), grid_start_.end() - 1);
+        for (size_t k=0; k<atoms_.size(); k++) {
+            grid_atoms_[position[atoms_cell_[k]]++] = k;
+        }
+    }
+
+    // Find the neighbors of all atoms, splitting the atoms between threads
+    // for large systems
+    n_threads = std::min(n_threads, atoms_.size() / MIN_ATOMS_PER_THREAD);
+    counts_.resize(atoms_.size());
+    neighbors_.clear();
+    if (n_threads <= 1) {
+        find_neighbors(frame, 0, atoms_.size(), neighbors_);
+    } else {
+        chunks_.resize(n_threads);
+        auto chunk_size = (atoms_.size() + n_threads - 1) / n_threads;
+        parallel_for(n_threads, [&](size_t chunk) {
+            auto begin = std::min(chunk * chunk_size, atoms_.size());
+            auto end = std::min(begin + chunk_size, atoms_.size());
+            chunks_[chunk].clear();
+            find_neighbors(frame, begin, end, chunks_[chunk]);
+        }, n_threads);
+        for (auto& chunk: chunks_) {
+            neighbors_.insert(neighbors_.end(), chunk.begin(), chunk.end());
+        }
+    }
+
+    offsets_.assign(natoms_ + 1, 0);
+    for (size_t k=0; k<atoms_.size(); k++) {
+        offsets_[atoms_[k] + 1] = counts_[k];
+    }
+    for (size_t i=0; i<natoms_; i++) {
+        offsets_[i + 1] += offsets_[i];
+    }
+}
+
+void NeighborList::find_neighbors(const Frame& frame, size_t begin, size_t end, std::vector<size_t>& neighbors) {
+    auto& cell = frame.cell();
+    auto& positions = frame.positions();
+    auto radius = cutoff_ + current_skin_;
+    auto& n_cells = n_cells_;
+    auto cell_index = [&n_cells](size_t a, size_t b, size_t c) {
+        return (a * n_cells[1] + b) * n_cells[2] + c;
+    };
+
+    auto neighbor_cells = std::vector<size_t>();
+    for (size_t k=begin; k<end; k++) {
+        auto i = atoms_[k];
+        auto start = neighbors.size();
+        if (all_pairs_) {
+            for (auto j: atoms_) {
+                if (j != i) {
+                    neighbors.push_back(j);
+                }
+            }
+            counts_[k] = neighbors.size() - start;
+            continue;
+        }
+
+        // Get the unique cells around the current one. They can appear
+        // multiple times if there are less than 3 cells in a direction.
+        auto current = atoms_cell_[k];
+        size_t index[3] = {
+            current / (n_cells[1] * n_cells[2]),
+            (current / n_cells[2]) % n_cells[1],
+            current % n_cells[2],
+        };
+        neighbor_cells.clear();
+        for (int da=-1; da<=1; da++) {
+            for (int db=-1; db<=1; db++) {
+                for (int dc=-1; dc<=1; dc++) {
+                    int delta[3] = {da, db, dc};
+                    size_t neighbor[3];
+                    bool inside = true;
+                    for (size_t d=0; d<3; d++) {
+                        auto value = static_cast<long>(index[d]) + delta[d];
+                        auto size = static_cast<long>(n_cells[d]);
+                        if (periodic_) {
+                            value = (value + size) % size;
+                        } else if (value < 0 || value >= size) {
+                            inside = false;
+                        }
+                        neighbor[d] = static_cast<size_t>(value);
+                    }
+                    if (inside) {
+                        neighbor_cells.push_back(cell_index(neighbor[0], neighbor[1], neighbor[2]));
+                    }
+                }
+            }
+        }
+        std::sort(neighbor_cells.begin(), neighbor_cells.end());
+        neighbor_cells.erase(std::unique(neighbor_cells.begin(), neighbor_cells.end()), neighbor_cells.end());
+
+        for (auto c: neighbor_cells) {
+            for (auto position=grid_start_[c]; position<grid_start_[c + 1]; position++) {
+                auto j = atoms_[grid_atoms_[position]];
+                if (j == i) {
+                    continue;
+                }
+                auto rij = positions[j] - positions[i];
+                if (periodic_) {
+                    rij = cell.wrap(rij);
+                }
+                if (rij.norm2() < radius * radius) {
+                    neighbors.push_back(j);
+                }
+            }
+        }
+        std::sort(neighbors.begin() + static_cast<std::ptrdiff_t>(start), neighbors.end());
+        counts_[k] = neighbors.size() - start;
+    }
+}
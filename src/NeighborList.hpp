@@ -0,0 +1,115 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_NEIGHBOR_LIST_HPP
+#define CFILES_NEIGHBOR_LIST_HPP
+
+#include <array>
+#include <cassert>
+#include <vector>
+
+#include <chemfiles.hpp>
+
+/// Verlet neighbor list, storing all the pairs of atoms closer than
+/// `cutoff + skin`. Pairs are found using a grid of cells larger than
+/// `cutoff + skin`, and the list is only rebuilt when an atom moved by more
+/// than half of the skin since the last build, or when the atoms or the unit
+/// cell changed.
+///
+/// All the pairs closer than `cutoff` are always in the list, but the list
+/// can also contain pairs further apart: users must still check the
+/// distances.
+class NeighborList {
+public:
+    /// Neighbors of a single atom, as a range of atomic indexes
+    class Neighbors {
+    public:
+        Neighbors(const size_t* begin, const size_t* end): begin_(begin), end_(end) {}
+
+        const size_t* begin() const {return begin_;}
+        const size_t* end() const {return end_;}
+        size_t size() const {return static_cast<size_t>(end_ - begin_);}
+
+    private:
+        const size_t* begin_;
+        const size_t* end_;
+    };
+
+    /// Create a neighbor list for pairs of atoms closer than `cutoff`, using
+    /// the given `skin`. Both values are in angstroms.
+    explicit NeighborList(double cutoff = 0, double skin = 1.0);
+
+    /// Update the list for the atoms at the given indexes in `frame`,
+    /// rebuilding it if needed with up to `n_threads` threads. `atoms` must
+    /// be sorted and contain unique indexes. This returns `true` if the list
+    /// was rebuilt.
+    bool update(const chemfiles::Frame& frame, const std::vector<size_t>& atoms, size_t n_threads = 1);
+
+    /// Get the neighbors of the atom at index `atom` in the frame, sorted by
+    /// increasing index. Atoms which were not part of the `atoms` in the last
+    /// call to `update` have no neighbors.
+    Neighbors neighbors(size_t atom) const {
+        assert(atom + 1 < offsets_.size());
+        return {neighbors_.data() + offsets_[atom], neighbors_.data() + offsets_[atom + 1]};
+    }
+
+    /// Get the number of times the list was built
+    size_t rebuilds() const {
+        return rebuilds_;
+    }
+
+private:
+    /// Check if the list needs to be rebuilt for the `atoms` in `frame`
+    bool needs_rebuild(const chemfiles::Frame& frame, const std::vector<size_t>& atoms) const;
+    /// Build the list from scratch for the `atoms` in `frame`
+    void build(const chemfiles::Frame& frame, const std::vector<size_t>& atoms, size_t n_threads);
+    /// Find the neighbors of the atoms from `atoms_[begin]` to `atoms_[end]`
+    /// in the grid, adding them to `neighbors` and setting `counts_`
+    void find_neighbors(const chemfiles::Frame& frame, size_t begin, size_t end, std::vector<size_t>& neighbors);
+
+    /// Cutoff distance
+    double cutoff_;
+    /// Requested skin distance
+    double skin_;
+    /// Skin used for the current list, which can be smaller than the
+    /// requested skin for small unit cells
+    double current_skin_ = 0;
+
+    /// Has the list been built at least once?
+    bool built_ = false;
+    /// Number of atoms in the frame at the last build
+    size_t natoms_ = 0;
+    /// Atoms in the list at the last build
+    std::vector<size_t> atoms_;
+    /// Positions of the atoms at the last build, in the same order as `atoms_`
+    std::vector<chemfiles::Vector3D> reference_;
+    /// Unit cell at the last build
+    chemfiles::UnitCell cell_;
+
+    /// Neighbors of the atom `i` are in `neighbors_[offsets_[i]]` to
+    /// `neighbors_[offsets_[i + 1]]`
+    std::vector<size_t> offsets_;
+    std::vector<size_t> neighbors_;
+
+    /// Scratch buffers for the cell grid, kept around to re-use the memory.
+    /// The atoms in the grid cell `c` are `grid_atoms_[grid_start_[c]]` to
+    /// `grid_atoms_[grid_start_[c + 1]]`, as indexes in `atoms_`.
+    std::vector<size_t> grid_start_;
+    std::vector<size_t> grid_atoms_;
+    std::vector<size_t> atoms_cell_;
+    /// Number of grid cells in each direction
+    std::array<size_t, 3> n_cells_ = {{1, 1, 1}};
+    /// Is the grid periodic?
+    bool periodic_ = false;
+    /// Are all the pairs in the list, without using the grid?
+    bool all_pairs_ = false;
+    /// Number of neighbors of each atom in `atoms_`
+    std::vector<size_t> counts_;
+    /// Neighbors found by each thread when building the list in parallel
+    std::vector<std::vector<size_t>> chunks_;
+
+    /// Number of builds of the list
+    size_t rebuilds_ = 0;
+};
+
+#endif
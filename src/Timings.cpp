@@ -0,0 +1,111 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <algorithm>
+#include <atomic>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+#include "Timings.hpp"
+
+static constexpr size_t N_PHASES = 6;
+static constexpr size_t N_COUNTERS = 4;
+
+static const char* PHASE_NAMES[N_PHASES] = {
+    "read", "select", "accumulate", "step/normalize", "correlate", "write",
+};
+
+const char* phase_name(Phase phase) {
+    return PHASE_NAMES[static_cast<size_t>(phase)];
+}
+
+static const char* COUNTER_NAMES[N_COUNTERS] = {
+    "frames", "pairs evaluated", "out-of-range histogram points",
+    "neighbor list rebuilds",
+};
+
+// Durations are stored in nanoseconds, and all values are updated atomically
+// to allow using timers from multiple threads
+static std::atomic<uint64_t> PHASES[N_PHASES];
+static std::atomic<uint64_t> COUNTERS[N_COUNTERS];
+static std::chrono::steady_clock::time_point START;
+
+/// Innermost running timer for the current thread
+static thread_local ScopedTimer* CURRENT_TIMER = nullptr;
+
+bool Timings::enabled_ = false;
+
+void Timings::enable() {
+    // This can be called multiple times in a run (for each replica, or for
+    // the pilot run of --auto-stride), but timings must always start with the
+    // first call
+    if (!enabled_) {
+        enabled_ = true;
+        START = std::chrono::steady_clock::now();
+    }
+}
+
+void Timings::add(Phase phase, std::chrono::nanoseconds duration) {
+    PHASES[static_cast<size_t>(phase)].fetch_add(
+        static_cast<uint64_t>(duration.count()), std::memory_order_relaxed
+    );
+}
+
+void Timings::count_slow(Counter counter, uint64_t value) {
+    COUNTERS[static_cast<size_t>(counter)].fetch_add(value, std::memory_order_relaxed);
+}
+
+void Timings::print(std::ostream& output) {
+    auto total = std::chrono::duration<double>(std::chrono::steady_clock::now() - START).count();
+    auto frames = COUNTERS[static_cast<size_t>(Counter::Frames)].load();
+
+    fmt::print(output, "[cfiles] {} frames in {:.3f} s", frames, total);
+    if (total > 0) {
+        fmt::print(output, " ({:.1f} frames/s)", static_cast<double>(frames) / total);
+    }
+    fmt::print(output, "\n");
+
+    fmt::print(output, "    {:<32}{:>12}{:>8}\n", "phase", "time (s)", "%");
+    double measured = 0;
+    for (size_t i=0; i<N_PHASES; i++) {
+        auto time = static_cast<double>(PHASES[i].load()) * 1e-9;
+        measured += time;
+        if (time == 0) {
+            continue;
+        }
+        fmt::print(output, "    {:<32}{:>12.3f}{:>8.1f}\n", PHASE_NAMES[i], time, 100 * time / total);
+    }
+    auto other = std::max(total - measured, 0.0);
+    fmt::print(output, "    {:<32}{:>12.3f}{:>8.1f}\n", "other", other, 100 * other / total);
+
+    fmt::print(output, "    {:<32}{:>12}\n", "counter", "value");
+    for (size_t i=0; i<N_COUNTERS; i++) {
+        fmt::print(output, "    {:<32}{:>12}\n", COUNTER_NAMES[i], COUNTERS[i].load());
+    }
+}
+
+void ScopedTimer::start(size_t step) {
+    running_ = true;
+    parent_ = CURRENT_TIMER;
+    CURRENT_TIMER = this;
+    if (Trace::enabled()) {
+        Trace::begin(phase_name(phase_), step);
+    }
+    start_ = clock::now();
+}
+
+void ScopedTimer::stop() {
+    auto elapsed = clock::now() - start_;
+    if (Trace::enabled()) {
+        Trace::end(phase_name(phase_));
+    }
+    if (Timings::enabled()) {
+        Timings::add(phase_, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed - nested_));
+    }
+    if (parent_ != nullptr) {
+        parent_->nested_ += elapsed;
+    }
+    CURRENT_TIMER = parent_;
+    running_ = false;
+}
@@ -0,0 +1,119 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_TIMINGS_HPP
+#define CFILES_TIMINGS_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+#include "Trace.hpp"
+
+/// The different phases of a command run. Time spent in each phase is
+/// accumulated separately when timings are enabled.
+enum class Phase {
+    /// Reading frames from the trajectory
+    Read,
+    /// Evaluating selections
+    Select,
+    /// Running the analysis kernel on a frame
+    Accumulate,
+    /// Storing and normalizing per-frame data
+    Normalize,
+    /// Computing correlations, usually with FFT
+    Correlate,
+    /// Writing results and output trajectories
+    Write,
+};
+
+/// Get the name of a `phase`, as used in the timings summary and traces
+const char* phase_name(Phase phase);
+
+/// Counters for some interesting events during a run
+enum class Counter {
+    /// Number of frames used
+    Frames,
+    /// Number of pairs for which a distance was computed
+    Pairs,
+    /// Number of points which fell outside of an histogram
+    OutOfRange,
+    /// Number of times a neighbor list was built
+    NeighborsRebuilds,
+};
+
+/// Global collection of timings and counters for the current run. Everything
+/// is disabled by default, and the only cost in this case is checking a
+/// boolean flag.
+class Timings {
+public:
+    /// Start collecting timings. Calling this function again after the first
+    /// call does nothing.
+    static void enable();
+    /// Are timings currently being collected?
+    static bool enabled() {
+        return enabled_;
+    }
+
+    /// Add `duration` to the time spent in `phase`
+    static void add(Phase phase, std::chrono::nanoseconds duration);
+
+    /// Increase the value of the `counter` by `value`
+    static void count(Counter counter, uint64_t value = 1) {
+        if (enabled_) {
+            count_slow(counter, value);
+        }
+    }
+
+    /// Print a summary table of the timings and counters to `output`
+    static void print(std::ostream& output);
+
+private:
+    static void count_slow(Counter counter, uint64_t value);
+    static bool enabled_;
+};
+
+/// RAII timer, adding the time spent between construction and destruction to
+/// a given phase. Nested timers are exclusive: time spent in an inner timer is
+/// not counted for the outer one. When tracing is enabled, this also records
+/// begin and end events for the phase, associated with the given `step`.
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Phase phase, size_t step = Trace::NO_STEP);
+    ~ScopedTimer();
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    void start(size_t step);
+    void stop();
+
+    /// Phase for this timer
+    Phase phase_;
+    /// Is this timer running? This is false when both timings and tracing
+    /// are disabled
+    bool running_ = false;
+    /// Time at which the timer started
+    clock::time_point start_;
+    /// Time spent in nested timers
+    clock::duration nested_ = clock::duration::zero();
+    /// Enclosing timer on the same thread, if any
+    ScopedTimer* parent_ = nullptr;
+};
+
+inline ScopedTimer::ScopedTimer(Phase phase, size_t step): phase_(phase) {
+    if (Timings::enabled() || Trace::enabled()) {
+        start(step);
+    }
+}
+
+inline ScopedTimer::~ScopedTimer() {
+    if (running_) {
+        stop();
+    }
+}
+
+#endif
@@ -0,0 +1,116 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+#include "Trace.hpp"
+#include "Errors.hpp"
+
+namespace {
+    using clock = std::chrono::steady_clock;
+
+    struct event {
+        /// Event name, with static lifetime
+        const char* name;
+        /// 'B' for begin events and 'E' for end events
+        char kind;
+        /// Time since the start of the trace
+        clock::duration time;
+        /// Step associated with the event, or Trace::NO_STEP
+        size_t step;
+    };
+
+    /// Events recorded by a single thread
+    struct thread_buffer {
+        explicit thread_buffer(size_t id): id(id) {
+            // Pre-allocate enough space for a reasonable number of events
+            events.reserve(1 << 14);
+        }
+
+        size_t id;
+        std::vector<event> events;
+    };
+}
+
+static std::string OUTPUT_PATH;
+static clock::time_point START;
+
+// All the thread buffers ever created. The buffers are owned here so that
+// they are still available after the threads are finished.
+static std::mutex BUFFERS_MUTEX;
+static std::vector<std::unique_ptr<thread_buffer>> BUFFERS;
+
+/// Buffer for the current thread, or `nullptr` if this thread did not record
+/// any event yet
+static thread_local thread_buffer* LOCAL_BUFFER = nullptr;
+
+static thread_buffer& local_buffer() {
+    if (LOCAL_BUFFER == nullptr) {
+        std::lock_guard<std::mutex> lock(BUFFERS_MUTEX);
+        BUFFERS.emplace_back(new thread_buffer(BUFFERS.size() + 1));
+        LOCAL_BUFFER = BUFFERS.back().get();
+    }
+    return *LOCAL_BUFFER;
+}
+
+bool Trace::enabled_ = false;
+constexpr size_t Trace::NO_STEP;
+
+void Trace::enable(std::string path) {
+    // Commands can call this multiple times in a single run, but events must
+    // all use the same start time to be consistent
+    if (!enabled_) {
+        OUTPUT_PATH = std::move(path);
+        START = clock::now();
+        enabled_ = true;
+    }
+}
+
+void Trace::begin(const char* name, size_t step) {
+    local_buffer().events.push_back({name, 'B', clock::now() - START, step});
+}
+
+void Trace::end(const char* name) {
+    local_buffer().events.push_back({name, 'E', clock::now() - START, NO_STEP});
+}
+
+void Trace::write() {
+    std::ofstream output(OUTPUT_PATH, std::ios::out);
+    if (!output.is_open()) {
+        throw CFilesError("Could not open the '" + OUTPUT_PATH + "' file.");
+    }
+
+    std::lock_guard<std::mutex> lock(BUFFERS_MUTEX);
+    fmt::print(output, "{{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    for (auto& buffer: BUFFERS) {
+        if (!first) {
+            fmt::print(output, ",\n");
+        }
+        first = false;
+        fmt::print(output,
+            "{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": {0}, \"args\": {{\"name\": \"thread {0}\"}}}}",
+            buffer->id
+        );
+
+        for (auto& event: buffer->events) {
+            auto time = std::chrono::duration<double, std::micro>(event.time).count();
+            fmt::print(output,
+                ",\n{{\"name\": \"{}\", \"ph\": \"{}\", \"ts\": {:.3f}, \"pid\": 1, \"tid\": {}",
+                event.name, event.kind, time, buffer->id
+            );
+            if (event.step != NO_STEP) {
+                fmt::print(output, ", \"args\": {{\"step\": {}}}", event.step);
+            }
+            fmt::print(output, "}}");
+        }
+    }
+    fmt::print(output, "\n]}}\n");
+}
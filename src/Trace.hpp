@@ -0,0 +1,43 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_TRACE_HPP
+#define CFILES_TRACE_HPP
+
+#include <cstddef>
+#include <string>
+
+/// Recording of begin/end events, written as Chrome trace-event JSON which can
+/// be opened in Perfetto or chrome://tracing.
+///
+/// Each thread records events in its own buffer without any locking, and all
+/// the buffers are written to the output file by `Trace::write`, which should
+/// only be called once all the threads are done.
+class Trace {
+public:
+    /// Value used for events not associated with a specific step
+    static constexpr size_t NO_STEP = static_cast<size_t>(-1);
+
+    /// Start recording events, which will be written to the file at `path`.
+    /// Calling this function again after the first call does nothing.
+    static void enable(std::string path);
+    /// Are events currently being recorded?
+    static bool enabled() {
+        return enabled_;
+    }
+
+    /// Record the beginning of an event with the given `name`. `name` must be
+    /// a string with static lifetime. If `step` is not `NO_STEP`, it will be
+    /// recorded in the event arguments.
+    static void begin(const char* name, size_t step = NO_STEP);
+    /// Record the end of the last event with the given `name` on this thread
+    static void end(const char* name);
+
+    /// Write all the recorded events to the output file
+    static void write();
+
+private:
+    static bool enabled_;
+};
+
+#endif
@@ -0,0 +1,619 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+
+#ifndef _WIN32
+#include <glob.h>
+#endif
+
+#include "TrajectoryReader.hpp"
+#include "BoundedQueue.hpp"
+#include "Decompressor.hpp"
+#include "Errors.hpp"
+#include "XYZReader.hpp"
+#include "parallel.hpp"
+
+using namespace chemfiles;
+
+/// Number of decoded frames to keep ahead of time for each segment
+static const size_t FRAMES_PER_SEGMENT = 4;
+
+static const size_t NO_STEP = static_cast<size_t>(-1);
+
+/// Get the lowercase extension of `path`, and remove it from `path`
+static std::string pop_extension(std::string& path) {
+    auto dot = path.rfind('.');
+    if (dot == std::string::npos) {
+        return "";
+    }
+    auto extension = path.substr(dot);
+    path.resize(dot);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) {
+        return static_cast<char>(std::tolower(c));
+    });
+    return extension;
+}
+
+/// Check if the file at `path` should be read as an XYZ file, and if this
+/// file is compressed
+static bool is_xyz(std::string path, const std::string& format, bool& compressed) {
+    if (format != "") {
+        compressed = (format == "XYZ / GZ" || format == "XYZ / XZ");
+        return format == "XYZ" || compressed;
+    }
+
+    auto extension = pop_extension(path);
+    compressed = (extension == ".gz" || extension == ".xz");
+    if (compressed) {
+        extension = pop_extension(path);
+    }
+    return extension == ".xyz";
+}
+
+/// Check if the file at `path` will be read with the compressed XYZ reader,
+/// which needs to decompress the whole file to count its steps
+static bool needs_decompression(const std::string& path, const std::string& format, bool fast_xyz) {
+    bool compressed = false;
+    return fast_xyz && is_xyz(path, format, compressed) && compressed && can_decompress(path);
+}
+
+static bool file_exists(const std::string& path) {
+    return std::ifstream(path).good();
+}
+
+/// Add all the files matching the glob `pattern` to `paths`, in sorted order
+static void expand_glob(const std::string& pattern, std::vector<std::string>& paths) {
+#ifndef _WIN32
+    glob_t matches;
+    auto status = glob(pattern.c_str(), 0, nullptr, &matches);
+    if (status == GLOB_NOMATCH) {
+        globfree(&matches);
+        throw CFilesError("no file matching '" + pattern + "'");
+    } else if (status != 0) {
+        globfree(&matches);
+        throw CFilesError("could not expand '" + pattern + "'");
+    }
+    for (size_t i=0; i<matches.gl_pathc; i++) {
+        paths.emplace_back(matches.gl_pathv[i]);
+    }
+    globfree(&matches);
+#else
+    paths.push_back(pattern);
+#endif
+}
+
+/// Get the list of segments in the trajectory at `path`, which can be a single
+/// file, a comma separated list of files, or glob patterns.
+static std::vector<std::string> trajectory_segments(const std::string& path) {
+    if (file_exists(path)) {
+        return {path};
+    }
+
+    auto paths = std::vector<std::string>();
+    for (auto& segment: split(path, ',')) {
+        if (segment.find_first_of("*?[") != std::string::npos && !file_exists(segment)) {
+            expand_glob(segment, paths);
+        } else if (!segment.empty()) {
+            paths.push_back(segment);
+        }
+    }
+
+    if (paths.empty()) {
+        throw CFilesError("no trajectory file in '" + path + "'");
+    }
+    return paths;
+}
+
+/// Reader for a single file
+class TrajectoryReader::File {
+public:
+    File(std::string path, std::string format, bool fast_xyz, bool growing):
+        path_(std::move(path)), format_(std::move(format)), fast_xyz_(fast_xyz), growing_(growing)
+    {
+        open();
+    }
+
+    /// Open the same file as `other`, re-using the frames positions found by
+    /// the fast XYZ reader
+    File(const File& other):
+        path_(other.path_), format_(other.format_), fast_xyz_(other.fast_xyz_), growing_(other.growing_),
+        custom_cell_(other.custom_cell_), cell_(other.cell_),
+        custom_topology_(other.custom_topology_), topology_(other.topology_),
+        threads_(other.threads_)
+    {
+        if (other.xyz_) {
+            xyz_.reset(new XYZReader(*other.xyz_));
+        } else {
+            open();
+            apply_settings();
+        }
+    }
+
+    File& operator=(const File&) = delete;
+
+    size_t nsteps() {
+        if (xyz_) {
+            return xyz_->nsteps();
+        } else if (compressed_) {
+            return compressed_->nsteps();
+        } else {
+            return trajectory_->nsteps();
+        }
+    }
+
+    void set_threads(size_t n_threads) {
+        threads_ = n_threads;
+        if (xyz_) {
+            xyz_->set_threads(n_threads);
+        } else if (compressed_) {
+            compressed_->set_threads(n_threads);
+        }
+    }
+
+    bool nsteps_requires_decompression() const {
+        return compressed_ && !compressed_->nsteps_known();
+    }
+
+    void set_cell(const UnitCell& cell) {
+        custom_cell_ = true;
+        cell_ = cell;
+        if (xyz_) {
+            xyz_->set_cell(cell);
+        } else if (compressed_) {
+            compressed_->set_cell(cell);
+        } else {
+            trajectory_->set_cell(cell);
+        }
+    }
+
+    void set_topology(const Topology& topology) {
+        custom_topology_ = true;
+        topology_ = topology;
+        if (xyz_) {
+            xyz_->set_topology(topology);
+        } else if (compressed_) {
+            compressed_->set_topology(topology);
+        } else {
+            trajectory_->set_topology(topology);
+        }
+    }
+
+    bool read_step(size_t step, Frame& frame) {
+        if (xyz_) {
+            return xyz_->read_step(step, frame);
+        } else if (compressed_) {
+            return compressed_->read_step(step, frame);
+        }
+
+        if (step >= trajectory_->nsteps()) {
+            return false;
+        }
+        frame = trajectory_->read_step(step);
+        return true;
+    }
+
+    /// Can we read the cell without reading the full frame?
+    bool has_cell_reader() const {
+        return static_cast<bool>(xyz_);
+    }
+
+    /// Read the cell at `step`, only for files with a cell-only reader
+    bool read_cell(size_t step, UnitCell& cell) const {
+        return xyz_->read_cell(step, cell);
+    }
+
+    size_t refresh() {
+        if (xyz_) {
+            return xyz_->refresh();
+        }
+
+        // other readers do not support reading only the new data, re-open
+        // the file instead
+        open();
+        apply_settings();
+        return nsteps();
+    }
+
+private:
+    /// Use the custom cell, topology and number of threads in a newly
+    /// opened file
+    void apply_settings() {
+        if (custom_cell_) {
+            set_cell(cell_);
+        }
+        if (custom_topology_) {
+            set_topology(topology_);
+        }
+        if (threads_ != 0) {
+            set_threads(threads_);
+        }
+    }
+
+    void open() {
+        xyz_.reset();
+        compressed_.reset();
+        trajectory_.reset();
+
+        bool compressed = false;
+        if (fast_xyz_ && is_xyz(path_, format_, compressed)) {
+            if (!compressed) {
+                xyz_.reset(new XYZReader(path_, growing_));
+                return;
+            } else if (can_decompress(path_)) {
+                compressed_.reset(new CompressedXYZReader(path_));
+                return;
+            }
+        }
+        trajectory_.reset(new Trajectory(path_, 'r', format_));
+    }
+
+    std::string path_;
+    std::string format_;
+    bool fast_xyz_;
+    /// Might the file still be written to?
+    bool growing_;
+
+    bool custom_cell_ = false;
+    UnitCell cell_;
+    bool custom_topology_ = false;
+    Topology topology_;
+    /// Number of threads used by the XYZ readers, or 0 for the default
+    size_t threads_ = 0;
+
+    std::unique_ptr<XYZReader> xyz_;
+    std::unique_ptr<CompressedXYZReader> compressed_;
+    std::unique_ptr<Trajectory> trajectory_;
+};
+
+struct TrajectoryReader::Segment {
+    explicit Segment(std::string path_): path(std::move(path_)) {}
+
+    std::string path;
+    std::unique_ptr<File> file;
+    /// Global step of the first frame in this segment
+    size_t first_step = 0;
+    /// Number of steps in this segment
+    size_t nsteps = 0;
+    /// Is `nsteps` known? Compressed segments are only counted once they
+    /// have been read until the end.
+    bool counted = false;
+    /// Frames decoded by the background threads
+    std::unique_ptr<BoundedQueue<Frame>> frames;
+    /// Error in the background thread decoding this segment, if any
+    std::exception_ptr error;
+};
+
+TrajectoryReader::TrajectoryReader(const std::string& path, const std::string& format, bool fast_xyz, bool growing):
+    format_(format), fast_xyz_(fast_xyz), growing_(growing), next_segment_(0)
+{
+    for (auto& segment: trajectory_segments(path)) {
+        segments_.emplace_back(new Segment(segment));
+    }
+
+    if (segments_.size() == 1) {
+        segments_[0]->file.reset(new File(segments_[0]->path, format, fast_xyz, growing));
+        return;
+    }
+
+    // open the segments concurrently to count their steps. Counting the
+    // steps in compressed segments would decompress them twice, so they are
+    // only opened and counted when the reading reaches them.
+    parallel_for(segments_.size(), [&](size_t i) {
+        auto& segment = *segments_[i];
+        if (!needs_decompression(segment.path, format, fast_xyz)) {
+            // only the last segment can still be written to
+            auto last = (i == segments_.size() - 1);
+            segment.file.reset(new File(segment.path, format, fast_xyz, growing && last));
+            segment.nsteps = segment.file->nsteps();
+            segment.counted = true;
+        }
+    });
+    update_counted();
+}
+
+TrajectoryReader::TrajectoryReader(): next_segment_(0) {}
+
+TrajectoryReader::~TrajectoryReader() {
+    stop();
+}
+
+std::unique_ptr<TrajectoryReader> TrajectoryReader::reopen() const {
+    auto reader = std::unique_ptr<TrajectoryReader>(new TrajectoryReader());
+    for (auto& segment: segments_) {
+        auto copy = std::unique_ptr<Segment>(new Segment(segment->path));
+        if (segment->file) {
+            copy->file.reset(new File(*segment->file));
+        }
+        copy->first_step = segment->first_step;
+        copy->nsteps = segment->nsteps;
+        copy->counted = segment->counted;
+        reader->segments_.emplace_back(std::move(copy));
+    }
+    reader->format_ = format_;
+    reader->fast_xyz_ = fast_xyz_;
+    reader->growing_ = growing_;
+    reader->custom_cell_ = custom_cell_;
+    reader->cell_ = cell_;
+    reader->custom_topology_ = custom_topology_;
+    reader->topology_ = topology_;
+    reader->nsteps_ = nsteps_;
+    reader->counted_ = counted_;
+    reader->threads_ = threads_;
+    return reader;
+}
+
+void TrajectoryReader::set_threads(size_t n_threads) {
+    stop();
+    threads_ = std::max(n_threads, static_cast<size_t>(1));
+    if (segments_.size() == 1) {
+        segments_[0]->file->set_threads(threads_);
+    }
+}
+
+size_t TrajectoryReader::nsteps() {
+    if (segments_.size() == 1) {
+        return segments_[0]->file->nsteps();
+    }
+
+    while (counted_ < segments_.size()) {
+        auto& segment = *segments_[counted_];
+        segment.nsteps = segment_file(counted_).nsteps();
+        segment.counted = true;
+        update_counted();
+    }
+    return nsteps_;
+}
+
+bool TrajectoryReader::nsteps_requires_decompression() const {
+    if (segments_.size() == 1) {
+        return segments_[0]->file->nsteps_requires_decompression();
+    }
+    // uncompressed segments are counted when opening them
+    return counted_ != segments_.size();
+}
+
+void TrajectoryReader::set_cell(const UnitCell& cell) {
+    stop();
+    custom_cell_ = true;
+    cell_ = cell;
+    for (auto& segment: segments_) {
+        if (segment->file) {
+            segment->file->set_cell(cell);
+        }
+    }
+}
+
+void TrajectoryReader::set_topology(const std::string& path, const std::string& format) {
+    stop();
+    auto topology = Trajectory(path, 'r', format).read().topology();
+    custom_topology_ = true;
+    topology_ = topology;
+    for (auto& segment: segments_) {
+        if (segment->file) {
+            segment->file->set_topology(topology);
+        }
+    }
+}
+
+size_t TrajectoryReader::refresh() {
+    stop();
+    if (segments_.size() == 1) {
+        return segments_[0]->file->refresh();
+    }
+
+    // only the last segment can grow
+    nsteps();
+    auto& last = *segments_.back();
+    last.nsteps = last.file->refresh();
+    nsteps_ = last.first_step + last.nsteps;
+    return nsteps_;
+}
+
+void TrajectoryReader::set_steps(const steps_range& steps) {
+    stop();
+    stride_ = steps.stride();
+    last_ = steps.last();
+}
+
+bool TrajectoryReader::read_step(size_t step, Frame& frame) {
+    if (segments_.size() == 1) {
+        return segments_[0]->file->read_step(step, frame);
+    }
+
+    if (counted_ != segments_.size()) {
+        return read_uncounted(step, frame);
+    }
+
+    if (step >= nsteps_) {
+        return false;
+    }
+
+    if (step != expected_step_) {
+        // the caller is not reading the steps we expected, restart the
+        // decoding from this step
+        if (expected_step_ != NO_STEP && step > expected_step_ - stride_) {
+            stride_ = step - (expected_step_ - stride_);
+        }
+        stop();
+        start(step);
+    }
+
+    auto& segment = *segments_[segment_index(step)];
+    auto decoded = Frame();
+    if (!segment.frames->pop(decoded)) {
+        if (segment.error) {
+            std::rethrow_exception(segment.error);
+        }
+        return false;
+    }
+    std::swap(frame, decoded);
+    {
+        std::lock_guard<std::mutex> lock(free_frames_mutex_);
+        free_frames_.emplace_back(std::move(decoded));
+    }
+
+    expected_step_ = step + stride_;
+    return true;
+}
+
+bool TrajectoryReader::read_cell(size_t step, UnitCell& cell) {
+    if (segments_.size() == 1 || step < nsteps_) {
+        auto& segment = *segments_[segments_.size() == 1 ? 0 : segment_index(step)];
+        if (segment.file->has_cell_reader()) {
+            return segment.file->read_cell(step - segment.first_step, cell);
+        }
+    }
+
+    if (!read_step(step, cell_frame_)) {
+        return false;
+    }
+    cell = cell_frame_.cell();
+    return true;
+}
+
+bool TrajectoryReader::read_uncounted(size_t step, Frame& frame) {
+    // read the segments in order until we find the one containing `step`
+    while (step >= nsteps_) {
+        if (counted_ == segments_.size()) {
+            return false;
+        }
+
+        auto& segment = *segments_[counted_];
+        auto& file = segment_file(counted_);
+        if (file.read_step(step - segment.first_step, frame)) {
+            frame.set_step(step);
+            return true;
+        }
+
+        // we went through the whole segment, its steps are now known
+        segment.nsteps = file.nsteps();
+        segment.counted = true;
+        update_counted();
+    }
+
+    auto index = segment_index(step);
+    auto& segment = *segments_[index];
+    if (!segment.file->read_step(step - segment.first_step, frame)) {
+        return false;
+    }
+    frame.set_step(step);
+    return true;
+}
+
+TrajectoryReader::File& TrajectoryReader::segment_file(size_t index) {
+    auto& segment = *segments_[index];
+    if (!segment.file) {
+        auto last = (index == segments_.size() - 1);
+        segment.file.reset(new File(segment.path, format_, fast_xyz_, growing_ && last));
+        if (custom_cell_) {
+            segment.file->set_cell(cell_);
+        }
+        if (custom_topology_) {
+            segment.file->set_topology(topology_);
+        }
+        if (threads_ != 0) {
+            segment.file->set_threads(threads_);
+        }
+    }
+    return *segment.file;
+}
+
+void TrajectoryReader::update_counted() {
+    while (counted_ < segments_.size() && segments_[counted_]->counted) {
+        segments_[counted_]->first_step = nsteps_;
+        nsteps_ += segments_[counted_]->nsteps;
+        counted_++;
+    }
+    if (counted_ < segments_.size()) {
+        segments_[counted_]->first_step = nsteps_;
+    }
+}
+
+size_t TrajectoryReader::segment_index(size_t step) const {
+    auto it = std::upper_bound(segments_.begin(), segments_.begin() + static_cast<std::ptrdiff_t>(counted_), step, [](size_t value, const std::unique_ptr<Segment>& segment) {
+        return value < segment->first_step;
+    });
+    return static_cast<size_t>(it - segments_.begin()) - 1;
+}
+
+void TrajectoryReader::start(size_t step) {
+    start_ = step;
+    auto first = segment_index(step);
+    for (size_t i=first; i<segments_.size(); i++) {
+        segments_[i]->frames.reset(new BoundedQueue<Frame>(FRAMES_PER_SEGMENT));
+        segments_[i]->error = nullptr;
+    }
+    next_segment_ = first;
+
+    // share the threads between the workers, each one parsing frames from
+    // its segment in parallel
+    auto n_threads = threads_ == 0 ? default_threads() : threads_;
+    auto n_workers = std::min(n_threads, segments_.size() - first);
+    for (size_t i=first; i<segments_.size(); i++) {
+        segments_[i]->file->set_threads(n_threads / n_workers);
+    }
+    for (size_t i=0; i<n_workers; i++) {
+        workers_.emplace_back(&TrajectoryReader::decode, this);
+    }
+}
+
+void TrajectoryReader::stop() {
+    for (auto& segment: segments_) {
+        if (segment->frames) {
+            segment->frames->close();
+        }
+    }
+    for (auto& worker: workers_) {
+        worker.join();
+    }
+    workers_.clear();
+    expected_step_ = NO_STEP;
+}
+
+void TrajectoryReader::decode() {
+    while (true) {
+        auto index = next_segment_++;
+        if (index >= segments_.size()) {
+            return;
+        }
+
+        // segments are taken in order by the workers, and each worker only
+        // works on one segment at the time
+        auto& segment = *segments_[index];
+        try {
+            auto step = start_;
+            if (segment.first_step > step) {
+                auto skipped = (segment.first_step - step + stride_ - 1) / stride_;
+                step += skipped * stride_;
+            }
+            auto end = std::min(last_, segment.first_step + segment.nsteps);
+
+            for (; step < end; step += stride_) {
+                auto frame = Frame();
+                {
+                    std::lock_guard<std::mutex> lock(free_frames_mutex_);
+                    if (!free_frames_.empty()) {
+                        frame = std::move(free_frames_.back());
+                        free_frames_.pop_back();
+                    }
+                }
+
+                if (!segment.file->read_step(step - segment.first_step, frame)) {
+                    break;
+                }
+                frame.set_step(step);
+
+                if (!segment.frames->push(std::move(frame))) {
+                    // the decoding was stopped
+                    return;
+                }
+            }
+        } catch (...) {
+            segment.error = std::current_exception();
+        }
+        segment.frames->close();
+    }
+}
@@ -0,0 +1,147 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_TRAJECTORY_READER_HPP
+#define CFILES_TRAJECTORY_READER_HPP
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <chemfiles.hpp>
+
+#include "utils.hpp"
+
+/// Input trajectory for the commands. This uses the fast XYZReader (or
+/// CompressedXYZReader for gzip and xz compressed XYZ files) when requested
+/// and possible, and chemfiles::Trajectory otherwise.
+///
+/// The trajectory can be made of multiple segments, given as a comma
+/// separated list of files or as a glob pattern. The segments are then used as
+/// a single logical trajectory, with a global step numbering. The segments
+/// are decoded ahead of time and concurrently by background threads, and
+/// frames are delivered in order. Compressed XYZ segments are only counted
+/// when the reading reaches their end, and until all segments are counted
+/// they are read one after the other.
+class TrajectoryReader {
+public:
+    /// Open the trajectory at `path` with the given `format`. If `fast_xyz` is
+    /// true and the file is a (possibly compressed) XYZ file, the fast XYZ
+    /// readers are used. If `growing` is true, the trajectory might still be
+    /// written to, and incomplete frames at the end are ignored until they
+    /// are completed and found by `refresh`.
+    TrajectoryReader(const std::string& path, const std::string& format, bool fast_xyz, bool growing = false);
+    ~TrajectoryReader();
+
+    TrajectoryReader(const TrajectoryReader&) = delete;
+    TrajectoryReader& operator=(const TrajectoryReader&) = delete;
+
+    /// Open the same trajectory again, for example to read it from another
+    /// thread. The frames positions already found by the fast XYZ reader are
+    /// re-used instead of scanning the files again, and the custom cell,
+    /// topology and number of threads are kept.
+    std::unique_ptr<TrajectoryReader> reopen() const;
+
+    /// Get the number of steps in the trajectory. This can be slow for
+    /// compressed files, see `nsteps_requires_decompression`.
+    size_t nsteps();
+    /// Does `nsteps` need to decompress the whole trajectory? This is the
+    /// case for compressed XYZ files (or segments) read with the fast reader,
+    /// until all the frames have been read once. Commands should then avoid calling
+    /// `nsteps`, and read frames until `read_step` returns `false`.
+    bool nsteps_requires_decompression() const;
+
+    /// Use the given `cell` for all frames instead of the one in the file
+    void set_cell(const chemfiles::UnitCell& cell);
+    /// Use the topology from the first frame of the file at `path` for all
+    /// frames, instead of the one in the trajectory
+    void set_topology(const std::string& path, const std::string& format = "");
+    /// Look for new frames appended to the trajectory since it was opened or
+    /// last refreshed, and return the new number of steps. With the fast XYZ
+    /// reader, only the new data is scanned. Other files are opened again.
+    size_t refresh();
+    /// Use up to `n_threads` threads to decode frames ahead of time. This
+    /// defaults to `default_threads()`.
+    void set_threads(size_t n_threads);
+    /// Indicate which `steps` will be read, so that segments can be decoded
+    /// ahead of time. Reading other steps works, but is slower.
+    void set_steps(const steps_range& steps);
+
+    /// Read the frame at `step` into `frame`. The memory of `frame` is re-used
+    /// when possible. This returns `false` if `step` is past the end of the
+    /// trajectory.
+    bool read_step(size_t step, chemfiles::Frame& frame);
+    /// Read the unit cell of the frame at `step` into `cell`. With the fast
+    /// XYZ reader for uncompressed files, only the comment line of the frame
+    /// is parsed; other files read the full frame. This returns `false` if
+    /// `step` is past the end of the trajectory.
+    bool read_cell(size_t step, chemfiles::UnitCell& cell);
+
+private:
+    class File;
+    struct Segment;
+
+    /// Create an empty reader, used by `reopen`
+    TrajectoryReader();
+
+    /// Start decoding segments in background threads, from `step` onward
+    void start(size_t step);
+    /// Stop the background threads
+    void stop();
+    /// Main function of the background threads
+    void decode();
+    /// Get the index of the segment containing the global `step`, which
+    /// must be in one of the counted segments
+    size_t segment_index(size_t step) const;
+    /// Implementation of `read_step` when some segments are not yet counted.
+    /// The segments are then read in order in the calling thread, counting
+    /// them as the reading reaches their end.
+    bool read_uncounted(size_t step, chemfiles::Frame& frame);
+    /// Get the file for the segment at `index`, opening it if needed
+    File& segment_file(size_t index);
+    /// Update `counted_` and the first step of the segments after the
+    /// segments whose steps were just counted
+    void update_counted();
+
+    std::vector<std::unique_ptr<Segment>> segments_;
+    /// Format and fast XYZ reader settings used to open the segments
+    std::string format_;
+    bool fast_xyz_ = false;
+    bool growing_ = false;
+    /// Custom cell and topology for all the segments
+    bool custom_cell_ = false;
+    chemfiles::UnitCell cell_;
+    bool custom_topology_ = false;
+    chemfiles::Topology topology_;
+    /// Number of segments at the start of the trajectory with a known number
+    /// of steps and first step
+    size_t counted_ = 0;
+    /// Total number of steps in the first `counted_` segments
+    size_t nsteps_ = 0;
+    /// Number of threads used to decode frames, or 0 for the default
+    size_t threads_ = 0;
+
+    /// Stride and last step (excluded) of the steps to decode
+    size_t stride_ = 1;
+    size_t last_ = static_cast<size_t>(-1);
+    /// First global step to decode
+    size_t start_ = 0;
+    /// Next step we expect to be requested in `read_step`
+    size_t expected_step_ = static_cast<size_t>(-1);
+
+    /// Background threads decoding segments
+    std::vector<std::thread> workers_;
+    /// Index of the next segment to decode
+    std::atomic<size_t> next_segment_;
+    /// Frames given back by the caller of `read_step`, to be re-used by the
+    /// background threads
+    std::vector<chemfiles::Frame> free_frames_;
+    std::mutex free_frames_mutex_;
+    /// Frame used to read cells for files without a cell-only reader
+    chemfiles::Frame cell_frame_;
+};
+
+#endif
@@ -0,0 +1,946 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <locale>
+#include <sstream>
+
+#include "XYZReader.hpp"
+#include "AtomicFile.hpp"
+#include "Decompressor.hpp"
+#include "Errors.hpp"
+#include "parallel.hpp"
+#include "utils.hpp"
+#include "warnings.hpp"
+
+using namespace chemfiles;
+
+/// Maximal number of bytes of text to parse in a single prefetch batch
+static const size_t MAX_BATCH_BYTES = 64 * 1024 * 1024;
+/// Maximal number of frames per thread to parse in a single prefetch batch
+static const size_t FRAMES_PER_THREAD = 4;
+/// Marker for cache entries that were already used
+static const size_t NO_STEP = static_cast<size_t>(-1);
+/// Magic bytes at the start of index files, including a format version
+static const char INDEX_MAGIC[8] = {'C', 'F', 'X', 'Y', 'Z', 'I', '0', '2'};
+
+namespace {
+    /// Columns of an extended XYZ file we know how to use
+    enum class Column {
+        Species,
+        Position,
+        Velocity,
+        /// Unused column, with a given number of values
+        Skip,
+    };
+
+    struct column_t {
+        Column kind;
+        size_t count;
+    };
+
+    /// Information from the comment line of a frame
+    struct comment_t {
+        bool has_lattice = false;
+        Matrix3D lattice;
+        /// Columns for each atomic line. The last column is always a `Skip`
+        /// column, ignoring any remaining value on the line.
+        std::vector<column_t> columns;
+        bool has_velocities = false;
+        /// Name of the time property (`time` or `Time`), empty if the
+        /// comment line does not contain the time
+        std::string time_name;
+        double time = 0;
+    };
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static void skip_spaces(const char*& current, const char* end) {
+    while (current < end && is_space(*current)) {
+        current++;
+    }
+}
+
+/// Get the end of the line starting at `current`, i.e. the position of the
+/// next new line character or `end`.
+static const char* line_end(const char* current, const char* end) {
+    auto found = static_cast<const char*>(std::memchr(current, '\n', static_cast<size_t>(end - current)));
+    return found == nullptr ? end : found;
+}
+
+/// Move to the next white-space separated token in the current line, and
+/// return its end. This throws if the line does not contain more tokens.
+static const char* next_token(const char*& current, const char* end) {
+    skip_spaces(current, end);
+    auto token_end = current;
+    while (token_end < end && !is_space(*token_end) && *token_end != '\n') {
+        token_end++;
+    }
+    if (token_end == current) {
+        throw CFilesError("XYZ: missing values in atomic line");
+    }
+    return token_end;
+}
+
+/// Parse an unsigned integer spanning the whole `[begin, end)` range
+static size_t parse_size(const char* begin, const char* end) {
+    if (begin == end) {
+        throw CFilesError("XYZ: expected an integer, got an empty string");
+    }
+    size_t value = 0;
+    for (auto current = begin; current < end; current++) {
+        if (*current < '0' || *current > '9') {
+            throw CFilesError("XYZ: can not convert '" + std::string(begin, end) + "' to an integer");
+        }
+        value = 10 * value + static_cast<size_t>(*current - '0');
+    }
+    return value;
+}
+
+/// Slow path for parsing floating point numbers, used for values which can
+/// not be represented exactly by the fast path (more than 19 significant
+/// digits, large exponents, inf, nan, ...)
+static double parse_double_slow(const char* begin, const char* end) {
+    auto string = std::string(begin, end);
+    std::replace(string.begin(), string.end(), 'd', 'e');
+    std::replace(string.begin(), string.end(), 'D', 'e');
+    std::istringstream stream(string);
+    stream.imbue(std::locale::classic());
+    double value = 0;
+    stream >> value;
+    if (stream.fail() || !stream.eof()) {
+        throw CFilesError("XYZ: can not convert '" + std::string(begin, end) + "' to number");
+    }
+    return value;
+}
+
+/// Parse a floating point number spanning the whole `[begin, end)` range,
+/// independently of the current locale. Numbers with at most 19 significant
+/// digits and small exponents are converted exactly by the fast path.
+static double parse_double(const char* begin, const char* end) {
+    static const double POWERS_OF_TEN[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    auto current = begin;
+    bool negative = false;
+    if (current < end && (*current == '-' || *current == '+')) {
+        negative = (*current == '-');
+        current++;
+    }
+
+    uint64_t mantissa = 0;
+    size_t digits = 0;
+    long exponent = 0;
+    bool any_digit = false;
+    while (current < end && *current >= '0' && *current <= '9') {
+        any_digit = true;
+        if (digits < 19) {
+            mantissa = 10 * mantissa + static_cast<uint64_t>(*current - '0');
+            if (mantissa != 0) {
+                digits++;
+            }
+        } else {
+            exponent++;
+            digits++;
+        }
+        current++;
+    }
+    if (current < end && *current == '.') {
+        current++;
+        while (current < end && *current >= '0' && *current <= '9') {
+            any_digit = true;
+            if (digits < 19) {
+                mantissa = 10 * mantissa + static_cast<uint64_t>(*current - '0');
+                exponent--;
+                if (mantissa != 0) {
+                    digits++;
+                }
+            } else {
+                digits++;
+            }
+            current++;
+        }
+    }
+
+    if (!any_digit) {
+        return parse_double_slow(begin, end);
+    }
+
+    if (current < end && (*current == 'e' || *current == 'E' || *current == 'd' || *current == 'D')) {
+        current++;
+        bool negative_exponent = false;
+        if (current < end && (*current == '-' || *current == '+')) {
+            negative_exponent = (*current == '-');
+            current++;
+        }
+        if (current == end) {
+            throw CFilesError("XYZ: can not convert '" + std::string(begin, end) + "' to number");
+        }
+        long value = 0;
+        while (current < end && *current >= '0' && *current <= '9') {
+            if (value < 100000) {
+                value = 10 * value + (*current - '0');
+            }
+            current++;
+        }
+        exponent += negative_exponent ? -value : value;
+    }
+
+    if (current != end) {
+        throw CFilesError("XYZ: can not convert '" + std::string(begin, end) + "' to number");
+    }
+
+    // mantissa and powers of ten up to 1e22 are exactly representable, so a
+    // single multiplication or division gives a correctly rounded result
+    if (digits > 19 || mantissa > (uint64_t(1) << 53) || exponent < -22 || exponent > 22) {
+        return parse_double_slow(begin, end);
+    }
+
+    auto value = static_cast<double>(mantissa);
+    if (exponent < 0) {
+        value /= POWERS_OF_TEN[-exponent];
+    } else {
+        value *= POWERS_OF_TEN[exponent];
+    }
+    return negative ? -value : value;
+}
+
+/// Parse the next token in the line as a floating point number
+static double next_double(const char*& current, const char* end) {
+    auto token_end = next_token(current, end);
+    auto value = parse_double(current, token_end);
+    current = token_end;
+    return value;
+}
+
+static bool equal_ignoring_case(const char* begin, const char* end, const char* expected) {
+    auto size = static_cast<size_t>(end - begin);
+    if (size != std::strlen(expected)) {
+        return false;
+    }
+    for (size_t i=0; i<size; i++) {
+        if (std::tolower(static_cast<unsigned char>(begin[i])) != expected[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Parse the `Properties` value from an extended XYZ comment line
+static void parse_properties(const char* begin, const char* end, comment_t& comment) {
+    auto fields = split(std::string(begin, end), ':');
+    if (fields.size() % 3 != 0) {
+        throw CFilesError("XYZ: invalid Properties in extended XYZ comment line");
+    }
+
+    comment.columns.clear();
+    bool has_species = false;
+    bool has_positions = false;
+    for (size_t i=0; i<fields.size(); i+=3) {
+        auto& name = fields[i];
+        auto count = parse_size(fields[i + 2].data(), fields[i + 2].data() + fields[i + 2].size());
+        if (name == "species" && count == 1) {
+            comment.columns.push_back({Column::Species, 1});
+            has_species = true;
+        } else if (name == "pos" && count == 3) {
+            comment.columns.push_back({Column::Position, 3});
+            has_positions = true;
+        } else if (name == "velo" && count == 3) {
+            comment.columns.push_back({Column::Velocity, 3});
+            comment.has_velocities = true;
+        } else {
+            comment.columns.push_back({Column::Skip, count});
+        }
+    }
+
+    if (!has_species || !has_positions) {
+        throw CFilesError("XYZ: missing species or pos in extended XYZ Properties");
+    }
+}
+
+/// Parse the comment line of a frame in `[begin, end)`, looking for extended
+/// XYZ `Lattice`, `Properties` and `Time` fields
+static comment_t parse_comment(const char* begin, const char* end) {
+    auto comment = comment_t();
+    comment.columns = {{Column::Species, 1}, {Column::Position, 3}};
+
+    auto current = begin;
+    while (current < end) {
+        skip_spaces(current, end);
+        auto key_begin = current;
+        while (current < end && !is_space(*current) && *current != '=') {
+            current++;
+        }
+        auto key_end = current;
+        if (current == end || *current != '=') {
+            // plain comment word or flag, ignore it
+            continue;
+        }
+        current++;
+
+        const char* value_begin = current;
+        const char* value_end = nullptr;
+        if (current < end && *current == '"') {
+            value_begin = current + 1;
+            value_end = static_cast<const char*>(std::memchr(value_begin, '"', static_cast<size_t>(end - value_begin)));
+            if (value_end == nullptr) {
+                throw CFilesError("XYZ: unterminated string in extended XYZ comment line");
+            }
+            current = value_end + 1;
+        } else {
+            while (current < end && !is_space(*current)) {
+                current++;
+            }
+            value_end = current;
+        }
+
+        if (equal_ignoring_case(key_begin, key_end, "lattice")) {
+            double values[9];
+            auto position = value_begin;
+            for (auto& value: values) {
+                value = next_double(position, value_end);
+            }
+            comment.has_lattice = true;
+            comment.lattice = Matrix3D(
+                values[0], values[3], values[6],
+                values[1], values[4], values[7],
+                values[2], values[5], values[8]
+            );
+        } else if (equal_ignoring_case(key_begin, key_end, "properties")) {
+            parse_properties(value_begin, value_end, comment);
+        } else if (equal_ignoring_case(key_begin, key_end, "time")) {
+            auto position = value_begin;
+            comment.time = next_double(position, value_end);
+            comment.time_name = std::string(key_begin, key_end);
+        }
+    }
+
+    comment.columns.push_back({Column::Skip, 0});
+    return comment;
+}
+
+void XYZParser::set_cell(UnitCell cell) {
+    cell_ = std::move(cell);
+    custom_cell_ = true;
+}
+
+void XYZParser::set_topology(Topology topology) {
+    topology_ = std::move(topology);
+    custom_topology_ = true;
+}
+
+const char* XYZParser::frame_end(const char* begin, const char* end, bool end_of_file) {
+    auto current = begin;
+    skip_spaces(current, end);
+    auto first_line_end = line_end(current, end);
+    if (first_line_end == end) {
+        return nullptr;
+    }
+    auto token_end = current;
+    while (token_end < first_line_end && !is_space(*token_end)) {
+        token_end++;
+    }
+    auto natoms = parse_size(current, token_end);
+
+    current = first_line_end + 1;
+    // comment line and atomic lines
+    for (size_t i=0; i<natoms + 1; i++) {
+        if (current >= end) {
+            return nullptr;
+        }
+        auto next = line_end(current, end);
+        if (next == end) {
+            // accept a missing new line at the end of the file
+            return (end_of_file && i == natoms) ? end : nullptr;
+        }
+        current = next + 1;
+    }
+    return current;
+}
+
+void XYZParser::parse(const char* begin, const char* end, Frame& frame) const {
+    auto current = begin;
+    skip_spaces(current, end);
+    auto token_end = next_token(current, end);
+    auto natoms = parse_size(current, token_end);
+    current = line_end(token_end, end) + 1;
+
+    auto comment_end = line_end(current, end);
+    auto comment = parse_comment(current, comment_end);
+    current = comment_end + 1;
+
+    if (custom_topology_ && topology_.size() != natoms) {
+        throw CFilesError(
+            "the topology contains " + std::to_string(topology_.size()) +
+            " atoms, but the frame contains " + std::to_string(natoms) + " atoms"
+        );
+    }
+
+    if (static_cast<bool>(frame.velocities()) && !comment.has_velocities) {
+        // there is no way to remove velocities from a frame
+        frame = Frame();
+    }
+    if (frame.size() != natoms) {
+        frame.clear_bonds();
+        frame.resize(natoms);
+    }
+    if (comment.has_velocities && !frame.velocities()) {
+        frame.add_velocities();
+    }
+
+    auto positions = frame.positions();
+    bool same_topology = true;
+    for (size_t i=0; i<natoms; i++) {
+        if (current >= end) {
+            throw CFilesError("XYZ: not enough atomic lines in frame");
+        }
+        auto next_line = line_end(current, end);
+        for (auto& column: comment.columns) {
+            switch (column.kind) {
+            case Column::Species: {
+                token_end = next_token(current, next_line);
+                if (!custom_topology_) {
+                    auto& name = frame[i].name();
+                    auto size = static_cast<size_t>(token_end - current);
+                    if (name.size() != size || std::memcmp(name.data(), current, size) != 0) {
+                        frame[i] = Atom(std::string(current, token_end));
+                    }
+                } else if (same_topology && frame[i].name() != topology_[i].name()) {
+                    same_topology = false;
+                }
+                current = token_end;
+                break;
+            }
+            case Column::Position:
+                positions[i][0] = next_double(current, next_line);
+                positions[i][1] = next_double(current, next_line);
+                positions[i][2] = next_double(current, next_line);
+                break;
+            case Column::Velocity: {
+                auto& velocity = (*frame.velocities())[i];
+                velocity[0] = next_double(current, next_line);
+                velocity[1] = next_double(current, next_line);
+                velocity[2] = next_double(current, next_line);
+                break;
+            }
+            case Column::Skip:
+                for (size_t j=0; j<column.count; j++) {
+                    current = next_token(current, next_line);
+                }
+                break;
+            }
+        }
+        current = next_line + 1;
+    }
+
+    if (custom_topology_ && !same_topology) {
+        frame.set_topology(topology_);
+    }
+
+    if (custom_cell_) {
+        frame.set_cell(cell_);
+    } else if (comment.has_lattice) {
+        frame.set_cell(UnitCell(comment.lattice));
+    } else {
+        frame.set_cell(UnitCell());
+    }
+
+    if (!comment.time_name.empty()) {
+        frame.set(comment.time_name, comment.time);
+    }
+}
+
+UnitCell XYZParser::parse_cell(const char* begin, const char* end) const {
+    if (custom_cell_) {
+        return cell_;
+    }
+
+    auto current = line_end(begin, end) + 1;
+    auto comment = parse_comment(current, line_end(current, end));
+    if (comment.has_lattice) {
+        return UnitCell(comment.lattice);
+    } else {
+        return UnitCell();
+    }
+}
+
+/// Skip spaces and empty lines starting at `current`
+static const char* skip_blank_lines(const char* current, const char* end) {
+    skip_spaces(current, end);
+    while (current < end && *current == '\n') {
+        current++;
+        skip_spaces(current, end);
+    }
+    return current;
+}
+
+/// Guess the stride between steps from the `previous` requested step and the
+/// `current` one
+static size_t guess_stride(size_t previous, size_t current) {
+    if (previous != NO_STEP && current > previous) {
+        return current - previous;
+    } else {
+        return 1;
+    }
+}
+
+/// Maximal number of frames in a single prefetch batch using `n_threads`
+static size_t max_batch_frames(size_t n_threads) {
+    return FRAMES_PER_THREAD * n_threads;
+}
+
+bool FrameCache::take(size_t step, Frame& frame) {
+    auto it = std::find(steps_.begin(), steps_.end(), step);
+    if (it == steps_.end()) {
+        return false;
+    }
+
+    auto index = static_cast<size_t>(it - steps_.begin());
+    // give the parsed frame to the caller, and get back the previous frame
+    // to re-use its memory during the next prefetch
+    std::swap(frame, frames_[index]);
+    steps_[index] = NO_STEP;
+    return true;
+}
+
+void FrameCache::parse(const XYZParser& parser, std::vector<size_t> steps, const std::vector<text_t>& texts, size_t n_threads) {
+    assert(steps.size() == texts.size());
+    steps_ = std::move(steps);
+    if (frames_.size() < steps_.size()) {
+        frames_.resize(steps_.size());
+    }
+
+    try {
+        parallel_for(steps_.size(), [&](size_t i) {
+            parser.parse(texts[i].first, texts[i].second, frames_[i]);
+            frames_[i].set_step(steps_[i]);
+        }, n_threads);
+    } catch (...) {
+        // do not keep partially parsed frames around
+        clear();
+        throw;
+    }
+}
+
+void FrameCache::clear() {
+    // keep the frames around to re-use their memory
+    std::fill(steps_.begin(), steps_.end(), NO_STEP);
+}
+
+XYZReader::XYZReader(std::string path, bool growing):
+    path_(std::move(path)), file_(new MemoryMap(path_)), threads_(default_threads())
+{
+    if (!load_index()) {
+        scan(0, !growing);
+    }
+}
+
+XYZReader::XYZReader(const XYZReader& other):
+    path_(other.path_), file_(other.file_), frames_(other.frames_),
+    parser_(other.parser_), threads_(other.threads_)
+{}
+
+std::string XYZReader::index_path(const std::string& path) {
+    return path + ".cfindex";
+}
+
+void XYZReader::save_index() const {
+    auto path = index_path(path_);
+    AtomicFile file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw CFilesError("Could not open the '" + path + "' file.");
+    }
+
+    auto write = [&file](uint64_t value) {
+        file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+    file.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    write(file_->size());
+    write(file_->modification_time());
+    write(file_->inode());
+    write(frames_.size());
+    for (auto& offsets: frames_) {
+        write(offsets.first);
+        write(offsets.second);
+    }
+
+    if (!file) {
+        throw CFilesError("failed to write the index at '" + path + "'");
+    }
+    file.commit();
+}
+
+bool XYZReader::load_index() {
+    std::ifstream file(index_path(path_), std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    auto read = [&file]() {
+        uint64_t value = 0;
+        file.read(reinterpret_cast<char*>(&value), sizeof(value));
+        return value;
+    };
+
+    char magic[sizeof(INDEX_MAGIC)] = {0};
+    file.read(magic, sizeof(magic));
+    if (!file || std::memcmp(magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+        return false;
+    }
+
+    // the index is only valid for the exact same file. Files rewritten in
+    // place with the same size are common, so the modification time and
+    // inode must also match.
+    auto size = file_->size();
+    auto saved_size = read();
+    auto modification_time = read();
+    auto inode = read();
+    if (!file || saved_size != size || modification_time != file_->modification_time() || inode != file_->inode()) {
+        return false;
+    }
+
+    auto count = static_cast<size_t>(read());
+    if (!file || count > size) {
+        return false;
+    }
+
+    auto frames = std::vector<std::pair<size_t, size_t>>();
+    frames.reserve(count);
+    size_t previous = 0;
+    for (size_t i=0; i<count; i++) {
+        auto start = static_cast<size_t>(read());
+        auto end = static_cast<size_t>(read());
+        if (!file || start < previous || end <= start || end > size) {
+            return false;
+        }
+        frames.emplace_back(start, end);
+        previous = end;
+    }
+
+    // only check the last frame against the file content, checking all the
+    // frames would read the whole file again
+    if (!frames.empty()) {
+        auto start = frames.back().first;
+        if (start != 0 && file_->data()[start - 1] != '\n') {
+            return false;
+        }
+    }
+
+    frames_ = std::move(frames);
+    return true;
+}
+
+void XYZReader::scan(size_t offset, bool end_of_file) {
+    auto begin = file_->data();
+    auto end = begin + file_->size();
+    auto current = begin + offset;
+    while (current < end) {
+        auto start = skip_blank_lines(current, end);
+        if (start == end) {
+            break;
+        }
+
+        auto next = XYZParser::frame_end(start, end, end_of_file);
+        if (next == nullptr) {
+            if (end_of_file) {
+                warn("ignoring incomplete frame at the end of '" + path_ + "'");
+            }
+            break;
+        }
+        frames_.emplace_back(start - begin, next - begin);
+        current = next;
+    }
+}
+
+size_t XYZReader::truncate_incomplete(const std::string& path) {
+    size_t nsteps = 0;
+    size_t complete = 0;
+    size_t size = 0;
+    {
+        MemoryMap file(path);
+        auto begin = file.data();
+        auto end = begin + file.size();
+        auto current = begin;
+        while (current < end) {
+            auto start = skip_blank_lines(current, end);
+            if (start == end) {
+                current = end;
+                break;
+            }
+
+            // a frame is only complete if its last line ends with a new line
+            auto next = XYZParser::frame_end(start, end, false);
+            if (next == nullptr) {
+                break;
+            }
+            nsteps++;
+            current = next;
+        }
+        complete = static_cast<size_t>(current - begin);
+        size = file.size();
+    }
+
+    if (complete != size) {
+        truncate_file(path, complete);
+    }
+    return nsteps;
+}
+
+size_t XYZReader::refresh() {
+    size_t offset = 0;
+    if (!frames_.empty()) {
+        // the last frame might still have been written to if it did not end
+        // with a new line, so we need to scan it again
+        auto last = frames_.back();
+        if (file_->data()[last.second - 1] != '\n') {
+            frames_.pop_back();
+            offset = last.first;
+        } else {
+            offset = last.second;
+        }
+    }
+
+    file_.reset(new MemoryMap(path_));
+    if (file_->size() < offset) {
+        throw CFilesError("the '" + path_ + "' file was truncated while reading it");
+    }
+    cache_.clear();
+    scan(offset, false);
+    return frames_.size();
+}
+
+void XYZReader::set_cell(UnitCell cell) {
+    parser_.set_cell(std::move(cell));
+    cache_.clear();
+}
+
+void XYZReader::set_topology(Topology topology) {
+    parser_.set_topology(std::move(topology));
+    cache_.clear();
+}
+
+bool XYZReader::read_cell(size_t step, UnitCell& cell) const {
+    if (step >= frames_.size()) {
+        return false;
+    }
+    auto data = file_->data();
+    cell = parser_.parse_cell(data + frames_[step].first, data + frames_[step].second);
+    return true;
+}
+
+bool XYZReader::parse_step(size_t step, Frame& frame) const {
+    if (step >= frames_.size()) {
+        return false;
+    }
+    auto data = file_->data();
+    parser_.parse(data + frames_[step].first, data + frames_[step].second, frame);
+    frame.set_step(step);
+    return true;
+}
+
+bool XYZReader::read_step(size_t step, Frame& frame) {
+    if (step >= frames_.size()) {
+        return false;
+    }
+
+    if (!cache_.take(step, frame)) {
+        prefetch(step);
+        auto found = cache_.take(step, frame);
+        assert(found);
+        (void)found;
+    }
+    last_step_ = step;
+    return true;
+}
+
+void XYZReader::prefetch(size_t step) {
+    auto stride = guess_stride(last_step_, step);
+    auto max_frames = max_batch_frames(threads_);
+
+    auto steps = std::vector<size_t>();
+    auto texts = std::vector<FrameCache::text_t>();
+    auto data = file_->data();
+    size_t bytes = 0;
+    for (auto current = step; current < frames_.size(); current += stride) {
+        auto& offsets = frames_[current];
+        steps.push_back(current);
+        texts.emplace_back(data + offsets.first, data + offsets.second);
+        bytes += offsets.second - offsets.first;
+        if (steps.size() >= max_frames || bytes >= MAX_BATCH_BYTES) {
+            break;
+        }
+    }
+
+    cache_.parse(parser_, std::move(steps), texts, threads_);
+}
+
+/// Sequential access to the text of the frames in a compressed XYZ file
+class XYZStream {
+public:
+    explicit XYZStream(const std::string& path): path_(path), decompressor_(path) {}
+
+    /// Find the next frame in the file, decompressing more data if needed.
+    /// The frame text is then in `[data() + begin, data() + end)`, until the
+    /// next call to `next` or `compact`. This returns `false` at the end of
+    /// the file.
+    bool next(size_t& begin, size_t& end) {
+        while (true) {
+            auto data = buffer_.data();
+            auto start = skip_blank_lines(data + position_, data + buffer_.size());
+            auto stop = data + buffer_.size();
+            if (start != stop) {
+                auto frame_end = XYZParser::frame_end(start, stop, end_of_file_);
+                if (frame_end != nullptr) {
+                    begin = static_cast<size_t>(start - data);
+                    end = static_cast<size_t>(frame_end - data);
+                    position_ = end;
+                    return true;
+                }
+            }
+
+            if (end_of_file_) {
+                if (start != stop) {
+                    warn_once("ignoring incomplete frame at the end of '" + path_ + "'");
+                }
+                position_ = buffer_.size();
+                return false;
+            }
+
+            if (!decompressor_.read(buffer_)) {
+                end_of_file_ = true;
+            }
+        }
+    }
+
+    /// Allow the data before the current position to be removed from the
+    /// buffer. The data is only moved once most of the buffer is unused, so
+    /// that calling this after every frame stays linear in the file size.
+    void compact() {
+        if (position_ <= buffer_.size() / 2) {
+            return;
+        }
+        buffer_.erase(buffer_.begin(), buffer_.begin() + static_cast<std::ptrdiff_t>(position_));
+        position_ = 0;
+    }
+
+    const char* data() const {
+        return buffer_.data();
+    }
+
+private:
+    std::string path_;
+    Decompressor decompressor_;
+    /// Decompressed data
+    std::vector<char> buffer_;
+    /// Position of the end of the last frame in the buffer
+    size_t position_ = 0;
+    /// Did we read all the data from the decompressor?
+    bool end_of_file_ = false;
+};
+
+CompressedXYZReader::CompressedXYZReader(std::string path):
+    path_(std::move(path)), threads_(default_threads())
+{
+    restart();
+}
+
+CompressedXYZReader::~CompressedXYZReader() = default;
+
+void CompressedXYZReader::restart() {
+    // destroy the previous stream first, stopping its decompression thread
+    stream_.reset();
+    stream_.reset(new XYZStream(path_));
+    next_step_ = 0;
+}
+
+size_t CompressedXYZReader::nsteps() {
+    if (nsteps_ == NO_STEP) {
+        XYZStream stream(path_);
+        size_t count = 0;
+        size_t begin = 0, end = 0;
+        while (stream.next(begin, end)) {
+            stream.compact();
+            count++;
+        }
+        nsteps_ = count;
+    }
+    return nsteps_;
+}
+
+void CompressedXYZReader::set_cell(UnitCell cell) {
+    parser_.set_cell(std::move(cell));
+    cache_.clear();
+}
+
+void CompressedXYZReader::set_topology(Topology topology) {
+    parser_.set_topology(std::move(topology));
+    cache_.clear();
+}
+
+bool CompressedXYZReader::read_step(size_t step, Frame& frame) {
+    if (!cache_.take(step, frame)) {
+        prefetch(step);
+        if (!cache_.take(step, frame)) {
+            return false;
+        }
+    }
+    last_step_ = step;
+    return true;
+}
+
+void CompressedXYZReader::prefetch(size_t step) {
+    if (step < next_step_) {
+        restart();
+    }
+
+    auto stride = guess_stride(last_step_, step);
+    auto max_frames = max_batch_frames(threads_);
+
+    stream_->compact();
+    auto steps = std::vector<size_t>();
+    auto offsets = std::vector<std::pair<size_t, size_t>>();
+    size_t begin = 0, end = 0;
+    auto wanted = step;
+    bool end_of_file = true;
+    while (stream_->next(begin, end)) {
+        if (next_step_ == wanted) {
+            steps.push_back(next_step_);
+            offsets.emplace_back(begin, end);
+            wanted += stride;
+        }
+        next_step_++;
+
+        if (steps.empty()) {
+            // skipping frames before the requested step
+            stream_->compact();
+        } else if (steps.size() >= max_frames || end - offsets.front().first >= MAX_BATCH_BYTES) {
+            // the buffer contains all the frames since the start of this
+            // batch, including the ones we skipped because of the stride
+            end_of_file = false;
+            break;
+        }
+    }
+
+    if (end_of_file) {
+        // we went through the whole file, and know the number of steps
+        nsteps_ = next_step_;
+    }
+
+    // the buffer is no longer modified, the pointers stay valid
+    auto data = stream_->data();
+    auto texts = std::vector<FrameCache::text_t>();
+    for (auto& offset: offsets) {
+        texts.emplace_back(data + offset.first, data + offset.second);
+    }
+    cache_.parse(parser_, std::move(steps), texts, threads_);
+}
@@ -0,0 +1,228 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_XYZ_READER_HPP
+#define CFILES_XYZ_READER_HPP
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <chemfiles.hpp>
+
+#include "MemoryMap.hpp"
+
+/// Parser for single frames in XYZ format, including the extended XYZ
+/// `Lattice` and `Properties` comment line fields. Numbers are parsed without
+/// using the current locale.
+class XYZParser {
+public:
+    /// Use the given `cell` for all frames instead of the one in the file
+    void set_cell(chemfiles::UnitCell cell);
+    /// Use the given `topology` for all frames instead of the atomic names in
+    /// the file
+    void set_topology(chemfiles::Topology topology);
+
+    /// Parse the frame contained in `[begin, end)` into `frame`. The memory
+    /// already allocated by the `frame` is re-used, and the atoms are only
+    /// updated if they changed.
+    void parse(const char* begin, const char* end, chemfiles::Frame& frame) const;
+    /// Parse only the unit cell of the frame contained in `[begin, end)`,
+    /// without reading the atomic lines
+    chemfiles::UnitCell parse_cell(const char* begin, const char* end) const;
+
+    /// Find the end of the frame starting at `begin`, without parsing it. If
+    /// the frame is incomplete, this returns `nullptr`. If `end_of_file` is
+    /// false, more data could follow `end` and the last line of the frame
+    /// must be terminated by a new line.
+    static const char* frame_end(const char* begin, const char* end, bool end_of_file = true);
+
+private:
+    bool custom_cell_ = false;
+    chemfiles::UnitCell cell_;
+    bool custom_topology_ = false;
+    chemfiles::Topology topology_;
+};
+
+/// Frames parsed ahead of the requested steps by the XYZ readers
+class FrameCache {
+public:
+    /// Text of a single frame
+    using text_t = std::pair<const char*, const char*>;
+
+    /// If the frame at `step` is in the cache, swap it with `frame` and
+    /// return `true`. The previous content of `frame` is kept in the cache to
+    /// re-use its memory.
+    bool take(size_t step, chemfiles::Frame& frame);
+    /// Parse the frames from `texts` in parallel with up to `n_threads`
+    /// threads, replacing the content of the cache. `steps` contains the step
+    /// of each frame.
+    void parse(const XYZParser& parser, std::vector<size_t> steps, const std::vector<text_t>& texts, size_t n_threads);
+    /// Remove all the frames from the cache
+    void clear();
+
+private:
+    std::vector<chemfiles::Frame> frames_;
+    std::vector<size_t> steps_;
+};
+
+/// Fast reader for XYZ files. The file is memory-mapped, the frames positions
+/// are found by scanning for new lines, and frames are parsed in parallel in
+/// batches ahead of the requested steps.
+///
+/// If an index created by `save_index` exists next to the file and matches
+/// its size, modification time and inode, the frames positions are read from
+/// the index instead of scanning the whole file.
+class XYZReader {
+public:
+    /// Open the XYZ file at `path`. If `growing` is true, the file might
+    /// still be written to: the last frame is only used if it ends with a
+    /// new line, and incomplete frames at the end are ignored silently until
+    /// the next call to `refresh`.
+    explicit XYZReader(std::string path, bool growing = false);
+    /// Open the same file as `other`, re-using the memory map and the frames
+    /// positions it already found instead of scanning the file again. The
+    /// cell, topology and number of threads are also copied.
+    XYZReader(const XYZReader& other);
+    XYZReader& operator=(const XYZReader&) = delete;
+
+    /// Get the path of the index file for the XYZ file at `path`
+    static std::string index_path(const std::string& path);
+    /// Save the positions of all the frames in this file to the index file,
+    /// to be used the next time this file is opened
+    void save_index() const;
+
+    /// Get the start and end offsets in bytes of each frame in the file
+    const std::vector<std::pair<size_t, size_t>>& frame_offsets() const {
+        return frames_;
+    }
+
+    /// Get the number of steps in this file
+    size_t nsteps() const {return frames_.size();}
+
+    /// Remove any incomplete frame at the end of the XYZ file at `path`, for
+    /// example left by an interrupted write, and return the number of
+    /// complete frames in the file.
+    static size_t truncate_incomplete(const std::string& path);
+
+    /// Look for new frames added at the end of the file since it was opened
+    /// or last refreshed. Only the new data is scanned. This returns the new
+    /// number of steps.
+    size_t refresh();
+
+    /// Use the given `cell` for all frames instead of the one in the file
+    void set_cell(chemfiles::UnitCell cell);
+    /// Use the given `topology` for all frames instead of the atomic names in
+    /// the file
+    void set_topology(chemfiles::Topology topology);
+
+    /// Use up to `n_threads` threads to parse frames ahead of time. This
+    /// defaults to `default_threads()`.
+    void set_threads(size_t n_threads) {
+        threads_ = std::max(n_threads, static_cast<size_t>(1));
+    }
+
+    /// Read the frame at `step` into `frame`, re-using the memory of `frame`.
+    /// This returns `false` if `step` is past the end of the file.
+    bool read_step(size_t step, chemfiles::Frame& frame);
+    /// Read only the unit cell of the frame at `step` into `cell`, without
+    /// parsing the atoms. This returns `false` if `step` is past the end of
+    /// the file.
+    bool read_cell(size_t step, chemfiles::UnitCell& cell) const;
+    /// Parse the frame at `step` into `frame` without using the cache of
+    /// pre-parsed frames. Contrary to `read_step`, this function can be
+    /// called from multiple threads at the same time. This returns `false`
+    /// if `step` is past the end of the file.
+    bool parse_step(size_t step, chemfiles::Frame& frame) const;
+
+private:
+    /// Try to load the positions of the frames from the index file, and
+    /// return `false` if the index is missing or does not match the file
+    bool load_index();
+    /// Parse a batch of frames starting at `step` in the cache
+    void prefetch(size_t step);
+    /// Find the frames in the file, starting at `offset`. If `end_of_file` is
+    /// false, the file might still be growing and the last frame must end
+    /// with a new line.
+    void scan(size_t offset, bool end_of_file);
+
+    std::string path_;
+    /// File content, shared with the copies of this reader
+    std::shared_ptr<MemoryMap> file_;
+    /// Start and end offsets of each frame in the file
+    std::vector<std::pair<size_t, size_t>> frames_;
+    /// Parser for individual frames
+    XYZParser parser_;
+    /// Number of threads used to parse frames
+    size_t threads_;
+    /// Already parsed frames
+    FrameCache cache_;
+    /// Last step requested in `read_step`, used to guess the stride between
+    /// steps when prefetching
+    size_t last_step_ = static_cast<size_t>(-1);
+};
+
+class XYZStream;
+
+/// Reader for gzip or xz compressed XYZ files. The file is decompressed in a
+/// background thread, and frames are parsed in parallel in batches like in
+/// `XYZReader`. Reading steps in increasing order is efficient, but going
+/// back to a previous step restarts the decompression from the beginning.
+class CompressedXYZReader {
+public:
+    explicit CompressedXYZReader(std::string path);
+    ~CompressedXYZReader();
+
+    /// Get the number of steps in this file. Unless all the frames were
+    /// already read, the first call decompresses the whole file to count the
+    /// frames.
+    size_t nsteps();
+    /// Is the number of steps already known, without having to decompress
+    /// the whole file?
+    bool nsteps_known() const {
+        return nsteps_ != static_cast<size_t>(-1);
+    }
+
+    /// Use the given `cell` for all frames instead of the one in the file
+    void set_cell(chemfiles::UnitCell cell);
+    /// Use the given `topology` for all frames instead of the atomic names in
+    /// the file
+    void set_topology(chemfiles::Topology topology);
+
+    /// Use up to `n_threads` threads to parse frames ahead of time. This
+    /// defaults to `default_threads()`.
+    void set_threads(size_t n_threads) {
+        threads_ = std::max(n_threads, static_cast<size_t>(1));
+    }
+
+    /// Read the frame at `step` into `frame`, re-using the memory of `frame`.
+    /// This returns `false` if `step` is past the end of the file.
+    bool read_step(size_t step, chemfiles::Frame& frame);
+
+private:
+    /// Start reading again from the beginning of the file
+    void restart();
+    /// Parse a batch of frames starting at `step` in the cache
+    void prefetch(size_t step);
+
+    std::string path_;
+    /// Decompressed data
+    std::unique_ptr<XYZStream> stream_;
+    /// Step of the next frame in `stream_`
+    size_t next_step_ = 0;
+    /// Cached number of steps
+    size_t nsteps_ = static_cast<size_t>(-1);
+    /// Parser for individual frames
+    XYZParser parser_;
+    /// Number of threads used to parse frames
+    size_t threads_;
+    /// Already parsed frames
+    FrameCache cache_;
+    /// Last step requested in `read_step`, used to guess the stride between
+    /// steps when prefetching
+    size_t last_step_ = static_cast<size_t>(-1);
+};
+
+#endif
@@ -6,7 +6,9 @@
 #include <fstream>
 
 #include "Angles.hpp"
+#include "AtomicFile.hpp"
 #include "Errors.hpp"
+#include "Timings.hpp"
 #include "warnings.hpp"
 
 using namespace chemfiles;
@@ -22,11 +24,15 @@ angle can be specified using the chemfiles selection language. It is possible
 to provide an alternative unit cell or topology for the trajectory file if they
 are not defined in the trajectory format.
 
+Multiple trajectories can be given as independent replicas of the same system.
+They are processed in parallel, and the output then contains the weighted
+average distribution and its standard deviation between replicas.
+
 For more information about chemfiles selection language, please see
 http://chemfiles.github.io/chemfiles/latest/selections.html
 
 Usage:
-  cfiles angles [options] <trajectory>
+  cfiles angles [options] <trajectory>...
   cfiles angles (-h | --help)
 
 Examples:
@@ -35,6 +41,7 @@ Examples:
   cfiles angles methane.xyz --cell 15:15:25 --guess-bonds --points=150
   cfiles angles result.xtc --topology=initial.mol --topology-format=PDB
   cfiles angles simulation.pdb --steps=:1000:5 -o partial-angles.dat
+  cfiles angles first.xtc second.xtc --replica-weights=2:1
 
 Options:
   -h --help                     show this help
@@ -78,27 +85,43 @@ Averager Angles::setup(int argc, const char* argv[]) {
     }
 }
 
+std::unique_ptr<AveCommand> Angles::replica() const {
+    return std::unique_ptr<AveCommand>(new Angles());
+}
+
 void Angles::finish(const Histogram& histogram) {
     double sum = 0;
     for (size_t i=0; i<histogram.size(); i++) {
         sum += rad2deg(histogram.first().width) * histogram[i];
     }
 
-    std::ofstream outfile(options_.outfile, std::ios::out);
+    AtomicFile outfile(output_path(options_.outfile));
     if(outfile.is_open()) {
         outfile << "# Angles distribution in trajectory " << AveCommand::options().trajectory << std::endl;
+        write_replicas(outfile);
+        write_convergence(outfile);
         outfile << "# Selection: " << options_.selection << std::endl;
 
+        bool replicas = AveCommand::options().replicas.size() > 1;
         for (size_t i=0; i<histogram.size(); i++) {
-            outfile << rad2deg(histogram.first().coord(i)) << "  " << histogram[i] / sum << "\n";
+            outfile << rad2deg(histogram.first().coord(i)) << "  " << histogram[i] / sum;
+            if (replicas) {
+                outfile << "  " << spread()[i] / sum;
+            }
+            outfile << "\n";
         }
+        outfile.commit();
     } else {
         throw CFilesError("Could not open the '" + options_.outfile + "' file.");
     }
 }
 
 void Angles::accumulate(const Frame& frame, Histogram& histogram) {
-    auto matched = selection_.evaluate(frame);
+    auto matched = std::vector<Match>();
+    {
+        ScopedTimer timer(Phase::Select);
+        matched = selection_.evaluate(frame);
+    }
     if (matched.empty()) {
         warn_once(
             "No angle corresponding to '" + selection_.string() + "' found."
@@ -24,6 +24,7 @@ public:
     Averager setup(int argc, const char* argv[]) override;
     void accumulate(const chemfiles::Frame& frame, Histogram& histogram) override;
     void finish(const Histogram& histogram) override;
+    std::unique_ptr<AveCommand> replica() const override;
 
 private:
     /// Options for this instance of RDF
@@ -2,10 +2,23 @@
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
 #include <docopt/docopt.h>
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <numeric>
 #include <sstream>
+#include <thread>
 
 #include "AveCommand.hpp"
+#include "Autocorrelation.hpp"
 #include "Errors.hpp"
+#include "Timings.hpp"
+#include "TrajectoryReader.hpp"
+#include "parallel.hpp"
 #include "utils.hpp"
 #include "warnings.hpp"
 
@@ -13,6 +26,10 @@ using namespace chemfiles;
 
 const std::string AveCommand::AVERAGE_OPTIONS = R"(
   --format=<format>             force the input file format to be <format>
+  --fast-xyz                    use a faster reader for XYZ files, parsing
+                                multiple frames in parallel. Compressed
+                                .xyz.gz and .xyz.xz files are decompressed in
+                                a separate thread
   -t <path>, --topology=<path>  alternative topology file for the input
   --topology-format=<format>    use <format> as format for the topology file
   --guess-bonds                 guess the bonds in the input
@@ -26,11 +43,79 @@ const std::string AveCommand::AVERAGE_OPTIONS = R"(
                                 <start> to <end> (excluded) by steps of
                                 <stride>. The default values are 0 for <start>,
                                 the number of steps for <end> and 1 for
-                                <stride>.)";
+                                <stride>.
+  --replica-weights=<weights>   weights to use when averaging over multiple
+                                replicas, as a colon separated list
+                                <w1:w2:...> with one value for each
+                                trajectory. By default, each replica is
+                                weighted by its number of frames
+  --checkpoint=<file>           periodically save the state of the
+                                computation to <file>, in a binary format.
+                                When using multiple replicas, the replica
+                                index is appended to <file> for all replicas
+                                but the first
+  --checkpoint-every=<n>        number of frames between two checkpoints
+                                [default: 1000]
+  --resume                      resume the computation from the state saved
+                                in the --checkpoint file, if it exists. The
+                                --steps must be the same as when creating
+                                the checkpoint
+  --follow                      keep reading new frames as they are added to
+                                the trajectory, updating the output file
+                                after each batch of new frames. This runs
+                                until interrupted, or until the end of
+                                --steps is reached
+  --follow-interval=<time>      time in seconds between two checks for new
+                                frames when using --follow [default: 10]
+  --window=<n>                  compute time-resolved results, averaging over
+                                a sliding window of <n> frames. The results
+                                for each window are written to the output
+                                file name with the last step of the window
+                                added before the extension, and the main
+                                output contains the last window
+  --window-every=<k>            number of frames between two outputs when
+                                using --window. This default to the window
+                                size, giving non-overlapping windows
+  --auto-stride                 choose the stride between frames to use
+                                roughly uncorrelated frames. The statistical
+                                inefficiency of the mean of the histogram is
+                                estimated over the first frames, and the
+                                stride from --steps is multiplied by it
+  --auto-stride-frames=<n>      number of frames used to estimate the
+                                statistical inefficiency with --auto-stride
+                                [default: 500]
+  --converge=<tol>              stop reading the trajectory once the average
+                                converged. The average is compared with the
+                                one at the previous check, and the run stops
+                                when the maximal change in a bin, relative to
+                                the largest value, stays below <tol> for 3
+                                consecutive checks
+  --converge-every=<n>          number of frames between two convergence
+                                checks with --converge [default: 100]
+  --threads=<n>                 number of threads used to process a single
+                                frame with many atoms. This defaults to all
+                                the available threads, divided between the
+                                replicas
+  --timings                     print a summary of the time spent in the
+                                different phases of the run to the standard
+                                error
+  --trace=<file>                record begin and end events for the phases of
+                                each frame on all threads, and write them to
+                                <file> in Chrome trace-event JSON format)";
 
 void AveCommand::parse_options(const std::map<std::string, docopt::value>& args) {
-    options_.trajectory = args.at("<trajectory>").asString();
+    options_.replicas = args.at("<trajectory>").asStringList();
+    options_.trajectory = options_.replicas[0];
     options_.guess_bonds = args.at("--guess-bonds").asBool();
+    options_.fast_xyz = args.at("--fast-xyz").asBool();
+
+    if (args.at("--timings").asBool()) {
+        Timings::enable();
+    }
+
+    if (args.at("--trace")) {
+        Trace::enable(args.at("--trace").asString());
+    }
 
     if (args.at("--steps")) {
         options_.steps = steps_range::parse(args.at("--steps").asString());
@@ -58,47 +143,565 @@ void AveCommand::parse_options(const std::map<std::string, docopt::value>& args)
         options_.custom_cell = true;
         options_.cell = parse_cell(args.at("--cell").asString());
     }
+
+    if (args.at("--checkpoint")) {
+        options_.checkpoint = args.at("--checkpoint").asString();
+    }
+
+    auto checkpoint_every = string2long(args.at("--checkpoint-every").asString());
+    if (checkpoint_every <= 0) {
+        throw CFilesError("'--checkpoint-every' must be positive");
+    }
+    options_.checkpoint_every = static_cast<size_t>(checkpoint_every);
+
+    options_.resume = args.at("--resume").asBool();
+    if (options_.resume && options_.checkpoint.empty()) {
+        throw CFilesError("Can not use '--resume' without a '--checkpoint'");
+    }
+
+    options_.follow = args.at("--follow").asBool();
+    if (options_.follow && options_.replicas.size() > 1) {
+        throw CFilesError("Can not use '--follow' with multiple trajectories");
+    }
+    options_.follow_interval = string2double(args.at("--follow-interval").asString());
+    if (options_.follow_interval <= 0) {
+        throw CFilesError("'--follow-interval' must be positive");
+    }
+
+    if (args.at("--window")) {
+        auto window = string2long(args.at("--window").asString());
+        if (window <= 0) {
+            throw CFilesError("'--window' must be positive");
+        }
+        if (options_.replicas.size() > 1) {
+            throw CFilesError("Can not use '--window' with multiple trajectories");
+        }
+        options_.window = static_cast<size_t>(window);
+        options_.window_every = options_.window;
+    }
+
+    if (args.at("--window-every")) {
+        if (options_.window == 0) {
+            throw CFilesError("Can not use '--window-every' without '--window'");
+        }
+        auto every = string2long(args.at("--window-every").asString());
+        if (every <= 0) {
+            throw CFilesError("'--window-every' must be positive");
+        }
+        options_.window_every = static_cast<size_t>(every);
+    }
+
+    options_.auto_stride = args.at("--auto-stride").asBool();
+    auto auto_stride_frames = string2long(args.at("--auto-stride-frames").asString());
+    if (auto_stride_frames < 2) {
+        throw CFilesError("'--auto-stride-frames' must be at least 2");
+    }
+    options_.auto_stride_frames = static_cast<size_t>(auto_stride_frames);
+
+    if (args.at("--converge")) {
+        options_.converge = string2double(args.at("--converge").asString());
+        if (options_.converge <= 0) {
+            throw CFilesError("'--converge' must be positive");
+        }
+        if (options_.window != 0) {
+            throw CFilesError("Can not use both '--converge' and '--window'");
+        }
+    }
+    auto converge_every = string2long(args.at("--converge-every").asString());
+    if (converge_every <= 0) {
+        throw CFilesError("'--converge-every' must be positive");
+    }
+    options_.converge_every = static_cast<size_t>(converge_every);
+
+    if (args.at("--threads")) {
+        auto threads = string2long(args.at("--threads").asString());
+        if (threads <= 0) {
+            throw CFilesError("'--threads' must be positive");
+        }
+        options_.threads = static_cast<size_t>(threads);
+    }
+
+    if (args.at("--replica-weights")) {
+        options_.weights.clear();
+        for (auto& weight: split(args.at("--replica-weights").asString(), ':')) {
+            options_.weights.push_back(string2double(weight));
+            if (options_.weights.back() < 0) {
+                throw CFilesError("replica weights can not be negative");
+            }
+        }
+        if (options_.weights.size() != options_.replicas.size()) {
+            throw CFilesError(
+                "expected " + std::to_string(options_.replicas.size()) +
+                " values for '--replica-weights', got " + std::to_string(options_.weights.size())
+            );
+        }
+    }
+}
+
+/// Number of consecutive checks below the tolerance to consider that the
+/// average converged
+static const size_t CONVERGENCE_CHECKS = 3;
+
+void AveCommand::write_convergence(std::ostream& output) const {
+    if (options_.converge == 0) {
+        return;
+    }
+    output << "# Convergence criterion: maximal relative change of the average below ";
+    output << options_.converge << " for " << CONVERGENCE_CHECKS << " checks every ";
+    output << options_.converge_every << " frames" << std::endl;
+
+    auto all = replicas_convergence_;
+    if (all.empty()) {
+        all.push_back(convergence_);
+    }
+    for (size_t i=0; i<all.size(); i++) {
+        output << "# ";
+        if (all.size() > 1) {
+            output << options_.replicas[i] << ": ";
+        }
+        if (all[i].step != static_cast<size_t>(-1)) {
+            output << "converged at step " << all[i].step;
+        } else {
+            output << "did not converge";
+        }
+        if (all[i].change >= 0) {
+            output << " (last relative change " << all[i].change << ")";
+        }
+        output << std::endl;
+    }
+}
+
+void AveCommand::write_replicas(std::ostream& output) const {
+    if (options_.replicas.size() < 2) {
+        return;
+    }
+    output << "# Averaged over " << options_.replicas.size() << " replicas:" << std::endl;
+    for (size_t i=0; i<options_.replicas.size(); i++) {
+        output << "#     " << options_.replicas[i] << " (weight " << options_.weights[i] << ")" << std::endl;
+    }
+}
+
+size_t AveCommand::frame_threads() const {
+    if (options_.threads != 0) {
+        return options_.threads;
+    }
+    return std::max(default_threads() / options_.replicas.size(), static_cast<size_t>(1));
 }
 
 int AveCommand::run(int argc, const char* argv[]) {
     histogram_ = setup(argc, argv);
+    histogram_.set_window(options_.window);
+
+    if (options_.auto_stride) {
+        choose_stride(argc, argv);
+    }
+
+    // Each additional replica uses its own instance of the command, with
+    // separated histograms and selections
+    auto replicas = std::vector<std::unique_ptr<AveCommand>>();
+    auto commands = std::vector<AveCommand*>{this};
+    for (size_t i=1; i<options_.replicas.size(); i++) {
+        replicas.emplace_back(replica());
+        auto& command = *replicas.back();
+        command.histogram_ = command.setup(argc, argv);
+        command.options_.trajectory = options_.replicas[i];
+        command.options_.steps = options_.steps;
+        if (!options_.checkpoint.empty()) {
+            command.options_.checkpoint = options_.checkpoint + "." + std::to_string(i);
+        }
+        commands.push_back(&command);
+    }
+
+    // Process all the replicas concurrently, each one in its own thread
+    parallel_for(commands.size(), [&](size_t i) {
+        commands[i]->accumulate_trajectory();
+    }, commands.size());
+
+    if (commands.size() > 1) {
+        for (auto command: commands) {
+            replicas_convergence_.push_back(command->convergence_);
+        }
+    }
+
+    {
+        ScopedTimer timer(Phase::Normalize);
+        for (auto command: commands) {
+            command->histogram_.average();
+        }
+
+        if (options_.weights.empty()) {
+            for (auto command: commands) {
+                options_.weights.push_back(static_cast<double>(command->histogram_.nsteps()));
+            }
+        }
+
+        auto others = std::vector<AveCommand*>(commands.begin() + 1, commands.end());
+        if (!others.empty()) {
+            auto histograms = std::vector<const Histogram*>();
+            for (auto command: commands) {
+                histograms.push_back(&command->histogram_);
+            }
+            combine_histograms(histograms, options_.weights, histogram_, spread_);
+        }
+        combine(others, options_.weights);
+    }
+
+    {
+        ScopedTimer timer(Phase::Write);
+        finish(histogram_);
+    }
+
+    if (options_.auto_stride) {
+        size_t used = 0;
+        size_t skipped = 0;
+        for (auto command: commands) {
+            auto nsteps = command->histogram_.nsteps();
+            used += nsteps;
+            if (nsteps != 0) {
+                skipped += (nsteps - 1) * (stride_factor_ - 1);
+            }
+        }
+        // remaining correlation between the used frames. The used frames can
+        // at best be independent, which happens when this is below 1.
+        auto residual = inefficiency_ / static_cast<double>(stride_factor_);
+        auto effective = static_cast<double>(used) / std::max(1.0, residual);
+
+        fmt::print(std::cerr, "[cfiles] auto-stride: statistical inefficiency of {:.2f} frames\n", inefficiency_);
+        fmt::print(std::cerr, "    {:<32}{:>12}\n", "stride", options_.steps.stride());
+        fmt::print(std::cerr, "    {:<32}{:>12}\n", "used frames", used);
+        fmt::print(std::cerr, "    {:<32}{:>12}\n", "skipped frames", skipped);
+        fmt::print(std::cerr, "    {:<32}{:>12.2f}\n", "residual inefficiency", residual);
+        fmt::print(std::cerr, "    {:<32}{:>12.1f}\n", "effective sample size", effective);
+    }
+    return 0;
+}
 
-    auto file = Trajectory(options_.trajectory);
+std::unique_ptr<TrajectoryReader> AveCommand::open_trajectory() const {
+    auto file = std::unique_ptr<TrajectoryReader>(
+        new TrajectoryReader(options_.trajectory, options_.format, options_.fast_xyz, options_.follow)
+    );
     if (options_.custom_cell) {
-        file.set_cell(options_.cell);
+        file->set_cell(options_.cell);
     }
 
     if (options_.topology != "") {
-        file.set_topology(options_.topology, options_.topology_format);
+        file->set_topology(options_.topology, options_.topology_format);
     }
+    return file;
+}
 
-    size_t steps_done = 0;
+/// Get the mean bin index of the `histogram`, weighted by the value in each
+/// bin. This is a cheap scalar summary of the data from a single frame.
+static double histogram_mean(const Histogram& histogram) {
+    double total = 0;
+    double mean = 0;
+    for (size_t i=0; i<histogram.size(); i++) {
+        total += histogram[i];
+        mean += static_cast<double>(i) * histogram[i];
+    }
+    return total == 0 ? 0 : mean / total;
+}
+
+/// Estimate the statistical inefficiency of the time serie `values`, i.e. the
+/// number of consecutive values corresponding to one independent sample.
+/// The normalized autocorrelation function is integrated until it first
+/// reaches zero.
+static double statistical_inefficiency(std::vector<float> values) {
+    auto size = values.size();
+    auto mean = std::accumulate(values.begin(), values.end(), 0.0) / static_cast<double>(size);
+    double variance = 0;
+    for (auto& value: values) {
+        value = static_cast<float>(value - mean);
+        variance += static_cast<double>(value) * value;
+    }
+    variance /= static_cast<double>(size);
+    if (variance <= 1e-12 * mean * mean) {
+        // the values are constant, any stride gives the same result
+        return 1;
+    }
+
+    auto correlator = Autocorrelation(size);
+    correlator.add_timeserie(std::move(values));
+    correlator.normalize();
+    auto& correlation = correlator.get_result();
+
+    double inefficiency = 1;
+    for (size_t t=1; t<size; t++) {
+        auto rho = correlation[t] / correlation[0];
+        if (rho <= 0) {
+            break;
+        }
+        inefficiency += 2 * rho * (1.0 - static_cast<double>(t) / static_cast<double>(size));
+    }
+    return inefficiency;
+}
+
+void AveCommand::choose_stride(int argc, const char* argv[]) {
+    // Use a separate instance of the command to compute the observable, so
+    // that the frames used here do not enter the final average
+    auto pilot = replica();
+    pilot->histogram_ = pilot->setup(argc, argv);
+
+    auto file = open_trajectory();
+    file->set_steps(options_.steps);
+
+    auto values = std::vector<float>();
+    auto frame = Frame();
     for (auto step: options_.steps) {
-        if (step >= file.nsteps()) {
+        if (values.size() == options_.auto_stride_frames) {
             break;
         }
-        auto frame = file.read_step(step);
-        if (options_.guess_bonds) {
-            frame.guess_bonds();
+        {
+            ScopedTimer timer(Phase::Read, step);
+            if (!file->read_step(step, frame)) {
+                break;
+            }
+            if (options_.guess_bonds) {
+                frame.guess_bonds();
+            }
         }
-        if (!options_.custom_cell && frame.cell().shape() == UnitCell::INFINITE) {
-            warn_once(
-                "this frame has an infinite unit cell, it's not what you want most of the time"
-            );
+        {
+            ScopedTimer timer(Phase::Accumulate, step);
+            pilot->accumulate(frame, pilot->histogram_);
+        }
+        values.push_back(static_cast<float>(histogram_mean(pilot->histogram_)));
+        pilot->histogram_.step();
+    }
+
+    if (values.size() < 2) {
+        warn("not enough frames to estimate the stride with '--auto-stride'");
+        return;
+    }
+
+    {
+        ScopedTimer timer(Phase::Correlate);
+        inefficiency_ = statistical_inefficiency(std::move(values));
+    }
+    stride_factor_ = static_cast<size_t>(std::ceil(inefficiency_));
+    options_.steps = options_.steps.with_stride(options_.steps.stride() * stride_factor_);
+}
+
+void AveCommand::accumulate_trajectory() {
+    auto file_ptr = open_trajectory();
+    auto& file = *file_ptr;
+
+    auto steps = options_.steps;
+    if (options_.resume) {
+        steps = steps.starting_at(read_checkpoint());
+        if (steps.first() >= steps.last() || convergence_.step != static_cast<size_t>(-1)) {
+            // the checkpointed run already went through all the steps, or
+            // stopped after converging
+            return;
+        }
+    }
+    file.set_steps(steps);
+
+    size_t steps_done = 0;
+    bool converged = false;
+    auto next_step = steps.first();
+    auto frame = Frame();
+    while (true) {
+        for (auto step: steps.starting_at(next_step)) {
+            {
+                ScopedTimer timer(Phase::Read, step);
+                if (!file.read_step(step, frame)) {
+                    break;
+                }
+                if (options_.guess_bonds) {
+                    frame.guess_bonds();
+                }
+            }
+            if (!options_.custom_cell && frame.cell().shape() == UnitCell::INFINITE) {
+                warn_once(
+                    "this frame has an infinite unit cell, it's not what you want most of the time"
+                );
+            }
+            {
+                ScopedTimer timer(Phase::Accumulate, step);
+                accumulate(frame, histogram_);
+            }
+            {
+                ScopedTimer timer(Phase::Normalize, step);
+                histogram_.step();
+            }
+            Timings::count(Counter::Frames);
+            steps_done++;
+            next_step = step + steps.stride();
+
+            if (options_.window != 0 && histogram_.nsteps() == options_.window) {
+                auto index = (step - options_.steps.first()) / options_.steps.stride() + 1;
+                if ((index - options_.window) % options_.window_every == 0) {
+                    output_suffix_ = std::to_string(step);
+                    write_output();
+                    output_suffix_.clear();
+                }
+            }
+
+            if (!options_.checkpoint.empty() && steps_done % options_.checkpoint_every == 0) {
+                write_checkpoint(next_step);
+            }
+
+            if (options_.converge != 0 && steps_done % options_.converge_every == 0) {
+                if (check_convergence(step)) {
+                    converged = true;
+                    break;
+                }
+            }
+        }
+
+        if (converged || !options_.follow || next_step >= steps.last()) {
+            break;
+        }
+
+        // Update the output with the frames we have, and wait for new frames
+        // to be added to the trajectory
+        if (!options_.checkpoint.empty()) {
+            write_checkpoint(next_step);
+        }
+        if (histogram_.nsteps() != 0) {
+            write_output();
         }
-        accumulate(frame, histogram_);
-        histogram_.step();
-        steps_done++;
+        do {
+            std::this_thread::sleep_for(std::chrono::duration<double>(options_.follow_interval));
+        } while (file.refresh() <= next_step);
     }
 
-    if (steps_done == 0) {
+    if (!options_.checkpoint.empty()) {
+        write_checkpoint(next_step);
+    }
+
+    if (histogram_.nsteps() == 0) {
         warn(
             "We did not use any step of the trajectory. Is your '--steps' argument valid?"
         );
     }
+}
+
+std::string AveCommand::output_path(const std::string& path) const {
+    if (output_suffix_.empty()) {
+        return path;
+    }
 
-    histogram_.average();
+    auto dot = path.rfind('.');
+    auto slash = path.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return path + "." + output_suffix_;
+    }
+    return path.substr(0, dot) + "." + output_suffix_ + path.substr(dot);
+}
 
-    finish(histogram_);
-    return 0;
+void AveCommand::write_output() {
+    // Work on a copy of the histogram to be able to continue accumulating
+    // data in the original one
+    auto histogram = Histogram();
+    {
+        ScopedTimer timer(Phase::Normalize);
+        histogram = histogram_.averaged();
+        combine({}, {static_cast<double>(histogram_.nsteps())});
+    }
+    ScopedTimer timer(Phase::Write);
+    finish(histogram);
+}
+
+void AveCommand::write_checkpoint(size_t next_step) const {
+    ScopedTimer timer(Phase::Write);
+    CheckpointWriter checkpoint(options_.checkpoint);
+    checkpoint.write(static_cast<uint64_t>(options_.steps.first()));
+    checkpoint.write(static_cast<uint64_t>(options_.steps.last()));
+    checkpoint.write(static_cast<uint64_t>(options_.steps.stride()));
+    checkpoint.write(static_cast<uint64_t>(next_step));
+    histogram_.save(checkpoint);
+
+    checkpoint.write(static_cast<uint64_t>(converged_checks_));
+    checkpoint.write(static_cast<uint64_t>(convergence_.step));
+    checkpoint.write(std::vector<double>{convergence_.change});
+    auto previous = std::vector<double>(previous_average_.size());
+    for (size_t i=0; i<previous.size(); i++) {
+        previous[i] = previous_average_[i];
+    }
+    checkpoint.write(static_cast<uint64_t>(previous.size()));
+    checkpoint.write(previous);
+
+    save_checkpoint(checkpoint);
+    checkpoint.commit();
+}
+
+bool AveCommand::check_convergence(size_t step) {
+    ScopedTimer timer(Phase::Normalize, step);
+    auto average = histogram_.averaged();
+    if (previous_average_.size() == average.size()) {
+        double scale = 0;
+        double change = 0;
+        for (size_t i=0; i<average.size(); i++) {
+            scale = std::max(scale, std::abs(average[i]));
+            change = std::max(change, std::abs(average[i] - previous_average_[i]));
+        }
+        convergence_.change = scale == 0 ? 0 : change / scale;
+        if (convergence_.change < options_.converge) {
+            converged_checks_++;
+        } else {
+            converged_checks_ = 0;
+        }
+    }
+    previous_average_ = std::move(average);
+
+    if (converged_checks_ == CONVERGENCE_CHECKS) {
+        convergence_.step = step;
+        return true;
+    }
+    return false;
+}
+
+size_t AveCommand::read_checkpoint() {
+    if (!std::ifstream(options_.checkpoint).good()) {
+        warn("no checkpoint at '" + options_.checkpoint + "', starting from the beginning");
+        return options_.steps.first();
+    }
+
+    CheckpointReader checkpoint(options_.checkpoint);
+    auto first = static_cast<size_t>(checkpoint.read_u64());
+    auto last = static_cast<size_t>(checkpoint.read_u64());
+    auto stride = static_cast<size_t>(checkpoint.read_u64());
+    if (first != options_.steps.first() || last != options_.steps.last() || stride != options_.steps.stride()) {
+        throw CFilesError(
+            "the checkpoint at '" + options_.checkpoint + "' does not match " +
+            "the current options: it was created with a different '--steps' " +
+            "or '--auto-stride'"
+        );
+    }
+
+    auto next_step = static_cast<size_t>(checkpoint.read_u64());
+    if (next_step < first || (next_step - first) % stride != 0) {
+        throw CFilesError(
+            "the checkpoint at '" + options_.checkpoint + "' is corrupted: " +
+            "step " + std::to_string(next_step) + " is not part of '--steps'"
+        );
+    }
+    histogram_.load(checkpoint);
+
+    converged_checks_ = static_cast<size_t>(checkpoint.read_u64());
+    convergence_.step = static_cast<size_t>(checkpoint.read_u64());
+    auto change = std::vector<double>(1);
+    checkpoint.read(change);
+    convergence_.change = change[0];
+    auto previous = std::vector<double>(static_cast<size_t>(checkpoint.read_u64()));
+    checkpoint.read(previous);
+    if (previous.empty()) {
+        previous_average_ = Histogram();
+    } else {
+        previous_average_ = histogram_.averaged();
+        if (previous_average_.size() != previous.size()) {
+            throw CFilesError(
+                "the checkpoint at '" + options_.checkpoint + "' does not match " +
+                "the current options: expected " + std::to_string(previous_average_.size()) +
+                " values, got " + std::to_string(previous.size())
+            );
+        }
+        for (size_t i=0; i<previous.size(); i++) {
+            previous_average_[i] = previous[i];
+        }
+    }
+
+    load_checkpoint(checkpoint);
+    return next_step;
 }
@@ -5,22 +5,33 @@
 #define CFILES_AVERAGE_COMMAND_HPP
 
 #include <map>
+#include <memory>
+#include <ostream>
 #include <chemfiles.hpp>
 
 #include "Averager.hpp"
 #include "Command.hpp"
+#include "parallel.hpp"
 #include "utils.hpp"
 
 namespace docopt {
     struct value;
 }
 
+class TrajectoryReader;
+
 /// Base class for time-averaged computations
 class AveCommand: public Command {
 public:
     struct Options {
-        /// Input trajectory
+        /// Input trajectory. When using multiple replicas, this is the
+        /// trajectory of the first replica.
         std::string trajectory;
+        /// Trajectories for all the independent replicas of the system
+        std::vector<std::string> replicas;
+        /// Weights of the replicas. If empty, the number of frames used in
+        /// each replica is used as weight.
+        std::vector<double> weights;
         /// Specific format to use with the trajectory
         std::string format = "";
         /// Specific steps to use from the trajectory
@@ -35,6 +46,35 @@ public:
         std::string topology_format = "";
         /// Should we try to guess the topology?
         bool guess_bonds = false;
+        /// Should we use the fast XYZ reader?
+        bool fast_xyz = false;
+        /// Path of the checkpoint file, empty to disable checkpoints
+        std::string checkpoint = "";
+        /// Number of frames between checkpoints
+        size_t checkpoint_every = 1000;
+        /// Should we resume from the checkpoint?
+        bool resume = false;
+        /// Should we keep reading frames added to the trajectory?
+        bool follow = false;
+        /// Time in seconds between two checks for new frames
+        double follow_interval = 10;
+        /// Number of frames in the sliding window, 0 to average over all
+        /// frames
+        size_t window = 0;
+        /// Number of frames between two outputs when using a window
+        size_t window_every = 0;
+        /// Should we choose the stride from the correlation between frames?
+        bool auto_stride = false;
+        /// Number of frames used to estimate the correlation between frames
+        size_t auto_stride_frames = 500;
+        /// Tolerance on the relative change of the average to stop the run,
+        /// 0 to use all the steps
+        double converge = 0;
+        /// Number of frames between two convergence checks
+        size_t converge_every = 100;
+        /// Number of threads to use inside a single frame, 0 to use the
+        /// default
+        size_t threads = 0;
     };
 
     /// A strinc containing Doctopt style options for all time-averaged commands.
@@ -52,17 +92,130 @@ public:
     /// Finish the run, and write any output
     virtual void finish(const Histogram& histogram) = 0;
 
+    /// Create a new instance of this command, used to process an additional
+    /// replica. `setup` is called on the new instance with the same arguments
+    /// as this one.
+    virtual std::unique_ptr<AveCommand> replica() const = 0;
+    /// Combine command-specific data from the other `replicas` into this
+    /// instance, using the given `weights` (the first weight is for this
+    /// instance). This is called once before `finish`, with an empty
+    /// `replicas` when using a single trajectory.
+    virtual void combine(const std::vector<AveCommand*>& /*replicas*/, const std::vector<double>& /*weights*/) {}
+    /// Save command-specific accumulated data to a `checkpoint`. Commands
+    /// with additional averaged data should override this function and
+    /// `load_checkpoint`.
+    virtual void save_checkpoint(CheckpointWriter& /*checkpoint*/) const {}
+    /// Load command-specific accumulated data saved by `save_checkpoint`
+    virtual void load_checkpoint(CheckpointReader& /*checkpoint*/) {}
+
 protected:
     /// Get access to the options for this run
     const Options& options() const {return options_;}
     /// Parse the options from a doctop map/
     void parse_options(const std::map<std::string, docopt::value>& args);
 
+    /// Get the weighted standard deviation of the averaged histogram between
+    /// replicas. This is only set when using multiple replicas.
+    const Histogram& spread() const {return spread_;}
+    /// Write the list of replicas and their weights as comments to `output`,
+    /// if there is more than one replica
+    void write_replicas(std::ostream& output) const;
+    /// Write the convergence criterion and the step at which the run stopped
+    /// as comments to `output`, when using `--converge`
+    void write_convergence(std::ostream& output) const;
+    /// Get the path to use for the output file `path`. This is `path`, except
+    /// for time-resolved outputs when using a window.
+    std::string output_path(const std::string& path) const;
+    /// Get the number of threads to use when accumulating a single frame
+    size_t frame_threads() const;
+    /// Accumulate data for `size` work items in `histogram`, splitting the
+    /// items between threads if there are at least `grain` items per thread.
+    /// `function(begin, end, histogram)` is called for each range of items,
+    /// with a private histogram for each thread, and the private histograms
+    /// are added to `histogram` at the end.
+    template <typename Function>
+    void parallel_accumulate(size_t size, size_t grain, Histogram& histogram, Function function);
+
 private:
+    /// Open this command's trajectory, with the custom cell and topology
+    std::unique_ptr<TrajectoryReader> open_trajectory() const;
+    /// Accumulate the data from all the frames in this command's trajectory
+    void accumulate_trajectory();
+    /// Estimate the statistical inefficiency of the data over the first
+    /// frames, and use a stride giving roughly uncorrelated frames
+    void choose_stride(int argc, const char* argv[]);
+    /// Write the output with the data accumulated so far, while keeping the
+    /// ability to accumulate more data
+    void write_output();
+    /// Write a checkpoint with the current state, to resume at `next_step`
+    void write_checkpoint(size_t next_step) const;
+    /// Read the state from the checkpoint, and get the next step to use
+    size_t read_checkpoint();
+    /// Compare the current average with the one from the previous check,
+    /// after using the frame at `step`. This returns `true` once the average
+    /// converged.
+    bool check_convergence(size_t step);
+
+    /// Convergence status of a trajectory
+    struct Convergence {
+        /// Step at which the average converged, or -1
+        size_t step;
+        /// Last relative change of the average, or -1 if it was not checked
+        double change;
+    };
+
     /// Options
     Options options_;
     /// Averaging histogram for the data
     Averager histogram_;
+    /// Standard deviation of the histogram between replicas
+    Histogram spread_;
+    /// Suffix to add to the output files, used for time-resolved outputs
+    std::string output_suffix_;
+    /// Statistical inefficiency estimated with `--auto-stride`, in units of
+    /// the initial stride
+    double inefficiency_ = 1;
+    /// Factor between the stride chosen with `--auto-stride` and the
+    /// initial stride
+    size_t stride_factor_ = 1;
+    /// Average at the previous convergence check
+    Histogram previous_average_;
+    /// Number of consecutive convergence checks below the tolerance
+    size_t converged_checks_ = 0;
+    /// Convergence status of this command's trajectory
+    Convergence convergence_ = {static_cast<size_t>(-1), -1};
+    /// Convergence status of all the replicas, set at the end of `run`
+    std::vector<Convergence> replicas_convergence_;
+    /// Private histograms for each thread in `parallel_accumulate`, kept
+    /// around to re-use the memory
+    std::vector<Histogram> thread_histograms_;
 };
 
+template <typename Function>
+void AveCommand::parallel_accumulate(size_t size, size_t grain, Histogram& histogram, Function function) {
+    auto n_threads = std::min(frame_threads(), size / std::max(grain, static_cast<size_t>(1)));
+    if (n_threads <= 1) {
+        function(static_cast<size_t>(0), size, histogram);
+        return;
+    }
+
+    thread_histograms_.resize(n_threads);
+    auto chunk = (size + n_threads - 1) / n_threads;
+    parallel_for(n_threads, [&](size_t thread) {
+        // copy the dimensions of the histogram, re-using the memory from
+        // previous frames
+        auto& local = thread_histograms_[thread];
+        local = histogram;
+        local.clear();
+
+        auto begin = std::min(thread * chunk, size);
+        auto end = std::min(begin + chunk, size);
+        function(begin, end, local);
+    }, n_threads);
+
+    for (size_t thread=0; thread<n_threads; thread++) {
+        histogram.add(thread_histograms_[thread]);
+    }
+}
+
 #endif
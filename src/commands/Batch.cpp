@@ -0,0 +1,225 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <thread>
+
+#include <docopt/docopt.h>
+#include <fmt/format.h>
+
+#include "Batch.hpp"
+#include "CommandFactory.hpp"
+#include "Errors.hpp"
+#include "Timings.hpp"
+#include "parallel.hpp"
+#include "utils.hpp"
+#include "warnings.hpp"
+
+static const char OPTIONS[] =
+R"(Run the same command on many files, using multiple threads. All the
+arguments between <command> and `--` are given to the command, followed by
+the input file. The arguments can contain templates, which are replaced by
+values for each input file:
+
+  {path}    full path of the input file
+  {dir}     directory containing the input file
+  {name}    name of the input file, without the directory
+  {stem}    name of the input file, without the directory and extension
+  {index}   index of the input file in the list of files, starting at 0
+
+If any argument contains {path}, the input file is not added at the end of the
+arguments. Failures on a given file are reported as warnings, without stopping
+the other files.
+
+The available cores are shared between the files processed in parallel, each
+command using a fraction of them for its own parallel work. Timings and traces
+are collected for the whole batch, with the --timings and --trace options of
+batch itself; they can not be given to the command.
+
+Usage:
+  cfiles batch [options] <command> <arguments>...
+  cfiles batch (-h | --help)
+
+Examples:
+  cfiles batch density --axis=Z -o {dir}/{stem}.density.dat -- *.xyz
+  cfiles batch info -o {name}.info -- run-*/trajectory.nc
+  cfiles batch -j 4 rdf -s "name O" -- replica-*.xtc
+  cfiles batch merge {path} water.pdb -o {stem}-solvated.pdb -- solutes/*.pdb
+
+Options:
+  -h --help                     show this help
+  -j <n>, --jobs=<n>            number of files to process in parallel. This
+                                default to the number of available cores
+  --timings                     print a summary of the time spent in the
+                                different phases of the run for all the files
+                                to the standard error
+  --trace=<file>                record begin and end events for the phases of
+                                each frame on all threads, and write them to
+                                <file> in Chrome trace-event JSON format
+)";
+
+/// Replace all the templates in `argument` with values for the file at `path`
+static std::string expand_templates(std::string argument, const std::string& path, size_t index) {
+    auto slash = path.find_last_of("/\\");
+    auto dir = slash == std::string::npos ? std::string(".") : path.substr(0, slash);
+    auto name = slash == std::string::npos ? path : path.substr(slash + 1);
+    auto dot = name.rfind('.');
+    auto stem = (dot == std::string::npos || dot == 0) ? name : name.substr(0, dot);
+
+    auto replace = [&argument](const std::string& pattern, const std::string& value) {
+        auto position = argument.find(pattern);
+        while (position != std::string::npos) {
+            argument.replace(position, pattern.size(), value);
+            position = argument.find(pattern, position + value.size());
+        }
+    };
+
+    replace("{path}", path);
+    replace("{dir}", dir);
+    replace("{name}", name);
+    replace("{stem}", stem);
+    replace("{index}", std::to_string(index));
+    return argument;
+}
+
+static Batch::Options parse_options(int argc, const char* argv[]) {
+    auto options_str = command_header("batch", Batch().description());
+    options_str += "Guillaume Fraux <guillaume@fraux.fr>\n\n";
+    options_str += OPTIONS;
+    // Use options_first to give all options after <command> to the command
+    auto args = docopt::docopt(options_str, {argv, argv + argc}, true, "", true);
+
+    Batch::Options options;
+    options.command = args["<command>"].asString();
+    if (options.command == "batch") {
+        throw CFilesError("can not use batch recursively");
+    }
+    // check that the command exists before starting
+    get_command(options.command);
+
+    auto arguments = args["<arguments>"].asStringList();
+    auto separator = std::find(arguments.begin(), arguments.end(), "--");
+    if (separator == arguments.end()) {
+        throw CFilesError("missing '--' between the command arguments and the input files");
+    }
+    options.arguments = std::vector<std::string>(arguments.begin(), separator);
+    for (auto& argument: options.arguments) {
+        // timings and traces are global, and can not be collected separately
+        // for commands running at the same time
+        if (argument == "--timings" || argument.compare(0, 7, "--trace") == 0) {
+            throw CFilesError(
+                "'" + argument + "' can not be given to the command, "
+                "use 'cfiles batch --timings' or 'cfiles batch --trace' instead"
+            );
+        }
+    }
+    options.files = std::vector<std::string>(separator + 1, arguments.end());
+    if (options.files.empty()) {
+        throw CFilesError("no input file given after '--'");
+    }
+
+    if (args["--jobs"]) {
+        auto jobs = string2long(args["--jobs"].asString());
+        if (jobs <= 0) {
+            throw CFilesError("the number of jobs must be positive");
+        }
+        options.threads = static_cast<size_t>(jobs);
+    } else {
+        options.threads = default_threads();
+    }
+
+    if (args["--timings"].asBool()) {
+        Timings::enable();
+    }
+
+    if (args["--trace"]) {
+        Trace::enable(args["--trace"].asString());
+    }
+
+    return options;
+}
+
+std::string Batch::description() const {
+    return "run a command on multiple files";
+}
+
+int Batch::run(int argc, const char* argv[]) {
+    options_ = parse_options(argc, argv);
+    auto errors = std::vector<std::string>(options_.files.size());
+
+    // share the cores between the commands running at the same time
+    auto n_threads = std::min(options_.threads, std::max(options_.files.size() - 1, static_cast<size_t>(1)));
+    set_threads_limit(std::max(default_threads() / n_threads, static_cast<size_t>(1)));
+
+    // The first file is processed on this thread, so that invalid arguments
+    // for the command are reported once, before starting the other threads.
+    errors[0] = process(0);
+
+    std::atomic<size_t> next(1);
+    auto worker = [&]() {
+        while (true) {
+            auto index = next++;
+            if (index >= options_.files.size()) {
+                return;
+            }
+            errors[index] = process(index);
+        }
+    };
+
+    n_threads = std::min(n_threads, options_.files.size() - 1);
+    auto threads = std::vector<std::thread>();
+    for (size_t i=0; i<n_threads; i++) {
+        threads.emplace_back(worker);
+    }
+    for (auto& thread: threads) {
+        thread.join();
+    }
+
+    size_t failed = 0;
+    for (size_t i=0; i<options_.files.size(); i++) {
+        if (!errors[i].empty()) {
+            warn("failed to process '" + options_.files[i] + "': " + errors[i]);
+            failed++;
+        }
+    }
+
+    if (failed != 0) {
+        warn(fmt::format("{} out of {} files failed", failed, options_.files.size()));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+std::string Batch::process(size_t index) const {
+    auto& path = options_.files[index];
+
+    auto arguments = std::vector<std::string>{options_.command};
+    bool has_path = false;
+    for (auto& argument: options_.arguments) {
+        if (argument.find("{path}") != std::string::npos) {
+            has_path = true;
+        }
+        arguments.push_back(expand_templates(argument, path, index));
+    }
+    if (!has_path) {
+        arguments.push_back(path);
+    }
+
+    auto argv = std::vector<const char*>();
+    for (auto& argument: arguments) {
+        argv.push_back(argument.c_str());
+    }
+
+    try {
+        auto command = get_command(options_.command);
+        auto status = command->run(static_cast<int>(argv.size()), argv.data());
+        if (status != 0) {
+            return "the command returned the status " + std::to_string(status);
+        }
+    } catch (const std::exception& e) {
+        return e.what();
+    }
+    return "";
+}
@@ -0,0 +1,37 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_BATCH_HPP
+#define CFILES_BATCH_HPP
+
+#include <string>
+#include <vector>
+
+#include "Command.hpp"
+
+class Batch final: public Command {
+public:
+    struct Options {
+        /// Name of the command to run on all files
+        std::string command;
+        /// Arguments for the command, which can contain templates
+        std::vector<std::string> arguments;
+        /// Input files
+        std::vector<std::string> files;
+        /// Number of files to process in parallel
+        size_t threads = 1;
+    };
+
+    Batch() {}
+    int run(int argc, const char* argv[]) override;
+    std::string description() const override;
+
+private:
+    /// Run the command on the file at `index`, and return an error message
+    /// or an empty string if everything went fine.
+    std::string process(size_t index) const;
+
+    Options options_;
+};
+
+#endif
@@ -2,11 +2,22 @@
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
 #include <docopt/docopt.h>
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <mutex>
 #include <sstream>
-#include <set>
+#include <thread>
 
+#include "BoundedQueue.hpp"
 #include "Convert.hpp"
 #include "Errors.hpp"
+#include "Timings.hpp"
+#include "TrajectoryReader.hpp"
+#include "XYZReader.hpp"
+#include "parallel.hpp"
 #include "utils.hpp"
 
 using namespace chemfiles;
@@ -36,6 +47,10 @@ Examples:
 Options:
   -h --help                     show this help
   --input-format=<format>       force the input file format to be <format>
+  --fast-xyz                    use a faster reader for XYZ files, parsing
+                                multiple frames in parallel. Compressed
+                                .xyz.gz and .xyz.xz files are decompressed in
+                                a separate thread
   --output-format=<format>      force the output file format to be <format>
   -t <path>, --topology=<path>  alternative topology file for the input
   --topology-format=<format>    use <format> as format for the topology file
@@ -64,6 +79,26 @@ Options:
                                 of mass to center inside the cell [default: all]
   -s <sel>, --selection=<sel>   selection to use for the output file
                                 [default: all]
+  --resume                      continue an interrupted conversion. The
+                                complete frames already in the output are
+                                kept, anything after them is removed, and the
+                                conversion continues with the corresponding
+                                step of the input. This is only supported for
+                                XYZ output
+  -j <n>, --jobs=<n>            convert the trajectory in <n> chunks in
+                                parallel, writing each chunk to a temporary
+                                file before concatenating them in the output.
+                                This is only supported for XYZ and GRO
+                                output. Compressed XYZ input with --fast-xyz
+                                is not split in chunks, since each chunk would
+                                need to decompress the file from the start
+                                [default: 1]
+  --timings                     print a summary of the time spent in the
+                                different phases of the run to the standard
+                                error
+  --trace=<file>                record begin and end events for the phases of
+                                each frame on all threads, and write them to
+                                <file> in Chrome trace-event JSON format
 )";
 
 static Convert::Options parse_options(int argc, const char* argv[]) {
@@ -76,6 +111,7 @@ static Convert::Options parse_options(int argc, const char* argv[]) {
     options.infile = args.at("<input>").asString();
     options.outfile = args.at("<output>").asString();
     options.guess_bonds = args.at("--guess-bonds").asBool();
+    options.fast_xyz = args.at("--fast-xyz").asBool();
     options.wrap = args.at("--wrap").asBool();
     options.wrap_selection = args.at("--wrap-selection").asString();
     options.center = args.at("--center").asBool();
@@ -121,53 +157,178 @@ static Convert::Options parse_options(int argc, const char* argv[]) {
         options.cell = parse_cell(args.at("--cell").asString());
     }
 
+    auto jobs = string2long(args.at("--jobs").asString());
+    if (jobs <= 0) {
+        throw CFilesError("'--jobs' must be positive");
+    }
+    options.jobs = static_cast<size_t>(jobs);
+    options.resume = args.at("--resume").asBool();
+
+    if (args.at("--timings").asBool()) {
+        Timings::enable();
+    }
+
+    if (args.at("--trace")) {
+        Trace::enable(args.at("--trace").asString());
+    }
+
     return options;
 }
 
 
-std::string Convert::description() const {
-    return "convert trajectories between formats";
-}
+/// Extract a subset of the atoms from frames. The mapping between atoms in
+/// the input and in the subset, and the corresponding topology are only
+/// computed again when the selected atoms or the bonds in the input change.
+class FrameSubset {
+public:
+    /// Get a frame containing the atoms at the `kept` indexes of `frame`,
+    /// which must be sorted.
+    const Frame& extract(const Frame& frame, const std::vector<size_t>& kept) {
+        auto velocities = frame.velocities();
+        if (!velocities && subset_.velocities()) {
+            // there is no way to remove velocities from an existing frame
+            subset_ = Frame();
+            dirty_ = true;
+        }
 
-int Convert::run(int argc, const char* argv[]) {
-    auto options = parse_options(argc, argv);
+        auto& topology = frame.topology();
+        if (dirty_ || kept != kept_ || topology.size() != input_size_ || topology.bonds() != bonds_) {
+            kept_ = kept;
+            update_topology(topology);
+        } else {
+            // atoms can change from one frame to another, for example when
+            // reading per-atom properties
+            for (size_t i=0; i<kept_.size(); i++) {
+                if (!(subset_[i] == frame[kept_[i]])) {
+                    subset_[i] = frame[kept_[i]];
+                }
+            }
+        }
 
-    auto infile = Trajectory(options.infile, 'r', options.input_format);
-    auto outfile = Trajectory(options.outfile, 'w', options.output_format);
+        auto positions = frame.positions();
+        auto subset_positions = subset_.positions();
+        for (size_t i=0; i<kept_.size(); i++) {
+            subset_positions[i] = positions[kept_[i]];
+        }
 
-    if (options.custom_cell) {
-        infile.set_cell(options.cell);
-    }
+        if (velocities) {
+            if (!subset_.velocities()) {
+                subset_.add_velocities();
+            }
+            auto subset_velocities = *subset_.velocities();
+            for (size_t i=0; i<kept_.size(); i++) {
+                subset_velocities[i] = (*velocities)[kept_[i]];
+            }
+        }
 
-    if (options.topology != "") {
-        infile.set_topology(options.topology, options.topology_format);
-    }
+        subset_.set_cell(frame.cell());
+        subset_.set_step(frame.step());
+        for (auto& property: frame.properties()) {
+            subset_.set(property.first, property.second);
+        }
 
-    auto selection = Selection(options.selection);
-    auto wrap_sel = Selection(options.wrap_selection);
-    if (wrap_sel.size() != 1) {
-        throw CFilesError("the wrapping selection should act on atoms");
+        return subset_;
     }
-    auto center_sel = Selection(options.center_selection);
-    if (center_sel.size() != 1) {
-        throw CFilesError("the center selection should act on atoms");
-    }
-    for (auto step: options.steps) {
-        if (step >= infile.nsteps()) {
-            break;
+
+private:
+    /// Build the topology of the subset from the `input` topology
+    void update_topology(const Topology& input) {
+        static const size_t NOT_KEPT = static_cast<size_t>(-1);
+        auto remap = std::vector<size_t>(input.size(), NOT_KEPT);
+        for (size_t i=0; i<kept_.size(); i++) {
+            remap[kept_[i]] = i;
         }
-        auto frame = infile.read_step(step);
 
-        if (options.guess_bonds) {
+        auto topology = Topology();
+        topology.reserve(kept_.size());
+        for (auto i: kept_) {
+            topology.add_atom(input[i]);
+        }
+
+        auto& bonds = input.bonds();
+        auto& orders = input.bond_orders();
+        for (size_t i=0; i<bonds.size(); i++) {
+            auto first = remap[bonds[i][0]];
+            auto second = remap[bonds[i][1]];
+            if (first != NOT_KEPT && second != NOT_KEPT) {
+                topology.add_bond(first, second, orders[i]);
+            }
+        }
+
+        for (auto& residue: input.residues()) {
+            auto id = residue.id();
+            auto subset = id ? Residue(residue.name(), *id) : Residue(residue.name());
+            for (auto& property: residue.properties()) {
+                subset.set(property.first, property.second);
+            }
+            for (auto i: residue) {
+                if (remap[i] != NOT_KEPT) {
+                    subset.add_atom(remap[i]);
+                }
+            }
+            topology.add_residue(std::move(subset));
+        }
+
+        subset_.resize(kept_.size());
+        subset_.set_topology(topology);
+
+        input_size_ = input.size();
+        bonds_ = bonds;
+        dirty_ = false;
+    }
+
+    /// Indexes of the atoms in the subset, in the input frames
+    std::vector<size_t> kept_;
+    /// Number of atoms in the input when the topology was last updated
+    size_t input_size_ = 0;
+    /// Bonds in the input when the topology was last updated
+    std::vector<Bond> bonds_;
+    /// Does the topology needs to be updated?
+    bool dirty_ = true;
+    /// Frame containing the subset of atoms
+    Frame subset_;
+};
+
+std::string Convert::description() const {
+    return "convert trajectories between formats";
+}
+
+/// A single frame going through the conversion pipeline
+struct ConvertTask {
+    /// Step of the frame in the input
+    size_t step = 0;
+    /// The frame itself
+    Frame frame;
+    /// Indexes of the atoms to write, when using a selection
+    std::vector<size_t> kept;
+};
+
+/// Wrap, center and select atoms in frames. Each thread in the pipeline uses
+/// its own instance, since selections can not be evaluated concurrently.
+class FrameTransform {
+public:
+    explicit FrameTransform(const Convert::Options& options):
+        options_(options),
+        selection_(options.selection),
+        wrap_selection_(options.wrap_selection),
+        center_selection_(options.center_selection)
+    {}
+
+    /// Transform the frame in `task`, and set the list of atoms to keep
+    void apply(ConvertTask& task) {
+        ScopedTimer accumulate_timer(Phase::Accumulate, task.step);
+        auto& frame = task.frame;
+        if (options_.guess_bonds) {
             frame.guess_bonds();
         }
 
-        if (options.wrap) {
+        if (options_.wrap) {
             auto positions = frame.positions();
-            auto cell = frame.cell();
+            auto& cell = frame.cell();
 
-            if (options.wrap_selection != "all") {
-                for (auto i: wrap_sel.list(frame)) {
+            if (options_.wrap_selection != "all") {
+                ScopedTimer timer(Phase::Select, task.step);
+                for (auto i: wrap_selection_.list(frame)) {
                     positions[i] = cell.wrap(positions[i]);
                 }
             } else {
@@ -177,12 +338,13 @@ int Convert::run(int argc, const char* argv[]) {
             }
         }
 
-        if (options.center) {
+        if (options_.center) {
             auto positions = frame.positions();
             double total_mass = 0.0;
             auto com = Vector3D();
-            if (options.center_selection != "all") {
-                for (size_t i: center_sel.list(frame)) {
+            if (options_.center_selection != "all") {
+                ScopedTimer timer(Phase::Select, task.step);
+                for (size_t i: center_selection_.list(frame)) {
                     auto mass = frame[i].mass();
                     com = com + mass * positions[i];
                     total_mass += mass;
@@ -201,33 +363,310 @@ int Convert::run(int argc, const char* argv[]) {
             }
         }
 
-        if (options.selection != "all") {
-            auto matched = selection.evaluate(frame);
-
-            std::set<size_t> keep;
-            for (auto match: matched) {
+        task.kept.clear();
+        if (options_.selection != "all") {
+            ScopedTimer timer(Phase::Select, task.step);
+            mask_.assign(frame.size(), false);
+            for (auto& match: selection_.evaluate(frame)) {
                 for (size_t i = 0; i < match.size(); i++) {
-                    keep.insert(match[i]);
+                    mask_[match[i]] = true;
                 }
             }
 
-            std::vector<size_t> remove;
-            remove.reserve(frame.size() - keep.size());
-            for (size_t i = 0; i < frame.size(); ++i) {
-                auto search = keep.find(i);
-                if (search == keep.end()) { // element not found
-                    remove.push_back(i);
+            for (size_t i = 0; i < frame.size(); i++) {
+                if (mask_[i]) {
+                    task.kept.push_back(i);
                 }
             }
+        }
+    }
+
+private:
+    const Convert::Options& options_;
+    Selection selection_;
+    Selection wrap_selection_;
+    Selection center_selection_;
+    /// Which atoms are part of the selection
+    std::vector<bool> mask_;
+};
+
+/// Open the input trajectory, using the custom cell and topology
+static std::unique_ptr<TrajectoryReader> open_input(const Convert::Options& options) {
+    auto infile = std::unique_ptr<TrajectoryReader>(
+        new TrajectoryReader(options.infile, options.input_format, options.fast_xyz)
+    );
+    if (options.custom_cell) {
+        infile->set_cell(options.cell);
+    }
+
+    if (options.topology != "") {
+        infile->set_topology(options.topology, options.topology_format);
+    }
+    return infile;
+}
+
+/// Read the frame at `task.step` from `infile`, returning `false` if there
+/// is no such step
+static bool read_task(TrajectoryReader& infile, ConvertTask& task) {
+    ScopedTimer timer(Phase::Read, task.step);
+    return infile.read_step(task.step, task.frame);
+}
 
-            // deleting an atom in the frame shifts all the indexes after it
-            // so we need to iterate in reverse order to delete the good atoms
-            for (auto i: reverse(remove)) {
-                frame.remove(i);
+/// Write the selected atoms from the frame in `task` to `outfile`
+static void write_task(const Convert::Options& options, ConvertTask& task, FrameSubset& subset, Trajectory& outfile) {
+    const Frame* output = &task.frame;
+    if (options.selection != "all") {
+        ScopedTimer timer(Phase::Select, task.step);
+        output = &subset.extract(task.frame, task.kept);
+    }
+
+    {
+        ScopedTimer timer(Phase::Write, task.step);
+        outfile.write(*output);
+    }
+    Timings::count(Counter::Frames);
+}
+
+/// Get the format of the output when using multiple jobs. The frames are
+/// converted to separated files which are then concatenated, so this only
+/// works for formats where frames are independent blocks of text.
+static std::string concatenable_format(const Convert::Options& options) {
+    auto format = options.output_format;
+    if (format.empty()) {
+        format = guess_format(options.outfile, 'w');
+    }
+
+    if (format != "XYZ" && format != "GRO") {
+        throw CFilesError("'--jobs' can only be used with uncompressed XYZ or GRO output");
+    }
+    return format;
+}
+
+/// Convert the trajectory using `options.jobs` threads, each one converting
+/// a contiguous chunk of steps to a temporary segment, and concatenate the
+/// segments in the output file. This returns `false` without converting
+/// anything if the input can not be split in chunks efficiently.
+static bool convert_in_chunks(const Convert::Options& options) {
+    auto format = concatenable_format(options);
+
+    // the input is only scanned here, and the chunks re-use the positions of
+    // the frames
+    auto input = open_input(options);
+    if (input->nsteps_requires_decompression()) {
+        return false;
+    }
+    auto steps = std::vector<size_t>();
+    auto nsteps = input->nsteps();
+    for (auto step: options.steps) {
+        if (step >= nsteps) {
+            break;
+        }
+        steps.push_back(step);
+    }
+
+    if (steps.empty()) {
+        if (!options.resume) {
+            Trajectory(options.outfile, 'w', format);
+        }
+        return true;
+    }
+
+    auto chunk = (steps.size() + options.jobs - 1) / options.jobs;
+    auto n_chunks = (steps.size() + chunk - 1) / chunk;
+    auto segments = std::vector<std::string>();
+    for (size_t i=0; i<n_chunks; i++) {
+        segments.push_back(options.outfile + ".part" + std::to_string(i));
+    }
+
+    try {
+        parallel_for(n_chunks, [&](size_t i) {
+            auto begin = i * chunk;
+            auto end = std::min(begin + chunk, steps.size());
+            auto range = options.steps.starting_at(steps[begin]).ending_at(steps[end - 1] + options.steps.stride());
+
+            auto infile = input->reopen();
+            infile->set_threads(std::max(default_threads() / n_chunks, static_cast<size_t>(1)));
+            infile->set_steps(range);
+            auto outfile = Trajectory(segments[i], 'w', format);
+
+            FrameTransform transform(options);
+            auto subset = FrameSubset();
+            auto task = ConvertTask();
+            for (auto step: range) {
+                task.step = step;
+                if (!read_task(*infile, task)) {
+                    break;
+                }
+                transform.apply(task);
+                write_task(options, task, subset, outfile);
+            }
+        }, n_chunks);
+
+        ScopedTimer timer(Phase::Write);
+        concatenate_files(segments, options.outfile, options.resume);
+    } catch (...) {
+        for (auto& segment: segments) {
+            std::remove(segment.c_str());
+        }
+        throw;
+    }
+
+    for (auto& segment: segments) {
+        std::remove(segment.c_str());
+    }
+    return true;
+}
+
+/// Number of frames waiting between two stages of the pipeline, for each
+/// transform thread
+static const size_t PIPELINE_DEPTH = 4;
+
+int Convert::run(int argc, const char* argv[]) {
+    auto options = parse_options(argc, argv);
+
+    if (Selection(options.wrap_selection).size() != 1) {
+        throw CFilesError("the wrapping selection should act on atoms");
+    }
+    if (Selection(options.center_selection).size() != 1) {
+        throw CFilesError("the center selection should act on atoms");
+    }
+    // check the main selection before starting any thread
+    Selection(options.selection);
+
+    if (options.resume) {
+        auto format = options.output_format;
+        if (format.empty()) {
+            format = guess_format(options.outfile, 'w');
+        }
+        if (format != "XYZ") {
+            throw CFilesError("'--resume' is only supported for uncompressed XYZ output");
+        }
+
+        if (std::ifstream(options.outfile).good()) {
+            // continue directly with the first step not in the output
+            auto done = XYZReader::truncate_incomplete(options.outfile);
+            auto first = options.steps.first() + done * options.steps.stride();
+            if (first >= options.steps.last()) {
+                return 0;
+            }
+            options.steps = options.steps.starting_at(first);
+        }
+    }
+
+    if (options.jobs > 1 && convert_in_chunks(options)) {
+        return 0;
+    }
+
+    auto infile_ptr = open_input(options);
+    auto& infile = *infile_ptr;
+    infile.set_steps(options.steps);
+    auto outfile = Trajectory(options.outfile, options.resume ? 'a' : 'w', options.output_format);
+
+    // The conversion runs as a pipeline: one thread reads the frames, a pool
+    // of threads transforms them, and the frames are written by this thread.
+    // Frames are distributed to the transform threads in a round-robin
+    // fashion, and collected in the same order, to write them in the same
+    // order as in the input.
+    auto n_workers = std::max(default_threads(), static_cast<size_t>(3)) - 2;
+    auto inputs = std::vector<std::unique_ptr<BoundedQueue<ConvertTask>>>();
+    auto outputs = std::vector<std::unique_ptr<BoundedQueue<ConvertTask>>>();
+    for (size_t i=0; i<n_workers; i++) {
+        inputs.emplace_back(new BoundedQueue<ConvertTask>(PIPELINE_DEPTH));
+        outputs.emplace_back(new BoundedQueue<ConvertTask>(PIPELINE_DEPTH));
+    }
+
+    // Tasks already written, given back to the reader thread to re-use the
+    // memory of the frames
+    auto free_tasks = std::vector<ConvertTask>();
+    std::mutex free_tasks_mutex;
+
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    // Record the current exception and stop all the stages of the pipeline
+    auto fail = [&]() {
+        {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+        for (size_t i=0; i<n_workers; i++) {
+            inputs[i]->close();
+            outputs[i]->close();
+        }
+    };
+
+    auto threads = std::vector<std::thread>();
+    threads.emplace_back([&]() {
+        try {
+            size_t index = 0;
+            for (auto step: options.steps) {
+                auto task = ConvertTask();
+                {
+                    std::lock_guard<std::mutex> lock(free_tasks_mutex);
+                    if (!free_tasks.empty()) {
+                        task = std::move(free_tasks.back());
+                        free_tasks.pop_back();
+                    }
+                }
+
+                task.step = step;
+                if (!read_task(infile, task)) {
+                    break;
+                }
+
+                if (!inputs[index % n_workers]->push(std::move(task))) {
+                    break;
+                }
+                index++;
+            }
+        } catch (...) {
+            fail();
+        }
+        for (auto& input: inputs) {
+            input->close();
+        }
+    });
+
+    for (size_t worker=0; worker<n_workers; worker++) {
+        threads.emplace_back([&, worker]() {
+            try {
+                FrameTransform transform(options);
+                auto task = ConvertTask();
+                while (inputs[worker]->pop(task)) {
+                    transform.apply(task);
+                    if (!outputs[worker]->push(std::move(task))) {
+                        break;
+                    }
+                }
+            } catch (...) {
+                fail();
             }
+            outputs[worker]->close();
+        });
+    }
+
+    try {
+        auto subset = FrameSubset();
+        auto task = ConvertTask();
+        size_t index = 0;
+        while (outputs[index % n_workers]->pop(task)) {
+            write_task(options, task, subset, outfile);
+            index++;
+
+            std::lock_guard<std::mutex> lock(free_tasks_mutex);
+            free_tasks.emplace_back(std::move(task));
         }
+    } catch (...) {
+        fail();
+    }
+
+    for (auto& thread: threads) {
+        thread.join();
+    }
 
-        outfile.write(frame);
+    if (error) {
+        std::rethrow_exception(error);
     }
 
     return 0;
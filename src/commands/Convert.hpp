@@ -22,11 +22,14 @@ public:
         bool custom_cell = false;
         chemfiles::UnitCell cell;
         bool guess_bonds = false;
+        bool fast_xyz = false;
         bool wrap = false;
         std::string wrap_selection = "";
         bool center = false;
         std::string center_selection = "";
         steps_range steps;
+        size_t jobs = 1;
+        bool resume = false;
     };
 
     int run(int argc, const char* argv[]) override;
@@ -2,16 +2,164 @@
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
 #include <docopt/docopt.h>
+#include <algorithm>
+#include <cmath>
 #include <sstream>
 #include <fstream>
 
 #include "Density.hpp"
+#include "AtomicFile.hpp"
 #include "Errors.hpp"
+#include "Timings.hpp"
 #include "utils.hpp"
 #include "warnings.hpp"
 
 using namespace chemfiles;
 
+/// Minimal number of atoms for each thread when accumulating a single frame
+/// in parallel
+static const size_t MIN_ATOMS_PER_THREAD = 16384;
+/// Number of atoms projected together on the axis
+static const size_t BLOCK_SIZE = 256;
+
+namespace {
+
+/// Positions of a block of atoms, with separate arrays for each coordinate
+struct PositionsBlock {
+    double x[BLOCK_SIZE];
+    double y[BLOCK_SIZE];
+    double z[BLOCK_SIZE];
+};
+
+/// Projection of positions on an axis, including the wrapping inside the unit
+/// cell and the optional conversion to fractional coordinates.
+///
+/// All the matrices are computed once per frame, and positions are processed
+/// by blocks in simple loops that the compiler can vectorize. The operations
+/// are the same as `axis.projection(scaling * cell.wrap(position))`, in the
+/// same order, to give exactly the same results.
+class BlockProjection {
+public:
+    BlockProjection(const UnitCell& cell, bool fractional, const Axis& axis, const Vector3D& origin):
+        shape_(cell.shape()), lengths_(cell.lengths()), matrix_(cell.matrix()),
+        inverse_(Matrix3D::unit()), fractional_(fractional), axis_(axis.vector()),
+        linear_(axis.is_linear()), origin_(axis.is_linear() ? Vector3D(0, 0, 0) : origin)
+    {
+        if (shape_ == UnitCell::TRICLINIC || fractional_) {
+            inverse_ = matrix_.invert();
+        }
+    }
+
+    /// Project the first `size` positions in `block` on the axis, and store
+    /// the results in `output`
+    void project(const PositionsBlock& block, size_t size, double* output) const {
+        assert(size <= BLOCK_SIZE);
+        if (linear_) {
+            project<Axis::Linear>(block, size, output);
+        } else {
+            project<Axis::Radial>(block, size, output);
+        }
+    }
+
+private:
+    template <Axis::Type Type>
+    void project(const PositionsBlock& block, size_t size, double* output) const;
+
+    /// Wrap the positions in `block` inside the unit cell
+    void wrap(PositionsBlock& block, size_t size) const {
+        if (shape_ == UnitCell::ORTHORHOMBIC) {
+            auto a = lengths_[0];
+            auto b = lengths_[1];
+            auto c = lengths_[2];
+            for (size_t k=0; k<size; k++) {
+                block.x[k] -= std::round(block.x[k] / a) * a;
+                block.y[k] -= std::round(block.y[k] / b) * b;
+                block.z[k] -= std::round(block.z[k] / c) * c;
+            }
+        } else if (shape_ == UnitCell::TRICLINIC) {
+            auto& h = matrix_;
+            auto& inv = inverse_;
+            for (size_t k=0; k<size; k++) {
+                auto x = block.x[k];
+                auto y = block.y[k];
+                auto z = block.z[k];
+                auto fx = inv[0][0] * x + inv[0][1] * y + inv[0][2] * z;
+                auto fy = inv[1][0] * x + inv[1][1] * y + inv[1][2] * z;
+                auto fz = inv[2][0] * x + inv[2][1] * y + inv[2][2] * z;
+                fx -= std::round(fx);
+                fy -= std::round(fy);
+                fz -= std::round(fz);
+                block.x[k] = h[0][0] * fx + h[0][1] * fy + h[0][2] * fz;
+                block.y[k] = h[1][0] * fx + h[1][1] * fy + h[1][2] * fz;
+                block.z[k] = h[2][0] * fx + h[2][1] * fy + h[2][2] * fz;
+            }
+        }
+    }
+
+    /// Convert the positions in `block` to fractional coordinates
+    void scale(PositionsBlock& block, size_t size) const {
+        auto& inv = inverse_;
+        for (size_t k=0; k<size; k++) {
+            auto x = block.x[k];
+            auto y = block.y[k];
+            auto z = block.z[k];
+            block.x[k] = inv[0][0] * x + inv[0][1] * y + inv[0][2] * z;
+            block.y[k] = inv[1][0] * x + inv[1][1] * y + inv[1][2] * z;
+            block.z[k] = inv[2][0] * x + inv[2][1] * y + inv[2][2] * z;
+        }
+    }
+
+    /// Shape of the unit cell
+    UnitCell::CellShape shape_;
+    /// Lengths of the unit cell
+    Vector3D lengths_;
+    /// Matrix of the unit cell
+    Matrix3D matrix_;
+    /// Inverse of the unit cell matrix, only set for triclinic cells and
+    /// fractional coordinates
+    Matrix3D inverse_;
+    /// Should we use fractional coordinates?
+    bool fractional_;
+    /// Normalized axis vector
+    Vector3D axis_;
+    /// Is this a linear axis?
+    bool linear_;
+    /// Origin of the positions, only used by radial axis
+    Vector3D origin_;
+};
+
+template <Axis::Type Type>
+void BlockProjection::project(const PositionsBlock& block, size_t size, double* output) const {
+    PositionsBlock wrapped;
+    for (size_t k=0; k<size; k++) {
+        wrapped.x[k] = block.x[k] - origin_[0];
+        wrapped.y[k] = block.y[k] - origin_[1];
+        wrapped.z[k] = block.z[k] - origin_[2];
+    }
+    wrap(wrapped, size);
+    if (fractional_) {
+        scale(wrapped, size);
+    }
+
+    auto a = axis_[0];
+    auto b = axis_[1];
+    auto c = axis_[2];
+    for (size_t k=0; k<size; k++) {
+        auto x = wrapped.x[k];
+        auto y = wrapped.y[k];
+        auto z = wrapped.z[k];
+        auto projected = a * x + b * y + c * z;
+        if (Type == Axis::Linear) {
+            output[k] = projected;
+        } else {
+            auto norm = std::sqrt(x * x + y * y + z * z);
+            output[k] = std::sqrt(norm * norm - projected * projected);
+        }
+    }
+}
+
+}
+
 static const char OPTIONS[] =
 R"(Compute the density profile of particles along a given axis or radially.
 The output for the radial density profile is normalized by r.
@@ -29,11 +177,15 @@ the same type are used (e.g. twice --axis option), the order will be the one the
 user gave. If the axis types are different (e.g. --axis and --radial), the
 --axis will be first. Two axis of type radial are forbidden.
 
+When multiple trajectories are given, they are used as independent replicas.
+The replicas are processed in parallel, and the output contains the weighted
+average profile together with its standard deviation between replicas.
+
 For more information about chemfiles selection language, please see
 http://chemfiles.org/chemfiles/latest/selections.html
 
 Usage:
-  cfiles density [options] <trajectory> [--axis=<axis>...] [--radial=<axis>...]
+  cfiles density [options] <trajectory>... [--axis=<axis>...] [--radial=<axis>...]
   cfiles density (-h | --help)
 
 Examples:
@@ -41,6 +193,7 @@ Examples:
   cfiles density in.pdb --selection="x > 3" --points=500
   cfiles density nt.pdb --radial=Z --max=3 --origin=0:0:2
   cfiles density nt.pdb --axis=Z --radial=Z --max=10:5 --origin=0:0:2
+  cfiles density run-1/nt.pdb run-2/nt.pdb --radial=Z --max=3
 
 Options:
   -h --help                     show this help
@@ -197,11 +350,15 @@ std::string Density::description() const {
 }
 
 void Density::accumulate(const chemfiles::Frame& frame, Histogram& profile) {
-    auto positions = frame.positions();
-    auto cell = frame.cell();
+    auto& positions = frame.positions();
+    auto& cell = frame.cell();
 
     assert(selection_.size() == 1);
-    auto selected = selection_.list(frame);
+    auto selected = std::vector<size_t>();
+    {
+        ScopedTimer timer(Phase::Select);
+        selected = selection_.list(frame);
+    }
     if (selected.empty()) {
         warn(
             "No matching atom for selection '" + selection_.string() +
@@ -209,40 +366,49 @@ void Density::accumulate(const chemfiles::Frame& frame, Histogram& profile) {
         );
     }
 
-    auto scaling = Matrix3D::unit();
-    if (options_.fractional) {
-        scaling = cell.matrix().invert();
+    auto projections = std::vector<BlockProjection>();
+    for (auto& axis: axis_) {
+        projections.emplace_back(cell, options_.fractional, axis, options_.origin);
     }
 
-    for (auto i: selected) {
-        double x = 0;
-        double y = 0;
-        if (axis_[0].is_linear()) {
-            x = axis_[0].projection(scaling * cell.wrap(positions[i]));
-        } else {
-            assert(axis_[0].is_radial());
-            x = axis_[0].projection(scaling * cell.wrap(positions[i] - options_.origin));
-        }
-        if (dimensionality() == 2) {
-            if (axis_[1].is_linear()) {
-                y = axis_[1].projection(scaling * cell.wrap(positions[i]));
+    parallel_accumulate(selected.size(), MIN_ATOMS_PER_THREAD, profile, [&](size_t begin, size_t end, Histogram& local) {
+        PositionsBlock block;
+        double x[BLOCK_SIZE];
+        double y[BLOCK_SIZE];
+        for (auto start=begin; start<end; start+=BLOCK_SIZE) {
+            auto size = std::min(BLOCK_SIZE, end - start);
+            for (size_t k=0; k<size; k++) {
+                auto& position = positions[selected[start + k]];
+                block.x[k] = position[0];
+                block.y[k] = position[1];
+                block.z[k] = position[2];
+            }
+
+            projections[0].project(block, size, x);
+            if (dimensionality() == 1) {
+                for (size_t k=0; k<size; k++) {
+                    local.insert(x[k]);
+                }
             } else {
-                assert(axis_[1].is_radial());
-                y = axis_[1].projection(scaling * cell.wrap(positions[i] - options_.origin));
+                projections[1].project(block, size, y);
+                for (size_t k=0; k<size; k++) {
+                    local.insert(x[k], y[k]);
+                }
             }
         }
-        if (dimensionality() == 1) {
-            profile.insert(x);
-        } else {
-            profile.insert(x, y);
-        }
-    }
+    });
+}
+
+std::unique_ptr<AveCommand> Density::replica() const {
+    return std::unique_ptr<AveCommand>(new Density());
 }
 
 void Density::finish(const Histogram& profile) {
-    std::ofstream outfile(options_.outfile, std::ios::out);
+    AtomicFile outfile(output_path(options_.outfile));
     if (outfile.is_open()) {
         outfile << "# Density profile in trajectory " << AveCommand::options().trajectory << std::endl;
+        write_replicas(outfile);
+        write_convergence(outfile);
         outfile << "# along axis " << axis_[0].str();
         if (dimensionality() == 2) {
             outfile << " and " << axis_[1].str();
@@ -250,30 +416,43 @@ void Density::finish(const Histogram& profile) {
         outfile << std::endl;
         outfile << "# Selection: " << options_.selection << std::endl;
 
+        bool replicas = AveCommand::options().replicas.size() > 1;
         if (dimensionality() == 1) {
             for (size_t i = 0; i < profile.size(); i++){
-                if (axis_[0].is_linear()) {
-                    outfile << profile.first().coord(i) << "  " << profile[i] << "\n";
-                } else {
-                    assert(axis_[0].is_radial());
-                    outfile << profile.first().coord(i) << "  " << profile[i] / profile.first().coord(i) << "\n";
+                double norm = 1;
+                if (axis_[0].is_radial()) {
+                    norm = profile.first().coord(i);
+                }
+                outfile << profile.first().coord(i) << "  " << profile[i] / norm;
+                if (replicas) {
+                    outfile << "  " << spread()[i] / norm;
                 }
+                outfile << "\n";
             }
         } else {
-            outfile << "# first second density" << std::endl;
+            if (replicas) {
+                outfile << "# first second density std(density)" << std::endl;
+            } else {
+                outfile << "# first second density" << std::endl;
+            }
 
             for (size_t i = 0; i < profile.first().nbins; i++){
                 for (size_t j = 0; j < profile.second().nbins; j++){
-                    outfile << profile.first().coord(i) << "\t" << profile.second().coord(j) << "\t";
-                    if (axis_[0].is_linear() and axis_[1].is_linear()) {
-                        outfile << profile(i, j) << "\n";
-                    } else {
+                    double norm = 1;
+                    if (!(axis_[0].is_linear() and axis_[1].is_linear())) {
                         assert(axis_[0].is_linear() and axis_[1].is_radial());
-                        outfile << profile(i, j) / profile.second().coord(j) << "\n";
+                        norm = profile.second().coord(j);
+                    }
+                    outfile << profile.first().coord(i) << "\t" << profile.second().coord(j) << "\t";
+                    outfile << profile(i, j) / norm;
+                    if (replicas) {
+                        outfile << "\t" << spread()(i, j) / norm;
                     }
+                    outfile << "\n";
                 }
             }
         }
+        outfile.commit();
     } else {
         throw CFilesError("Could not open the '" + options_.outfile + "' file.");
     }
@@ -1,7 +1,11 @@
 // cfiles, an analysis frontend for the Chemfiles library
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
+#include <functional>
+#include <random>
 
 #include <docopt/docopt.h>
 #include <fmt/format.h>
@@ -10,14 +14,83 @@
 #include <Eigen/Dense>
 
 #include "Elastic.hpp"
+#include "CellFluctuations.hpp"
 #include "Errors.hpp"
+#include "Timings.hpp"
+#include "TrajectoryReader.hpp"
+#include "parallel.hpp"
+#include "warnings.hpp"
 
 using namespace chemfiles;
 
-using Matrix6 = Eigen::Matrix<double, 6, 6>;
+/// Fluctuations of the unit cell in blocks of consecutive frames, used for
+/// the block bootstrap.
+///
+/// The number of frames is not known before reading the whole trajectory, so
+/// cells are first accumulated in small chunks of consecutive frames. When
+/// there are too many chunks, neighboring chunks are merged two by two. The
+/// chunks are grouped in blocks with the same number of frames at the end,
+/// up to the size of a chunk.
+class BlockFluctuations {
+public:
+    /// Create an accumulator giving `n_blocks` blocks at the end
+    explicit BlockFluctuations(size_t n_blocks): n_blocks_(n_blocks) {}
+
+    /// Add a new `cell` matrix after all the previous ones
+    void add(const Matrix3D& cell) {
+        if (chunks_.empty() || chunks_.back().count() == chunk_size_) {
+            if (chunks_.size() == CHUNKS_PER_BLOCK * n_blocks_) {
+                for (size_t i=0; i<chunks_.size() / 2; i++) {
+                    auto chunk = chunks_[2 * i];
+                    chunk.merge(chunks_[2 * i + 1]);
+                    chunks_[i] = chunk;
+                }
+                chunks_.resize(chunks_.size() / 2);
+                chunk_size_ *= 2;
+            }
+            if (chunks_.empty() || chunks_.back().count() == chunk_size_) {
+                chunks_.emplace_back();
+            }
+        }
+        chunks_.back().add(cell);
+        count_ += 1;
+    }
+
+    /// Get the blocks of consecutive frames. There are at most `n_blocks`
+    /// blocks, and none of them is empty.
+    std::vector<CellFluctuations> blocks() const {
+        auto n_blocks = std::min(n_blocks_, count_);
+        auto blocks = std::vector<CellFluctuations>(n_blocks);
+        if (n_blocks == 0) {
+            return blocks;
+        }
+
+        auto block_size = (count_ + n_blocks - 1) / n_blocks;
+        size_t start = 0;
+        for (auto& chunk: chunks_) {
+            auto block = std::min(start / block_size, n_blocks - 1);
+            blocks[block].merge(chunk);
+            start += chunk.count();
+        }
 
-static size_t CARTESIAN_TO_VOIGT[][2] = {
-    {0, 0}, {1, 1}, {2, 2}, {1, 2}, {0, 2}, {0, 1},
+        blocks.erase(std::remove_if(blocks.begin(), blocks.end(), [](const CellFluctuations& block) {
+            return block.count() == 0;
+        }), blocks.end());
+        return blocks;
+    }
+
+private:
+    /// Maximal number of chunks for each block, this must be even
+    static const size_t CHUNKS_PER_BLOCK = 16;
+
+    /// Number of blocks to create
+    size_t n_blocks_;
+    /// Total number of cells
+    size_t count_ = 0;
+    /// Number of cells in each chunk
+    size_t chunk_size_ = 1;
+    /// Fluctuations of the cell in each chunk
+    std::vector<CellFluctuations> chunks_;
 };
 
 static const std::string OPTIONS =
@@ -40,6 +113,11 @@ Examples:
 Options:
   -h --help                        show this help
   --format=<format>                force the input file format to be <format>
+  --fast-xyz                       use a faster reader for XYZ files, only
+                                   parsing the unit cell from the comment line
+                                   of each frame. Compressed .xyz.gz and
+                                   .xyz.xz files are decompressed in a separate
+                                   thread
   -t <temp>, --temperature=<temp>  temperature of the simulation, in kelvin
   -o <file>, --output=<file>       write result to <file>. This default to the
                                    trajectory file name with the `.angles.dat`
@@ -51,6 +129,19 @@ Options:
                                    steps of <stride>. The default values are 0
                                    for <start>, the number of steps for <end>
                                    and 1 for <stride>.
+  --bootstrap=<n>                  estimate 95% confidence intervals for the
+                                   stiffness tensor and the moduli using <n>
+                                   block bootstrap samples of the trajectory.
+                                   This needs at least 2 frames
+  --bootstrap-blocks=<n>           split the trajectory in <n> blocks of
+                                   consecutive frames for the bootstrap, <n>
+                                   must be at least 2 [default: 20]
+  --timings                        print a summary of the time spent in the
+                                   different phases of the run to the standard
+                                   error
+  --trace=<file>                   record begin and end events for the phases
+                                   of each frame on all threads, and write them
+                                   to <file> in Chrome trace-event JSON format
 )";
 
 
@@ -62,6 +153,11 @@ static Elastic::Options parse_options(int argc, const char* argv[]) {
 
     Elastic::Options options;
     options.trajectory = args.at("<trajectory>").asString();
+    options.fast_xyz = args.at("--fast-xyz").asBool();
+
+    if (args.at("--format")) {
+        options.format = args.at("--format").asString();
+    }
 
     if (args["--temperature"]) {
         options.temperature = string2double(args.at("--temperature").asString());
@@ -73,117 +169,235 @@ static Elastic::Options parse_options(int argc, const char* argv[]) {
         options.steps = steps_range::parse(args.at("--steps").asString());
     }
 
+    if (args.at("--bootstrap")) {
+        auto bootstrap = string2long(args.at("--bootstrap").asString());
+        if (bootstrap <= 0) {
+            throw CFilesError("'--bootstrap' must be positive");
+        }
+        options.bootstrap = static_cast<size_t>(bootstrap);
+    }
+
+    auto blocks = string2long(args.at("--bootstrap-blocks").asString());
+    if (blocks < 2) {
+        throw CFilesError("'--bootstrap-blocks' must be at least 2");
+    }
+    options.bootstrap_blocks = static_cast<size_t>(blocks);
+
     if (args["--output"]) {
         options.outfile = args.at("--output").asString();
     } else {
         options.outfile = options.trajectory + ".elastic.dat";
     }
 
+    if (args.at("--timings").asBool()) {
+        Timings::enable();
+    }
+
+    if (args.at("--trace")) {
+        Trace::enable(args.at("--trace").asString());
+    }
+
     return options;
 }
 
+/// Elastic moduli derived from a compliance matrix
+struct ElasticModuli {
+    /// Stiffness matrix in Voigt notation
+    Matrix6 stiffness;
+    /// Bulk modulus, Young's modulus, shear modulus and Poisson's ratio for
+    /// the Voigt, Reuss and Hill averaging, in this order
+    double averages[3][4];
+};
+
+/// Compute the elastic moduli from the `compliance` matrix, returning `false`
+/// if the compliance matrix is not invertible.
+static bool compute_moduli(const Matrix6& compliance, ElasticModuli& moduli) {
+    if (std::abs(compliance.determinant()) < 100 * DBL_EPSILON) {
+        return false;
+    }
+
+    const auto& SVoigt = compliance;
+    moduli.stiffness = SVoigt.inverse();
+    const auto& CVoigt = moduli.stiffness;
+
+    double A = (CVoigt(0, 0) + CVoigt(1, 1) + CVoigt(2, 2)) / 3.0;
+    double B = (CVoigt(1, 2) + CVoigt(0, 2) + CVoigt(0, 1)) / 3.0;
+    double C = (CVoigt(3, 3) + CVoigt(4, 4) + CVoigt(5, 5)) / 3.0;
+
+    double a = (SVoigt(0, 0) + SVoigt(1, 1) + SVoigt(2, 2)) / 3.0;
+    double b = (SVoigt(1, 2) + SVoigt(0, 2) + SVoigt(0, 1)) / 3.0;
+    double c = (SVoigt(3, 3) + SVoigt(4, 4) + SVoigt(5, 5)) / 3.0;
+
+    double KV = (A + 2.0 * B) / 3.0;
+    double GV = (A - B + 3.0 * C) / 5.0;
+    double YV = 1.0 / (1.0 / (3.0 * GV) + 1.0 / (9.0 * KV));
+    double PV = (1.0 - 3.0 * GV / (3.0 * KV + GV)) / 2.0;
+
+    double KR = 1.0 / (3.0 * a + 6.0 * b);
+    double GR = 5.0 / (4.0 * a - 4.0 * b + 3.0 * c);
+    double YR = 1.0 / (1.0 / (3.0 * GR) + 1.0 / (9.0 * KR));
+    double PR = (1.0 - 3.0 * GR / (3.0 * KR + GR)) / 2.0;
+
+    double KH = (KV + KR) / 2.0;
+    double GH = (GV + GR) / 2.0;
+    double YH = 1.0 / (1.0 / (3.0 * GH) + 1.0 / (9.0 * KH));
+    double PH = (1.0 - 3.0 * GH / (3.0 * KH + GH)) / 2.0;
+
+    double averages[3][4] = {
+        {KV, YV, GV, PV},
+        {KR, YR, GR, PR},
+        {KH, YH, GH, PH},
+    };
+    std::copy(&averages[0][0], &averages[0][0] + 12, &moduli.averages[0][0]);
+    return true;
+}
+
+/// Get the `fraction` percentile of `values`, interpolating linearly between
+/// the closest ranks. `values` must be sorted.
+static double percentile(const std::vector<double>& values, double fraction) {
+    auto position = fraction * static_cast<double>(values.size() - 1);
+    auto lower = static_cast<size_t>(std::floor(position));
+    auto upper = std::min(lower + 1, values.size() - 1);
+    auto weight = position - static_cast<double>(lower);
+    return (1 - weight) * values[lower] + weight * values[upper];
+}
+
+/// Confidence interval of a single value from the bootstrap samples
+struct Interval {
+    double lower;
+    double upper;
+};
+
+/// Get the 95% confidence interval of `get(sample)` over the `samples`
+template <typename Getter>
+static Interval confidence_interval(const std::vector<ElasticModuli>& samples, Getter get) {
+    auto values = std::vector<double>();
+    values.reserve(samples.size());
+    for (auto& sample: samples) {
+        values.push_back(get(sample));
+    }
+    std::sort(values.begin(), values.end());
+    return {percentile(values, 0.025), percentile(values, 0.975)};
+}
+
+/// Run `n_samples` block bootstrap resamplings of the `blocks`, and compute
+/// the elastic moduli for each one of them. Samples where the compliance
+/// matrix is not invertible are discarded.
+static std::vector<ElasticModuli> bootstrap(const std::vector<CellFluctuations>& blocks, size_t n_samples, double temperature) {
+    auto samples = std::vector<ElasticModuli>(n_samples);
+    auto valid = std::vector<char>(n_samples, 0);
+    parallel_for(n_samples, [&](size_t sample) {
+        // use one generator per sample to get the same results regardless
+        // of the number of threads
+        auto rng = std::mt19937(static_cast<uint32_t>(sample));
+        auto distribution = std::uniform_int_distribution<size_t>(0, blocks.size() - 1);
+
+        auto fluctuations = CellFluctuations();
+        for (size_t i=0; i<blocks.size(); i++) {
+            fluctuations.merge(blocks[distribution(rng)]);
+        }
+        valid[sample] = compute_moduli(fluctuations.compliance(temperature), samples[sample]);
+    });
+
+    auto result = std::vector<ElasticModuli>();
+    result.reserve(n_samples);
+    for (size_t i=0; i<n_samples; i++) {
+        if (valid[i]) {
+            result.emplace_back(samples[i]);
+        }
+    }
+    return result;
+}
+
 std::string Elastic::description() const {
     return "compute elastic constants from unit cell fluctuations in NPT";
 }
 
 int Elastic::run(int argc, const char* argv[]) {
     auto options = parse_options(argc, argv);
-    auto cells = std::vector<Matrix3D>();
 
-    auto trajectory = Trajectory(options.trajectory, 'r', options.format);
+    TrajectoryReader trajectory(options.trajectory, options.format, options.fast_xyz);
+    trajectory.set_steps(options.steps);
+
+    // Split the trajectory in blocks of consecutive frames for the bootstrap.
+    // The number of frames is not used here, since counting the frames in
+    // compressed files requires to decompress them.
+    auto blocks = BlockFluctuations(options.bootstrap != 0 ? options.bootstrap_blocks : 0);
+
+    auto fluctuations = CellFluctuations();
+    auto cell = UnitCell();
     for (auto step: options.steps) {
-        if (step >= trajectory.nsteps()) {
-            break;
-        }
-        auto frame = trajectory.read_step(step);
-        cells.emplace_back(frame.cell().matrix());
-    }
-
-    // Use the avrerage as the reference state
-    auto reference = Matrix3D::zero();
-    for (auto& cell: cells) {
-        reference += cell.invert();
-    }
-    reference /= cells.size();
-    auto reference_t = reference.transpose();
-
-    auto epsilons = std::vector<Matrix3D>();
-    epsilons.reserve(cells.size());
-    for (auto& cell: cells) {
-        epsilons.emplace_back(0.5 * (reference_t * cell.transpose() * cell * reference - Matrix3D::unit()));
-    }
-
-    // in GPa A^2 / K
-    auto BOLTZMANN = 1.38065e-2;
-    auto volume_inv = reference.determinant();
-    auto v_kt = 1.0 / (volume_inv * BOLTZMANN * options.temperature);
-    auto compute = [&](size_t ij[2], size_t kl[2]) {
-        auto i = ij[0];
-        auto j = ij[1];
-        auto k = kl[0];
-        auto l = kl[1];
-
-        // Multiplicative factors for cross terms yz xz xy
-        double factor = 1.0;
-        if (i != j) {
-            factor *= 2;
-        }
-        if (k != l) {
-            factor *= 2;
+        {
+            ScopedTimer timer(Phase::Read, step);
+            if (!trajectory.read_cell(step, cell)) {
+                break;
+            }
         }
-
-        double eij = 0;
-        double ekl = 0;
-        double eij_ekl = 0;
-        for (auto& epsilon: epsilons) {
-            eij += epsilon[i][j];
-            ekl += epsilon[k][l];
-            eij_ekl += epsilon[i][j] * epsilon[k][l];
+        if (options.bootstrap != 0) {
+            blocks.add(cell.matrix());
         }
-        eij /= epsilons.size();
-        ekl /= epsilons.size();
-        eij_ekl /= epsilons.size();
-
-        return factor * v_kt * (eij_ekl - eij * ekl);
-    };
+        fluctuations.add(cell.matrix());
+        Timings::count(Counter::Frames);
+    }
 
-    auto SVoigt = Matrix6();
-    for (size_t i=0; i<6; i++) {
-        for (size_t j=0; j<=i; j++) {
-            SVoigt(i, j) = compute(CARTESIAN_TO_VOIGT[i], CARTESIAN_TO_VOIGT[j]);
-        }
+    if (fluctuations.count() == 0) {
+        throw CFilesError("the first step is past the end of the trajectory");
     }
-    // Make the matrix symetric
-    for (size_t i=0; i<6; i++) {
-        for (size_t j=i+1; j<6; j++) {
-            SVoigt(i, j) = SVoigt(j, i);
+
+    auto bootstrap_blocks = std::vector<CellFluctuations>();
+    if (options.bootstrap != 0) {
+        bootstrap_blocks = blocks.blocks();
+        if (bootstrap_blocks.size() < 2) {
+            throw CFilesError("not enough frames in the trajectory for --bootstrap");
         }
     }
 
-    if (std::abs(SVoigt.determinant()) < 100 * DBL_EPSILON) {
+    auto SVoigt = fluctuations.compliance(options.temperature);
+    auto moduli = ElasticModuli();
+    if (!compute_moduli(SVoigt, moduli)) {
         throw CFilesError("the compliance matrix is not invertible");
     }
+    const auto& CVoigt = moduli.stiffness;
+
+    auto samples = std::vector<ElasticModuli>();
+    if (options.bootstrap != 0) {
+        ScopedTimer timer(Phase::Normalize);
+        samples = bootstrap(bootstrap_blocks, options.bootstrap, options.temperature);
+        if (samples.empty()) {
+            throw CFilesError("the compliance matrix is not invertible in any bootstrap sample");
+        } else if (samples.size() != options.bootstrap) {
+            warn(fmt::format(
+                "discarded {} bootstrap samples with a non invertible compliance matrix",
+                options.bootstrap - samples.size()
+            ));
+        }
+    }
 
-    auto CVoigt = SVoigt.inverse();
     std::ofstream outfile(options.outfile, std::ios::out);
     if (!outfile.is_open()) {
         throw CFilesError("Could not open the '" + options.outfile + "' file.");
     }
 
-    fmt::print(outfile, "# stiffness tensor in GPa from {}\n", options.trajectory);
-    for (size_t i=0; i<6; i++) {
-        for (size_t j=0; j<6; j++) {
-            if (j != 0) {
-                fmt::print(outfile, " ");
-            }
-            if (j >= i) {
-                fmt::print(outfile, "{:12.5f}", CVoigt(i, j));
-            } else {
-                fmt::print(outfile, "            ");
+    auto print_stiffness = [&](std::function<double(size_t, size_t)> value) {
+        for (size_t i=0; i<6; i++) {
+            for (size_t j=0; j<6; j++) {
+                if (j != 0) {
+                    fmt::print(outfile, " ");
+                }
+                if (j >= i) {
+                    fmt::print(outfile, "{:12.5f}", value(i, j));
+                } else {
+                    fmt::print(outfile, "            ");
+                }
             }
+            fmt::print(outfile, "\n");
         }
-        fmt::print(outfile, "\n");
-    }
+    };
+
+    fmt::print(outfile, "# stiffness tensor in GPa from {}\n", options.trajectory);
+    print_stiffness([&](size_t i, size_t j) {
+        return CVoigt(i, j);
+    });
 
     auto eigenvalues = CVoigt.eigenvalues();
     auto sorter = [](std::complex<double> i, std::complex<double> j) {
@@ -200,36 +414,59 @@ int Elastic::run(int argc, const char* argv[]) {
         }
     }
 
-    double A = (CVoigt(0, 0) + CVoigt(1, 1) + CVoigt(2, 2)) / 3.0;
-    double B = (CVoigt(1, 2) + CVoigt(0, 2) + CVoigt(0, 1)) / 3.0;
-    double C = (CVoigt(3, 3) + CVoigt(4, 4) + CVoigt(5, 5)) / 3.0;
-
-    double a = (SVoigt(0, 0) + SVoigt(1, 1) + SVoigt(2, 2)) / 3.0;
-    double b = (SVoigt(1, 2) + SVoigt(0, 2) + SVoigt(0, 1)) / 3.0;
-    double c = (SVoigt(3, 3) + SVoigt(4, 4) + SVoigt(5, 5)) / 3.0;
+    const char* AVERAGING[] = {"Voigt", "Reuss", "Hill"};
+    fmt::print(outfile, "# Bulk modulus (GPa) | Young's modulus (GPa) | Shear modulus (GPa) | Poisson's ratio\n");
+    for (size_t averaging=0; averaging<3; averaging++) {
+        auto& values = moduli.averages[averaging];
+        fmt::print(outfile, "# {} averaging\n", AVERAGING[averaging]);
+        fmt::print(outfile, "{:12.5f} {:12.5f} {:12.5f} {:12.5f}\n", values[0], values[1], values[2], values[3]);
+    }
 
-    double KV = (A + 2.0 * B) / 3.0;
-    double GV = (A - B + 3.0 * C) / 5.0;
-    double YV = 1.0 / (1.0 / (3.0 * GV) + 1.0 / (9.0 * KV));
-    double PV = (1.0 - 3.0 * GV / (3.0 * KV + GV)) / 2.0;
+    if (samples.empty()) {
+        return 0;
+    }
 
-    double KR = 1.0 / (3.0 * a + 6.0 * b);
-    double GR = 5.0 / (4.0 * a - 4.0 * b + 3.0 * c);
-    double YR = 1.0 / (1.0 / (3.0 * GR) + 1.0 / (9.0 * KR));
-    double PR = (1.0 - 3.0 * GR / (3.0 * KR + GR)) / 2.0;
+    fmt::print(outfile,
+        "# 95% confidence intervals from {} bootstrap samples of {} blocks of about {} frames\n",
+        samples.size(), bootstrap_blocks.size(), fluctuations.count() / bootstrap_blocks.size()
+    );
 
-    double KH = (KV + KR) / 2.0;
-    double GH = (GV + GR) / 2.0;
-    double YH = 1.0 / (1.0 / (3.0 * GH) + 1.0 / (9.0 * KH));
-    double PH = (1.0 - 3.0 * GH / (3.0 * KH + GH)) / 2.0;
+    auto stiffness_lower = Matrix6();
+    auto stiffness_upper = Matrix6();
+    for (size_t i=0; i<6; i++) {
+        for (size_t j=i; j<6; j++) {
+            auto interval = confidence_interval(samples, [&](const ElasticModuli& sample) {
+                return sample.stiffness(i, j);
+            });
+            stiffness_lower(i, j) = interval.lower;
+            stiffness_upper(i, j) = interval.upper;
+        }
+    }
+    fmt::print(outfile, "# lower bound of the stiffness tensor (GPa)\n");
+    print_stiffness([&](size_t i, size_t j) {
+        return stiffness_lower(i, j);
+    });
+    fmt::print(outfile, "# upper bound of the stiffness tensor (GPa)\n");
+    print_stiffness([&](size_t i, size_t j) {
+        return stiffness_upper(i, j);
+    });
 
     fmt::print(outfile, "# Bulk modulus (GPa) | Young's modulus (GPa) | Shear modulus (GPa) | Poisson's ratio\n");
-    fmt::print(outfile, "# Voigt averaging\n");
-    fmt::print(outfile, "{:12.5f} {:12.5f} {:12.5f} {:12.5f}\n", KV, YV, GV, PV);
-    fmt::print(outfile, "# Reuss averaging\n");
-    fmt::print(outfile, "{:12.5f} {:12.5f} {:12.5f} {:12.5f}\n", KR, YR, GR, PR);
-    fmt::print(outfile, "# Hill averaging\n");
-    fmt::print(outfile, "{:12.5f} {:12.5f} {:12.5f} {:12.5f}\n", KH, YH, GH, PH);
+    for (size_t averaging=0; averaging<3; averaging++) {
+        Interval intervals[4];
+        for (size_t i=0; i<4; i++) {
+            intervals[i] = confidence_interval(samples, [&](const ElasticModuli& sample) {
+                return sample.averages[averaging][i];
+            });
+        }
+        fmt::print(outfile, "# {} averaging, lower and upper bounds\n", AVERAGING[averaging]);
+        fmt::print(outfile, "{:12.5f} {:12.5f} {:12.5f} {:12.5f}\n",
+            intervals[0].lower, intervals[1].lower, intervals[2].lower, intervals[3].lower
+        );
+        fmt::print(outfile, "{:12.5f} {:12.5f} {:12.5f} {:12.5f}\n",
+            intervals[0].upper, intervals[1].upper, intervals[2].upper, intervals[3].upper
+        );
+    }
 
     return 0;
 }
@@ -18,12 +18,19 @@ public:
         std::string trajectory;
         /// Specific format to use with the trajectory
         std::string format = "";
+        /// Should we use the fast XYZ reader?
+        bool fast_xyz = false;
         /// Specific steps to use from the trajectory
         steps_range steps;
         /// Output data file
         std::string outfile;
         /// Temperature of the simulation
         double temperature;
+        /// Number of bootstrap samples to use for confidence intervals, or 0
+        /// to disable the bootstrap
+        size_t bootstrap = 0;
+        /// Number of blocks of consecutive frames for the bootstrap
+        size_t bootstrap_blocks = 20;
     };
 
     Elastic() {}
@@ -2,6 +2,7 @@
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
 #include <docopt/docopt.h>
+#include <algorithm>
 #include <sstream>
 #include <fstream>
 #include <unordered_map>
@@ -14,6 +15,9 @@
 #include "Autocorrelation.hpp"
 #include "Histogram.hpp"
 #include "Errors.hpp"
+#include "NeighborList.hpp"
+#include "Timings.hpp"
+#include "TrajectoryReader.hpp"
 #include "utils.hpp"
 #include "warnings.hpp"
 
@@ -49,6 +53,10 @@ Options:
                                 trajectory file name with the `.hbonds.dat`
                                 extension.
   --format=<format>             force the input file format to be <format>
+  --fast-xyz                    use a faster reader for XYZ files, parsing
+                                multiple frames in parallel. Compressed
+                                .xyz.gz and .xyz.xz files are decompressed in
+                                a separate thread
   -t <path>, --topology=<path>  alternative topology file for the input
   --topology-format=<format>    use <format> as format for the topology file
   --guess-bonds                 guess the bonds in the input
@@ -83,6 +91,12 @@ Options:
                                 autocorrelation and output it to the given
                                 <ouput> file. This can be used to retrieve the
                                 lifetime of hydrogen bonds.
+  --timings                     print a summary of the time spent in the
+                                different phases of the run to the standard
+                                error
+  --trace=<file>                record begin and end events for the phases of
+                                each frame on all threads, and write them to
+                                <file> in Chrome trace-event JSON format
 )";
 
 struct hbond {
@@ -120,6 +134,7 @@ static HBonds::Options parse_options(int argc, const char* argv[]) {
     HBonds::Options options;
     options.trajectory = args.at("<trajectory>").asString();
     options.guess_bonds = args.at("--guess-bonds").asBool();
+    options.fast_xyz = args.at("--fast-xyz").asBool();
 
     options.acceptor_selection = args.at("--acceptors").asString();
     options.donor_selection = args.at("--donors").asString();
@@ -175,6 +190,14 @@ static HBonds::Options parse_options(int argc, const char* argv[]) {
         options.cell = parse_cell(args.at("--cell").asString());
     }
 
+    if (args.at("--timings").asBool()) {
+        Timings::enable();
+    }
+
+    if (args.at("--trace")) {
+        Trace::enable(args.at("--trace").asString());
+    }
+
     return options;
 }
 
@@ -202,7 +225,7 @@ int HBonds::run(int argc, const char* argv[]) {
     fmt::print(outfile, "# Hydrogen bonds in {}\n", options.trajectory);
     fmt::print(outfile, "# Between '{}' and '{}'\n", options.acceptor_selection, options.donor_selection);
 
-    auto infile = Trajectory(options.trajectory, 'r', options.format);
+    TrajectoryReader infile(options.trajectory, options.format, options.fast_xyz);
     if (options.custom_cell) {
         infile.set_cell(options.cell);
     }
@@ -210,25 +233,67 @@ int HBonds::run(int argc, const char* argv[]) {
     if (options.topology != "") {
         infile.set_topology(options.topology, options.topology_format);
     }
+    infile.set_steps(options.steps);
 
     auto histogram = Histogram(options.npoints, 0, options.distance, options.npoints, 0, options.angle * 180 / PI);
     auto existing_bonds = std::unordered_map<hbond, std::vector<float>>();
+    auto acceptors_list = std::vector<size_t>();
+    // Donors and acceptors are looked up in a neighbor list, kept from one
+    // frame to the next
+    auto neighbors = NeighborList(options.distance);
+    auto neighbors_atoms = std::vector<size_t>();
+    auto is_acceptor = std::vector<bool>();
     size_t used_steps = 0;
+    auto frame = Frame();
     for (auto step: options.steps) {
-        if (step >= infile.nsteps()) {
-            break;
-        }
-        auto frame = infile.read_step(step);
-        if (options.guess_bonds) {
-            frame.guess_bonds();
+        {
+            ScopedTimer timer(Phase::Read, step);
+            if (!infile.read_step(step, frame)) {
+                break;
+            }
+            if (options.guess_bonds) {
+                frame.guess_bonds();
+            }
         }
 
         auto bonds = std::unordered_set<hbond>();
-        auto matched = donors.evaluate(frame);
+        auto matched = std::vector<Match>();
+        {
+            ScopedTimer timer(Phase::Select);
+            matched = donors.evaluate(frame);
+        }
         if (matched.empty()) {
             warn("no atom matching the donnor selection at step " + std::to_string(step));
         }
 
+        // The acceptors do not depend on the donor, so only evaluate the
+        // selection once per frame, and remove hydrogen atoms from the list
+        {
+            ScopedTimer timer(Phase::Select);
+            acceptors_list = acceptors.list(frame);
+        }
+        if (acceptors_list.empty()) {
+            warn("no atom matching the acceptor selection at step " + std::to_string(step));
+        }
+        auto& topology = frame.topology();
+        acceptors_list.erase(std::remove_if(acceptors_list.begin(), acceptors_list.end(), [&topology](size_t i) {
+            return topology[i].type() == "H";
+        }), acceptors_list.end());
+
+        ScopedTimer accumulate_timer(Phase::Accumulate, step);
+        is_acceptor.assign(frame.size(), false);
+        neighbors_atoms = acceptors_list;
+        for (auto acceptor: acceptors_list) {
+            is_acceptor[acceptor] = true;
+        }
+        for (auto& match: matched) {
+            neighbors_atoms.push_back(match[0]);
+        }
+        std::sort(neighbors_atoms.begin(), neighbors_atoms.end());
+        neighbors_atoms.erase(std::unique(neighbors_atoms.begin(), neighbors_atoms.end()), neighbors_atoms.end());
+        neighbors.update(frame, neighbors_atoms);
+
+        uint64_t pairs = 0;
         for (auto match: matched) {
             assert(match.size() == 2);
 
@@ -242,25 +307,29 @@ int HBonds::run(int argc, const char* argv[]) {
                 );
             }
 
-            auto acceptors_list = acceptors.list(frame);
-            if (acceptors_list.empty()) {
-                warn("no atom matching the acceptor selection at step " + std::to_string(step));
-            }
-
-            for (auto acceptor: acceptors_list) {
-                if (acceptor != donor && frame.topology()[acceptor].type() != "H") {
-                    auto distance = frame.distance(acceptor, donor);
-                    auto theta = frame.angle(acceptor, donor, hydrogen);
-                    if (distance < options.distance && theta < options.angle) {
-                        bonds.emplace(hbond{donor, hydrogen, acceptor});
-                        if (options.histogram) {
-                            histogram.insert(distance, theta * 180 / PI);
-                        }
+            // neighbors are sorted, giving the same order as acceptors_list
+            for (auto acceptor: neighbors.neighbors(donor)) {
+                if (!is_acceptor[acceptor]) {
+                    continue;
+                }
+                pairs++;
+                auto distance = frame.distance(acceptor, donor);
+                if (distance >= options.distance) {
+                    continue;
+                }
+                auto theta = frame.angle(acceptor, donor, hydrogen);
+                if (theta < options.angle) {
+                    bonds.emplace(hbond{donor, hydrogen, acceptor});
+                    if (options.histogram) {
+                        histogram.insert(distance, theta * 180 / PI);
                     }
                 }
             }
         }
 
+        Timings::count(Counter::Pairs, pairs);
+
+        ScopedTimer write_timer(Phase::Write);
         fmt::print(outfile, "# step n_bonds\n");
         fmt::print(outfile, "{} {}\n", step, bonds.size());
         fmt::print(outfile, "# Donnor Hydrogen Acceptor\n", step);
@@ -297,6 +366,7 @@ int HBonds::run(int argc, const char* argv[]) {
         }
 
         if (options.autocorrelation) {
+            ScopedTimer timer(Phase::Normalize);
             for (auto& bond: bonds) {
                 auto it = existing_bonds.find(bond);
                 if (it == existing_bonds.end()) {
@@ -315,10 +385,12 @@ int HBonds::run(int argc, const char* argv[]) {
                 }
             }
         }
+        Timings::count(Counter::Frames);
         used_steps += 1;
     }
 
     if (options.autocorrelation && used_steps != 0) {
+        ScopedTimer correlate_timer(Phase::Correlate);
         // Compute the autocorrelation for all bonds and average them
         auto correlator = Autocorrelation(used_steps);
         for (auto&& it: std::move(existing_bonds)) {
@@ -327,6 +399,7 @@ int HBonds::run(int argc, const char* argv[]) {
         correlator.normalize();
         auto& correlation = correlator.get_result();
 
+        ScopedTimer write_timer(Phase::Write);
         std::ofstream outcorr(options.autocorr_output, std::ios::out);
         if (!outcorr.is_open()) {
             throw CFilesError("Could not open the '" + options.autocorr_output + "' file.");
@@ -28,6 +28,8 @@ public:
         std::string topology_format;
         /// Should we try to guess the topology?
         bool guess_bonds = false;
+        /// Should we use the fast XYZ reader?
+        bool fast_xyz = false;
         /// HBonds output
         std::string outfile;
         /// Should we compute the autocorrelation
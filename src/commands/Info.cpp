@@ -1,7 +1,11 @@
 // cfiles, an analysis frontend for the Chemfiles library
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <sstream>
 
 #include <fmt/format.h>
@@ -11,7 +15,11 @@
 
 #include "Info.hpp"
 #include "Errors.hpp"
+#include "Timings.hpp"
+#include "XYZReader.hpp"
+#include "parallel.hpp"
 #include "utils.hpp"
+#include "warnings.hpp"
 
 using namespace chemfiles;
 
@@ -25,13 +33,30 @@ Usage:
 Examples:
     cfiles info water.xyz
     cfiles info --guess-bonds --step 4 water.xyz
+    cfiles info water.xyz -o water.info
+    cfiles info --scan water.xyz
 
 Options:
   -h --help                     show this help
+  -o <file>, --output=<file>    write the information to <file> instead of
+                                the standard output
   --format=<format>             force the input file format to be <format>
   --guess-bonds                 guess the bonds in the input
   --step=<step>                 give informations about the frame at <step>
                                 [default: 0]
+  --scan                        read all the frames in the trajectory in
+                                parallel, and report how the atoms count,
+                                topology, cell and steps change over the
+                                trajectory. For uncompressed XYZ files, this
+                                also saves an index of the frames positions
+                                next to the file, used to open this file
+                                faster later.
+  --timings                     print a summary of the time spent in the
+                                different phases of the run to the standard
+                                error
+  --trace=<file>                record begin and end events for the phases of
+                                each frame on all threads, and write them to
+                                <file> in Chrome trace-event JSON format
 )";
 
 static Info::Options parse_options(int argc, const char* argv[]) {
@@ -43,35 +68,242 @@ static Info::Options parse_options(int argc, const char* argv[]) {
     Info::Options options;
     options.input = args["<input>"].asString();
     options.guess_bonds = args.at("--guess-bonds").asBool();
+    options.scan = args.at("--scan").asBool();
     auto step = args.at("--step").asLong();
 
     if (args.at("--format")) {
         options.format = args.at("--format").asString();
     }
 
+    if (args.at("--output")) {
+        options.output = args.at("--output").asString();
+    }
+
     if (step >= 0) {
         options.step = static_cast<size_t>(step);
     } else {
         throw CFilesError("step must be positive");
     }
 
+    if (args.at("--timings").asBool()) {
+        Timings::enable();
+    }
+
+    if (args.at("--trace")) {
+        Trace::enable(args.at("--trace").asString());
+    }
+
     return options;
 }
 
+/// Statistics about a range of frames in a trajectory
+class ScanStatistics {
+public:
+    /// Add a new `frame` to the statistics
+    void add(const Frame& frame) {
+        if (count_ == 0) {
+            topology_ = frame.topology();
+        } else if (constant_topology_) {
+            constant_topology_ = same_topology(topology_, frame.topology());
+        }
+        count_ += 1;
+
+        atoms_.add(frame.size());
+        volume_.add(frame.cell().volume());
+        steps_.add(frame.step());
+        for (auto name: {"time", "Time"}) {
+            auto time = frame.get(name);
+            if (time && time->kind() == Property::DOUBLE) {
+                time_.add(time->as_double());
+                break;
+            }
+        }
+    }
+
+    /// Merge the statistics from `other`, which must contain frames after
+    /// the frames in this instance
+    void merge(const ScanStatistics& other) {
+        if (other.count_ == 0) {
+            return;
+        }
+
+        if (count_ == 0) {
+            topology_ = other.topology_;
+        } else {
+            constant_topology_ = constant_topology_ && other.constant_topology_ &&
+                                 same_topology(topology_, other.topology_);
+        }
+        count_ += other.count_;
+        atoms_.merge(other.atoms_);
+        volume_.merge(other.volume_);
+        steps_.merge(other.steps_);
+        time_.merge(other.time_);
+    }
+
+    /// Write the statistics to `output`
+    void write(std::ostream& output) const {
+        fmt::print(output, "frames_count = {}\n", count_);
+        if (count_ == 0) {
+            return;
+        }
+        fmt::print(output, "atoms_count = [{}, {}]\n", atoms_.min, atoms_.max);
+        fmt::print(output, "cell_volume = [{}, {}]\n", volume_.min, volume_.max);
+        fmt::print(output, "constant_topology = {}\n", constant_topology_ ? "true" : "false");
+        fmt::print(output, "frames_steps = [{}, {}]\n", steps_.min, steps_.max);
+        if (time_.count != 0) {
+            fmt::print(output, "time = [{}, {}]\n", time_.min, time_.max);
+        }
+    }
+
+private:
+    /// Range of values of a single quantity
+    template <typename T>
+    struct Range {
+        size_t count = 0;
+        T min = std::numeric_limits<T>::max();
+        T max = std::numeric_limits<T>::lowest();
+
+        void add(T value) {
+            count += 1;
+            min = std::min(min, value);
+            max = std::max(max, value);
+        }
+
+        void merge(const Range<T>& other) {
+            count += other.count;
+            min = std::min(min, other.min);
+            max = std::max(max, other.max);
+        }
+    };
+
+    /// Check if the `first` and `second` topologies contain the same atoms
+    /// and bonds
+    static bool same_topology(const Topology& first, const Topology& second) {
+        if (first.size() != second.size()) {
+            return false;
+        }
+        for (size_t i=0; i<first.size(); i++) {
+            if (first[i] != second[i]) {
+                return false;
+            }
+        }
+        return first.bonds() == second.bonds();
+    }
+
+    size_t count_ = 0;
+    Range<size_t> atoms_;
+    Range<double> volume_;
+    Range<size_t> steps_;
+    Range<double> time_;
+    /// Topology of the first frame
+    Topology topology_;
+    /// Do all frames have the same topology as the first one?
+    bool constant_topology_ = true;
+};
+
+/// Read all the `nsteps` frames of the input in parallel chunks, and write
+/// statistics about the whole trajectory to `output`. Uncompressed XYZ files
+/// are read with the fast reader `xyz`, and the other formats (when `xyz` is
+/// `nullptr`) with a separate chemfiles trajectory for each chunk.
+static void scan_trajectory(const Info::Options& options, const XYZReader* xyz, size_t nsteps, std::ostream& output) {
+    auto n_chunks = std::min(default_threads(), nsteps);
+    auto chunk_size = n_chunks == 0 ? 0 : (nsteps + n_chunks - 1) / n_chunks;
+    auto statistics = std::vector<ScanStatistics>(n_chunks);
+    parallel_for(n_chunks, [&](size_t chunk) {
+        auto begin = chunk * chunk_size;
+        auto end = std::min(begin + chunk_size, nsteps);
+
+        std::unique_ptr<Trajectory> trajectory;
+        if (!xyz) {
+            trajectory.reset(new Trajectory(options.input, 'r', options.format));
+        }
+
+        auto frame = Frame();
+        for (auto step=begin; step<end; step++) {
+            {
+                ScopedTimer timer(Phase::Read, step);
+                if (xyz) {
+                    xyz->parse_step(step, frame);
+                } else {
+                    frame = trajectory->read_step(step);
+                }
+            }
+            ScopedTimer timer(Phase::Accumulate, step);
+            if (options.guess_bonds) {
+                frame.guess_bonds();
+            }
+            statistics[chunk].add(frame);
+            Timings::count(Counter::Frames);
+        }
+    }, n_chunks);
+
+    auto all = ScanStatistics();
+    for (auto& chunk: statistics) {
+        all.merge(chunk);
+    }
+
+    fmt::print(output, "\n[scan]\n");
+    all.write(output);
+
+    if (xyz && xyz->nsteps() != 0) {
+        auto& offsets = xyz->frame_offsets();
+        auto min = std::numeric_limits<size_t>::max();
+        size_t max = 0;
+        size_t total = 0;
+        for (auto& frame: offsets) {
+            auto size = frame.second - frame.first;
+            min = std::min(min, size);
+            max = std::max(max, size);
+            total += size;
+        }
+        fmt::print(output, "frames_bytes = [{}, {}, {}]\n", min, total / offsets.size(), max);
+
+        try {
+            xyz->save_index();
+        } catch (const CFilesError& e) {
+            warn(std::string("could not save the frames index: ") + e.what());
+        }
+    }
+}
+
 std::string Info::description() const {
     return "get information on a trajectory";
 }
 
 int Info::run(int argc, const char* argv[]) {
     auto options = parse_options(argc, argv);
-    auto input = Trajectory(options.input, 'r', options.format);
+
+    auto format = options.format;
+    if (format.empty()) {
+        format = guess_format(options.input);
+    }
+
+    // When scanning uncompressed XYZ files, use the fast reader for
+    // everything: it finds all the frames in a single pass over the file, or
+    // directly from the saved index.
+    std::unique_ptr<XYZReader> xyz;
+    std::unique_ptr<Trajectory> input;
+    size_t nsteps = 0;
+    if (options.scan && format == "XYZ") {
+        xyz.reset(new XYZReader(options.input));
+        nsteps = xyz->nsteps();
+    } else {
+        input.reset(new Trajectory(options.input, 'r', options.format));
+        nsteps = input->nsteps();
+    }
 
     std::stringstream output;
     fmt::print(output, "file = {}\n", options.input);
-    fmt::print(output, "steps = {}\n", input.nsteps());
+    fmt::print(output, "steps = {}\n", nsteps);
 
-    if (input.nsteps() > options.step) {
-        auto frame = input.read_step(options.step);
+    if (nsteps > options.step) {
+        auto frame = Frame();
+        if (xyz) {
+            xyz->parse_step(options.step, frame);
+            frame.set_step(options.step);
+        } else {
+            frame = input->read_step(options.step);
+        }
         fmt::print(output, "\n[frame(step={})]\n", frame.step());
 
         auto& cell = frame.cell();
@@ -95,7 +327,19 @@ int Info::run(int argc, const char* argv[]) {
         fmt::print(output, "residues_count = {}\n", topology.residues().size());
     }
 
-    std::cout << output.str();
+    if (options.scan) {
+        scan_trajectory(options, xyz.get(), nsteps, output);
+    }
+
+    if (options.output.empty()) {
+        std::cout << output.str();
+    } else {
+        std::ofstream outfile(options.output, std::ios::out);
+        if (!outfile.is_open()) {
+            throw CFilesError("Could not open the '" + options.output + "' file.");
+        }
+        outfile << output.str();
+    }
 
     return 0;
 }
@@ -11,8 +11,10 @@ public:
     struct Options {
         std::string input;
         std::string format;
+        std::string output;
         bool guess_bonds;
         size_t step;
+        bool scan;
     };
 
     Info() {}
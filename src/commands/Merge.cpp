@@ -2,10 +2,19 @@
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
 #include <docopt/docopt.h>
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <fstream>
+#include <memory>
 #include <sstream>
+#include <thread>
 
+#include "BoundedQueue.hpp"
 #include "Merge.hpp"
 #include "Errors.hpp"
+#include "Timings.hpp"
+#include "XYZReader.hpp"
 #include "utils.hpp"
 
 using namespace chemfiles;
@@ -33,6 +42,17 @@ Options:
                                 <a:b:c:α:β:γ> or <a:b:c> or <a>. 'a', 'b' and
                                 'c' are in angstroms, 'α', 'β', and 'γ' are in
                                 degrees.
+  --resume                      continue an interrupted merge. The complete
+                                frames already in the output are kept,
+                                anything after them is removed, and the merge
+                                continues with the corresponding step of the
+                                inputs. This is only supported for XYZ output
+  --timings                     print a summary of the time spent in the
+                                different phases of the run to the standard
+                                error
+  --trace=<file>                record begin and end events for the phases of
+                                each frame on all threads, and write them to
+                                <file> in Chrome trace-event JSON format
   )";
 
 static Merge::Options parse_options(int argc, const char* argv[]) {
@@ -72,10 +92,129 @@ static Merge::Options parse_options(int argc, const char* argv[]) {
         options.cell = parse_cell(args["--cell"].asString());
     }
 
+    options.resume = args["--resume"].asBool();
+
+    if (args["--timings"].asBool()) {
+        Timings::enable();
+    }
+
+    if (args["--trace"]) {
+        Trace::enable(args["--trace"].asString());
+    }
+
     return options;
 }
 
 
+/// Merge the frames from multiple inputs in a single frame. The merged
+/// frame is re-used from one step to the next, and its topology is only
+/// built again when the topology of one of the inputs changes.
+class FrameMerger {
+public:
+    /// Merge all the `frames` in a single frame
+    const Frame& merge(const std::vector<Frame>& frames) {
+        bool velocities = false;
+        for (auto& frame: frames) {
+            velocities = velocities || static_cast<bool>(frame.velocities());
+        }
+        if (velocities != static_cast<bool>(merged_.velocities())) {
+            // there is no way to remove velocities from a frame
+            merged_ = Frame();
+            sizes_.clear();
+        }
+
+        bool changed = sizes_.size() != frames.size();
+        for (size_t i=0; i<frames.size() && !changed; i++) {
+            auto& topology = frames[i].topology();
+            changed = topology.size() != sizes_[i] || topology.bonds() != bonds_[i];
+        }
+
+        if (changed) {
+            update_topology(frames);
+            if (velocities && !merged_.velocities()) {
+                merged_.add_velocities();
+            }
+        } else {
+            // atoms can change from one frame to another, for example when
+            // reading per-atom properties
+            size_t start = 0;
+            for (auto& frame: frames) {
+                auto& topology = frame.topology();
+                for (size_t i=0; i<frame.size(); i++) {
+                    if (!(merged_[start + i] == topology[i])) {
+                        merged_[start + i] = topology[i];
+                    }
+                }
+                start += frame.size();
+            }
+        }
+
+        auto positions = merged_.positions();
+        size_t start = 0;
+        for (auto& frame: frames) {
+            std::copy(frame.positions().begin(), frame.positions().end(), positions.begin() + static_cast<std::ptrdiff_t>(start));
+
+            if (velocities) {
+                auto output = (*merged_.velocities()).begin() + static_cast<std::ptrdiff_t>(start);
+                auto input = frame.velocities();
+                if (input) {
+                    std::copy(input->begin(), input->end(), output);
+                } else {
+                    std::fill(output, output + static_cast<std::ptrdiff_t>(frame.size()), Vector3D());
+                }
+            }
+            start += frame.size();
+        }
+
+        return merged_;
+    }
+
+private:
+    /// Build the topology of the merged frame from the ones of `frames`
+    void update_topology(const std::vector<Frame>& frames) {
+        size_t natoms = 0;
+        for (auto& frame: frames) {
+            natoms += frame.size();
+        }
+
+        auto topology = Topology();
+        topology.reserve(natoms);
+        sizes_.clear();
+        bonds_.clear();
+        size_t start = 0;
+        for (auto& frame: frames) {
+            auto& input = frame.topology();
+            for (size_t i=0; i<input.size(); i++) {
+                topology.add_atom(input[i]);
+            }
+
+            // translate bonding informations
+            auto& bonds = input.bonds();
+            auto& orders = input.bond_orders();
+            for (size_t i=0; i<bonds.size(); i++) {
+                topology.add_bond(start + bonds[i][0], start + bonds[i][1], orders[i]);
+            }
+
+            sizes_.push_back(input.size());
+            bonds_.push_back(bonds);
+            start += input.size();
+        }
+
+        merged_.resize(natoms);
+        merged_.set_topology(topology);
+    }
+
+    /// Number of atoms in each input when the topology was last updated
+    std::vector<size_t> sizes_;
+    /// Bonds in each input when the topology was last updated
+    std::vector<std::vector<Bond>> bonds_;
+    /// Merged frame
+    Frame merged_;
+};
+
+/// Number of frames read ahead of the merge for each input
+static const size_t READ_AHEAD = 4;
+
 std::string Merge::description() const {
     return "merge multiple trajectories";
 }
@@ -88,93 +227,153 @@ int Merge::run(int argc, const char* argv[]) {
         auto trajectory = Trajectory(options.infiles[i], 'r', options.input_formats[i]);
         inputs.emplace_back(std::move(trajectory));
     }
-    auto outfile = Trajectory(options.outfile, 'w', options.output_format);
-
-    if (options.custom_cell) {
-        outfile.set_cell(options.cell);
-    }
 
     size_t step = 0;
     auto frames = std::vector<Frame>(inputs.size());
-    while (true) {
-        bool did_read_one_frame = false;
-        for (size_t i=0; i<inputs.size(); i++) {
-            // Handle trajectories with different number of steps
-            if (step < inputs[i].nsteps()) {
-                frames[i] = inputs[i].read();
-                did_read_one_frame = true;
-            }
+    if (options.resume) {
+        auto format = options.output_format;
+        if (format.empty()) {
+            format = guess_format(options.outfile, 'w');
+        }
+        if (format != "XYZ") {
+            throw CFilesError("'--resume' is only supported for uncompressed XYZ output");
         }
 
-        if (!did_read_one_frame) {
-            break;
+        if (std::ifstream(options.outfile).good()) {
+            step = XYZReader::truncate_incomplete(options.outfile);
         }
 
-        // Check that unit cells match
-        if (!options.custom_cell) {
-            // We use the first non-infinite cell as reference
-            auto reference = UnitCell();
-            for (auto& frame: frames) {
-                if (frame.cell().shape() != UnitCell::INFINITE) {
-                    reference = frame.cell();
-                    break;
+        if (step != 0) {
+            // Read the frame before the first step to merge, so that the next
+            // calls to `read` give the first step; and the last frame of
+            // shorter trajectories can be repeated.
+            ScopedTimer timer(Phase::Read, step);
+            for (size_t i=0; i<inputs.size(); i++) {
+                auto nsteps = inputs[i].nsteps();
+                if (nsteps != 0) {
+                    frames[i] = inputs[i].read_step(std::min(step, nsteps) - 1);
                 }
             }
+        }
+    }
 
-            // Either all the cell are the same, or there is one finite cell
-            // and multiple infinite cells
-            for (auto& frame: frames) {
-                if (frame.cell().shape() != UnitCell::INFINITE) {
-                    if (frame.cell() != reference) {
-                        throw CFilesError(
-                            "Mismatch in unit cells. Please specify which one "
-                            "you want using the --cell argument."
-                        );
+    auto outfile = Trajectory(options.outfile, options.resume ? 'a' : 'w', options.output_format);
+    if (options.custom_cell) {
+        outfile.set_cell(options.cell);
+    }
+
+    // Each input is read in its own thread, a few frames ahead of the merge
+    auto nsteps = std::vector<size_t>();
+    auto queues = std::vector<std::unique_ptr<BoundedQueue<Frame>>>();
+    auto errors = std::vector<std::exception_ptr>(inputs.size());
+    auto readers = std::vector<std::thread>();
+    for (size_t i=0; i<inputs.size(); i++) {
+        nsteps.push_back(inputs[i].nsteps());
+        queues.emplace_back(new BoundedQueue<Frame>(READ_AHEAD));
+    }
+    for (size_t i=0; i<inputs.size(); i++) {
+        readers.emplace_back([&, i, step]() {
+            try {
+                for (size_t current=step; current<nsteps[i]; current++) {
+                    auto frame = Frame();
+                    {
+                        ScopedTimer timer(Phase::Read, current);
+                        frame = inputs[i].read();
+                    }
+                    if (!queues[i]->push(std::move(frame))) {
+                        break;
                     }
                 }
+            } catch (...) {
+                errors[i] = std::current_exception();
             }
-        }
+            queues[i]->close();
+        });
+    }
 
-        bool one_frame_has_velocity = false;
-        size_t natoms = 0;
-        for (auto& frame: frames) {
-            one_frame_has_velocity = one_frame_has_velocity || static_cast<bool>(frame.velocities());
-            natoms += frame.size();
+    // Stop all the readers, and wait for them to finish
+    auto stop_readers = [&]() {
+        for (auto& queue: queues) {
+            queue->close();
         }
-
-        auto output_frame = Frame();
-        output_frame.reserve(natoms);
-        if (one_frame_has_velocity) {
-            output_frame.add_velocities();
+        for (auto& reader: readers) {
+            if (reader.joinable()) {
+                reader.join();
+            }
         }
+    };
 
-        auto start = 0;
-        for (auto& frame: frames) {
-            auto positions = frame.positions();
-            auto& topology = frame.topology();
-            for (size_t i=0; i<frame.size(); i++) {
-                output_frame.add_atom(topology[i], positions[i]);
+    try {
+        auto cells = std::vector<UnitCell>(frames.size());
+        auto merger = FrameMerger();
+        while (true) {
+            bool did_read_one_frame = false;
+            for (size_t i=0; i<frames.size(); i++) {
+                // Handle trajectories with different number of steps
+                if (step < nsteps[i]) {
+                    if (!queues[i]->pop(frames[i])) {
+                        if (errors[i]) {
+                            std::rethrow_exception(errors[i]);
+                        }
+                        throw CFilesError("could not read step " + std::to_string(step) + " of '" + options.infiles[i] + "'");
+                    }
+                    did_read_one_frame = true;
+                }
             }
 
-            if (frame.velocities()) {
-                auto velocities = *frame.velocities();
-                auto output_velocities = *output_frame.velocities();
-                for (size_t i=0; i<frame.size(); i++) {
-                    output_velocities[start + i] = velocities[i];
+            if (!did_read_one_frame) {
+                break;
+            }
+
+            ScopedTimer accumulate_timer(Phase::Accumulate, step);
+            // Check that unit cells match, only if they changed since the
+            // previous step
+            bool cells_changed = false;
+            for (size_t i=0; i<frames.size(); i++) {
+                if (frames[i].cell() != cells[i]) {
+                    cells[i] = frames[i].cell();
+                    cells_changed = true;
                 }
             }
 
-            // translate bonding informations
-            for (auto& bond: frame.topology().bonds()) {
-                output_frame.add_bond(start + bond[0], start + bond[1]);
+            if (!options.custom_cell && cells_changed) {
+                // We use the first non-infinite cell as reference
+                auto reference = UnitCell();
+                for (auto& cell: cells) {
+                    if (cell.shape() != UnitCell::INFINITE) {
+                        reference = cell;
+                        break;
+                    }
+                }
+
+                // Either all the cell are the same, or there is one finite cell
+                // and multiple infinite cells
+                for (auto& cell: cells) {
+                    if (cell.shape() != UnitCell::INFINITE) {
+                        if (cell != reference) {
+                            throw CFilesError(
+                                "Mismatch in unit cells. Please specify which one "
+                                "you want using the --cell argument."
+                            );
+                        }
+                    }
+                }
             }
 
-            start += frame.size();
-        }
+            auto& output_frame = merger.merge(frames);
 
-        outfile.write(output_frame);
-        step++;
+            {
+                ScopedTimer timer(Phase::Write);
+                outfile.write(output_frame);
+            }
+            Timings::count(Counter::Frames);
+            step++;
+        }
+    } catch (...) {
+        stop_readers();
+        throw;
     }
+    stop_readers();
 
     return 0;
 }
@@ -17,6 +17,7 @@ public:
         std::string output_format = "";
         bool custom_cell = false;
         chemfiles::UnitCell cell;
+        bool resume = false;
     };
 
     Merge() {}
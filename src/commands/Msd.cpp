@@ -11,6 +11,8 @@
 #include "Msd.hpp"
 #include "Autocorrelation.hpp"
 #include "Errors.hpp"
+#include "Timings.hpp"
+#include "TrajectoryReader.hpp"
 #include "utils.hpp"
 #include "warnings.hpp"
 
@@ -22,6 +24,9 @@ step of a trajectory. The resulting graph should be linear after a while, and
 can be used to extract diffusion coefficient D for movement in d dimensions:
     <[r(t) - r(0)]^2> = 2 * d * D * t
 
+The trajectory can be split in multiple segments, given as a comma separated
+list of files or as a glob pattern.
+
 Usage:
   cfiles msd [options] <trajectory>
   cfiles msd (-h | --help)
@@ -30,6 +35,7 @@ Examples:
   cfiles msd file.pdb -o msd.dat
   cfiles msd water.xyz --cell 15:15:25 --unwrap
   cfiles msd trajectory.nc --topology topol.pdb --selection "name Li"
+  cfiles msd "run.part*.xyz" --unwrap -o msd.dat
 
 Options:
   -h --help                     show this help
@@ -37,6 +43,10 @@ Options:
                                 trajectory file name with the `.msd.dat`
                                 extension.
   --format=<format>             force the input file format to be <format>
+  --fast-xyz                    use a faster reader for XYZ files, parsing
+                                multiple frames in parallel. Compressed
+                                .xyz.gz and .xyz.xz files are decompressed in
+                                a separate thread
   -t <path>, --topology=<path>  alternative topology file for the input
   --topology-format=<format>    use <format> as format for the topology file
   --guess-bonds                 guess the bonds in the input
@@ -57,6 +67,12 @@ Options:
                                 [default: all]
   --unwrap                      undo periodic boundary condition wrapping,
                                 placing atoms back outside of the box
+  --timings                     print a summary of the time spent in the
+                                different phases of the run to the standard
+                                error
+  --trace=<file>                record begin and end events for the phases of
+                                each frame on all threads, and write them to
+                                <file> in Chrome trace-event JSON format
 )";
 
 static MSD::Options parse_options(int argc, const char* argv[]) {
@@ -68,6 +84,7 @@ static MSD::Options parse_options(int argc, const char* argv[]) {
     MSD::Options options;
     options.trajectory = args.at("<trajectory>").asString();
     options.guess_bonds = args.at("--guess-bonds").asBool();
+    options.fast_xyz = args.at("--fast-xyz").asBool();
 
     options.selection = args.at("--selection").asString();
 
@@ -106,6 +123,14 @@ static MSD::Options parse_options(int argc, const char* argv[]) {
 
     options.unwrap = args.at("--unwrap").asBool();
 
+    if (args.at("--timings").asBool()) {
+        Timings::enable();
+    }
+
+    if (args.at("--trace")) {
+        Trace::enable(args.at("--trace").asString());
+    }
+
     return options;
 }
 
@@ -128,7 +153,7 @@ int MSD::run(int argc, const char* argv[]) {
     fmt::print(outfile, "# Mean Square Deviation in {}\n", options.trajectory);
     fmt::print(outfile, "# For atoms '{}'\n", options.selection);
 
-    auto trajectory = Trajectory(options.trajectory, 'r', options.format);
+    TrajectoryReader trajectory(options.trajectory, options.format, options.fast_xyz);
     if (options.custom_cell) {
         trajectory.set_cell(options.cell);
     }
@@ -136,35 +161,56 @@ int MSD::run(int argc, const char* argv[]) {
     if (options.topology != "") {
         trajectory.set_topology(options.topology, options.topology_format);
     }
+    trajectory.set_steps(options.steps);
 
     // Pre-allocate memory to store the positions of each atom at each time step
-    auto frame = trajectory.read_step(options.steps.first());
-    if (options.guess_bonds) {
-        frame.guess_bonds();
+    auto frame = Frame();
+    {
+        ScopedTimer timer(Phase::Read, options.steps.first());
+        if (!trajectory.read_step(options.steps.first(), frame)) {
+            throw CFilesError("the first step is past the end of the trajectory");
+        }
+        if (options.guess_bonds) {
+            frame.guess_bonds();
+        }
     }
     auto natoms = selection.list(frame).size();
-    auto nsteps = options.steps.count(trajectory.nsteps());
 
+    // Counting the steps in compressed files requires to decompress them, so
+    // the number of steps is only used to pre-allocate memory when it is
+    // cheap to get
+    size_t expected_steps = 0;
+    if (!trajectory.nsteps_requires_decompression()) {
+        expected_steps = options.steps.count(trajectory.nsteps());
+    }
     auto positions = std::vector<std::array<std::vector<float>, 3>>(natoms);
     for (size_t atom=0; atom<natoms; atom++) {
-        positions[atom][0] = std::vector<float>(nsteps, 0.0);
-        positions[atom][1] = std::vector<float>(nsteps, 0.0);
-        positions[atom][2] = std::vector<float>(nsteps, 0.0);
+        positions[atom][0].reserve(expected_steps);
+        positions[atom][1].reserve(expected_steps);
+        positions[atom][2].reserve(expected_steps);
     }
 
     // First, extract all the positions we need
-    size_t current_step = 0;
-    auto previous_frame = std::move(frame);
+    size_t nsteps = 0;
+    // the first frame was already read above, reading it again would
+    // restart the decoding of multiple segments
+    auto previous_frame = frame.clone();
     for (auto step: options.steps) {
-        if (step >= trajectory.nsteps()) {
-            break;
-        }
-        auto frame = trajectory.read_step(step);
-        if (options.guess_bonds) {
-            frame.guess_bonds();
+        if (nsteps != 0) {
+            ScopedTimer timer(Phase::Read, step);
+            if (!trajectory.read_step(step, frame)) {
+                break;
+            }
+            if (options.guess_bonds) {
+                frame.guess_bonds();
+            }
         }
 
-        auto matched = selection.list(frame);
+        auto matched = std::vector<size_t>();
+        {
+            ScopedTimer timer(Phase::Select);
+            matched = selection.list(frame);
+        }
         if (matched.size() != natoms) {
             throw CFilesError(fmt::format(
                 "the number of atoms matched by '{}' changed from {} to {} since the first step",
@@ -172,6 +218,7 @@ int MSD::run(int argc, const char* argv[]) {
             ));
         }
 
+        ScopedTimer timer(Phase::Accumulate, step);
         auto current_positions = frame.positions();
         auto previous_positions = previous_frame.positions();
 
@@ -210,13 +257,15 @@ int MSD::run(int argc, const char* argv[]) {
                 current = cell * (prev_frac + delta);
             }
 
-            positions[atom][0][current_step] = current[0];
-            positions[atom][1][current_step] = current[1];
-            positions[atom][2][current_step] = current[2];
+            positions[atom][0].push_back(static_cast<float>(current[0]));
+            positions[atom][1].push_back(static_cast<float>(current[1]));
+            positions[atom][2].push_back(static_cast<float>(current[2]));
         }
 
-        current_step++;
-        previous_frame = std::move(frame);
+        Timings::count(Counter::Frames);
+        nsteps++;
+        // keep the old previous frame around to re-use its memory
+        std::swap(previous_frame, frame);
     }
 
     // We want to compute <[r(t) - r(0)]^2> where <...> denotes average on the
@@ -225,6 +274,7 @@ int MSD::run(int argc, const char* argv[]) {
     // computed directly, and the last one through the autocorrelation
     // framework.
     auto msd = std::vector<double>(nsteps, 0.0);
+    ScopedTimer correlate_timer(Phase::Correlate);
 
     // Start with the <r(t)^2 + r(0)^2> term
     for (size_t atom=0; atom<natoms; atom++) {
@@ -270,6 +320,7 @@ int MSD::run(int argc, const char* argv[]) {
         msd[step] += -2 * 3 * correlated[step];
     }
 
+    ScopedTimer write_timer(Phase::Write);
     for (size_t step=1; step<nsteps / 2; step++) {
         fmt::print(outfile, "{} {}\n", step * options.steps.stride(), msd[step]);
     }
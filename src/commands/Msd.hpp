@@ -28,6 +28,8 @@ public:
         std::string topology_format;
         /// Should we try to guess the topology?
         bool guess_bonds = false;
+        /// Should we use the fast XYZ reader?
+        bool fast_xyz = false;
         /// msd output
         std::string outfile;
         /// Selection of atoms to use when computing MSD
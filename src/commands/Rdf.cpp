@@ -2,11 +2,12 @@
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
 #include <docopt/docopt.h>
-#include <unordered_set>
 #include <fstream>
 
 #include "Rdf.hpp"
+#include "AtomicFile.hpp"
 #include "Errors.hpp"
+#include "Timings.hpp"
 #include "utils.hpp"
 #include "warnings.hpp"
 
@@ -16,18 +17,28 @@ constexpr double PI = 3.141592653589793238463;
 /// Get the radius of the biggest inscribed sphere in the unit cell
 static double biggest_sphere_radius(const UnitCell& cell);
 
+/// Minimal number of atoms or pairs for each thread when accumulating a
+/// single frame in parallel
+static const size_t MIN_ITEMS_PER_THREAD = 4096;
+
 static const char OPTIONS[] =
 R"(Compute radial pair distribution function (often denoted g(r)) and running
 coordination number. The pair of particles to use can be specified using the
 chemfiles selection language. It is possible to provide an alternative unit
 cell or topology for the trajectory file if they are not defined in the
-trajectory format.
+trajectory format. The trajectory can be split in multiple segments, given as
+a comma separated list of files or as a glob pattern.
+
+Multiple trajectories can be given, and are then used as independent replicas
+of the same system. Each replica is processed in its own thread, and the
+output contains the weighted average over all replicas, as well as the
+standard deviation of g(r) between replicas.
 
 For more information about chemfiles selection language, please see
 http://chemfiles.github.io/chemfiles/latest/selections.html
 
 Usage:
-  cfiles rdf [options] <trajectory>
+  cfiles rdf [options] <trajectory>...
   cfiles rdf (-h | --help)
 
 Examples:
@@ -36,6 +47,8 @@ Examples:
   cfiles rdf methane.xyz --cell 15:15:25 --guess-bonds --points=150
   cfiles rdf result.xtc --topology=initial.mol --topology-format=PDB
   cfiles rdf simulation.pdb --steps=10000::100 -o partial-rdf.dat
+  cfiles rdf "run.part*.xyz" -s "name O" -o rdf-O-O.dat
+  cfiles rdf replica-1.xtc replica-2.xtc replica-3.xtc -s "name O"
 
 Options:
   -h --help                     show this help
@@ -113,34 +126,82 @@ Averager Rdf::setup(int argc, const char* argv[]) {
         }
     }
 
+    neighbors_ = NeighborList(options_.rmax);
     coord_ij_ = Averager(options_.npoints, 0, options_.rmax);
     coord_ji_ = Averager(options_.npoints, 0, options_.rmax);
+    coord_ij_.set_window(AveCommand::options().window);
+    coord_ji_.set_window(AveCommand::options().window);
     return Averager(options_.npoints, 0, options_.rmax);
 }
 
-void Rdf::finish(const Histogram& histogram) {
+std::unique_ptr<AveCommand> Rdf::replica() const {
+    return std::unique_ptr<AveCommand>(new Rdf());
+}
+
+void Rdf::combine(const std::vector<AveCommand*>& replicas, const std::vector<double>& weights) {
     coord_ij_.average();
     coord_ji_.average();
+    if (replicas.empty()) {
+        return;
+    }
+
+    auto coord_ij = std::vector<const Histogram*>{&coord_ij_};
+    auto coord_ji = std::vector<const Histogram*>{&coord_ji_};
+    for (auto replica: replicas) {
+        auto& rdf = static_cast<Rdf&>(*replica);
+        rdf.coord_ij_.average();
+        rdf.coord_ji_.average();
+        coord_ij.push_back(&rdf.coord_ij_);
+        coord_ji.push_back(&rdf.coord_ji_);
+    }
+
+    auto spread = Histogram();
+    combine_histograms(coord_ij, weights, coord_ij_, spread);
+    combine_histograms(coord_ji, weights, coord_ji_, spread);
+}
+
+void Rdf::save_checkpoint(CheckpointWriter& checkpoint) const {
+    coord_ij_.save(checkpoint);
+    coord_ji_.save(checkpoint);
+}
+
+void Rdf::load_checkpoint(CheckpointReader& checkpoint) {
+    coord_ij_.load(checkpoint);
+    coord_ji_.load(checkpoint);
+}
 
-    std::ofstream outfile(options_.outfile, std::ios::out);
+void Rdf::finish(const Histogram& histogram) {
+    AtomicFile outfile(output_path(options_.outfile));
     if(!outfile.is_open()) {
         throw CFilesError("Could not open the '" + options_.outfile + "' file.");
     }
 
     outfile << "# Radial distribution function in trajectory " << AveCommand::options().trajectory << std::endl;
+    write_replicas(outfile);
+    write_convergence(outfile);
     outfile << "# Using selection: " << options_.selection << std::endl;
-    outfile << "# r   g(r)   N_ij(r)   N_ji(r)" << std::endl;
+
+    bool replicas = AveCommand::options().replicas.size() > 1;
+    if (replicas) {
+        outfile << "# r   g(r)   N_ij(r)   N_ji(r)   std(g(r))" << std::endl;
+    } else {
+        outfile << "# r   g(r)   N_ij(r)   N_ji(r)" << std::endl;
+    }
 
     for (size_t i=0; i<histogram.size(); i++){
-        outfile << histogram.first().coord(i) << " " << histogram[i] << " " << coord_ij_[i] << " " << coord_ji_[i] << "\n";
+        outfile << histogram.first().coord(i) << " " << histogram[i] << " " << coord_ij_[i] << " " << coord_ji_[i];
+        if (replicas) {
+            outfile << " " << spread()[i];
+        }
+        outfile << "\n";
     }
+    outfile.commit();
 }
 
 void Rdf::accumulate(const Frame& frame, Histogram& histogram) {
     check_rmax(frame);
 
-    auto positions = frame.positions();
-    auto cell = frame.cell();
+    auto& cell = frame.cell();
     size_t n_first = 0;
     size_t n_second = 0;
 
@@ -167,58 +228,86 @@ void Rdf::accumulate(const Frame& frame, Histogram& histogram) {
 
     if (selection_.size() == 1) {
         // Use the same selection for both atoms in the pair
-        auto matched = selection_.list(frame);
+        auto matched = std::vector<size_t>();
+        {
+            ScopedTimer timer(Phase::Select);
+            matched = selection_.list(frame);
+        }
         n_first = matched.size();
 
         if (use_center) {
             // The center point is given as a vector
-            auto& cell = frame.cell();
             auto& positions = frame.positions();
             n_second = 1;
-            for (auto i: matched) {
-                auto rij = center - positions[i];
-                cell.wrap(rij);
-                auto d = rij.norm();
-                if (d < options_.rmax){
-                    histogram.insert(d);
+            Timings::count(Counter::Pairs, matched.size());
+            parallel_accumulate(matched.size(), MIN_ITEMS_PER_THREAD, histogram, [&](size_t begin, size_t end, Histogram& local) {
+                for (auto k=begin; k<end; k++) {
+                    auto rij = center - positions[matched[k]];
+                    cell.wrap(rij);
+                    auto d = rij.norm();
+                    if (d < options_.rmax){
+                        local.insert(d);
+                    }
                 }
-            }
+            });
         } else {
-            // Use the same selection for both atoms in the pair
+            // Use the same selection for both atoms in the pair, only
+            // looking at the pairs in the neighbor list
             n_second = matched.size();
-            for (auto i: matched) {
-                for (auto j: matched) {
-                    if (i == j) continue;
+            neighbors_.update(frame, matched, frame_threads());
 
-                    auto rij = frame.distance(i, j);
-                    if (rij < options_.rmax){
-                        histogram.insert(rij);
+            auto& positions = frame.positions();
+            parallel_accumulate(matched.size(), MIN_ITEMS_PER_THREAD, histogram, [&](size_t begin, size_t end, Histogram& local) {
+                uint64_t pairs = 0;
+                for (auto k=begin; k<end; k++) {
+                    auto i = matched[k];
+                    for (auto j: neighbors_.neighbors(i)) {
+                        pairs++;
+                        auto rij = cell.wrap(positions[j] - positions[i]).norm();
+                        if (rij < options_.rmax){
+                            local.insert(rij);
+                        }
                     }
                 }
-            }
+                Timings::count(Counter::Pairs, pairs);
+            });
         }
     } else {
         // If we have a pair selection, use it directly
         assert(selection_.size() == 2);
-        auto matched = selection_.evaluate(frame);
-        std::unordered_set<size_t> first_particles;
-        std::unordered_set<size_t> second_particles;
+        auto matched = std::vector<Match>();
+        {
+            ScopedTimer timer(Phase::Select);
+            matched = selection_.evaluate(frame);
+        }
+        Timings::count(Counter::Pairs, matched.size());
+        // Use flags instead of sets to count the particles, to prevent any
+        // allocation when the frame size does not change
+        first_particles_.assign(frame.size(), false);
+        second_particles_.assign(frame.size(), false);
 
         for (auto match: matched) {
             auto i = match[0];
             auto j = match[1];
 
-            first_particles.insert(i);
-            second_particles.insert(j);
-
-            auto rij = frame.distance(i, j);
-            if (rij < options_.rmax){
-                histogram.insert(rij);
+            if (!first_particles_[i]) {
+                first_particles_[i] = true;
+                n_first++;
+            }
+            if (!second_particles_[j]) {
+                second_particles_[j] = true;
+                n_second++;
             }
         }
 
-        n_first = first_particles.size();
-        n_second = second_particles.size();
+        parallel_accumulate(matched.size(), MIN_ITEMS_PER_THREAD, histogram, [&](size_t begin, size_t end, Histogram& local) {
+            for (auto k=begin; k<end; k++) {
+                auto rij = frame.distance(matched[k][0], matched[k][1]);
+                if (rij < options_.rmax){
+                    local.insert(rij);
+                }
+            }
+        });
     }
 
     if (n_first == 0 || n_second == 0) {
@@ -5,6 +5,7 @@
 #define CFILES_RDF_HPP
 
 #include "AveCommand.hpp"
+#include "NeighborList.hpp"
 
 class Rdf final: public AveCommand {
 public:
@@ -27,6 +28,10 @@ public:
     Averager setup(int argc, const char* argv[]) override;
     void accumulate(const chemfiles::Frame& frame, Histogram& histogram) override;
     void finish(const Histogram& histogram) override;
+    std::unique_ptr<AveCommand> replica() const override;
+    void combine(const std::vector<AveCommand*>& replicas, const std::vector<double>& weights) override;
+    void save_checkpoint(CheckpointWriter& checkpoint) const override;
+    void load_checkpoint(CheckpointReader& checkpoint) override;
 
 private:
     /// Check if the maximal distance is larger than the biggest inscribed
@@ -45,6 +50,13 @@ private:
     /// j->i pairs
     Averager coord_ij_;
     Averager coord_ji_;
+    /// Scratch buffers used to count the particles in pair selections, kept
+    /// around to be re-used from one frame to the next
+    std::vector<bool> first_particles_;
+    std::vector<bool> second_particles_;
+    /// Neighbor list for the pairs in single atom selections, kept from one
+    /// frame to the next
+    NeighborList neighbors_;
 };
 
 #endif
@@ -9,6 +9,8 @@
 
 #include "Rotcf.hpp"
 #include "Autocorrelation.hpp"
+#include "Timings.hpp"
+#include "TrajectoryReader.hpp"
 #include "warnings.hpp"
 
 using namespace chemfiles;
@@ -17,7 +19,8 @@ static const char OPTIONS[] =
 R"(Compute rotation correlation dynamic for arbitrary bonds and molecules. The
 bonds and molecules to use are specified using chemfiles selection language.
 This analysis does not support changes in the topology or the matched atoms
-during the simulation.
+during the simulation. The trajectory can be split in multiple segments, given
+as a comma separated list of files or as a glob pattern.
 
 For more information about chemfiles selection language, please see
 http://chemfiles.org/chemfiles/latest/selections.html
@@ -29,6 +32,7 @@ Usage:
 Examples:
   cfiles rotcf water.xyz --cell 15:15:25
   cfiles rotcf input.pdb -s "bonds: type(#1) O and type(#2) H"
+  cfiles rotcf part1.xyz,part2.xyz,part3.xyz --cell 15:15:25
 
 Options:
   -h --help                     show this help
@@ -36,6 +40,10 @@ Options:
                                 trajectory file name with the `.rotcf.dat`
                                 extension.
   --format=<format>             force the input file format to be <format>
+  --fast-xyz                    use a faster reader for XYZ files, parsing
+                                multiple frames in parallel. Compressed
+                                .xyz.gz and .xyz.xz files are decompressed in
+                                a separate thread
   -t <path>, --topology=<path>  alternative topology file for the input
   --topology-format=<format>    use <format> as format for the topology file
   --guess-bonds                 guess the bonds in the input
@@ -52,6 +60,12 @@ Options:
                                 <stride>.
   --selection=<sel>, -s <sel>   selection to use for the donors. This must be a
                                 selection of size 2 [default: bonds: all]
+  --timings                     print a summary of the time spent in the
+                                different phases of the run to the standard
+                                error
+  --trace=<file>                record begin and end events for the phases of
+                                each frame on all threads, and write them to
+                                <file> in Chrome trace-event JSON format
 )";
 
 static Rotcf::Options parse_options(int argc, const char* argv[]) {
@@ -63,6 +77,7 @@ static Rotcf::Options parse_options(int argc, const char* argv[]) {
     Rotcf::Options options;
     options.trajectory = args.at("<trajectory>").asString();
     options.guess_bonds = args.at("--guess-bonds").asBool();
+    options.fast_xyz = args.at("--fast-xyz").asBool();
 
     options.selection = args.at("--selection").asString();
 
@@ -99,6 +114,14 @@ static Rotcf::Options parse_options(int argc, const char* argv[]) {
         options.cell = parse_cell(args.at("--cell").asString());
     }
 
+    if (args.at("--timings").asBool()) {
+        Timings::enable();
+    }
+
+    if (args.at("--trace")) {
+        Trace::enable(args.at("--trace").asString());
+    }
+
     return options;
 }
 
@@ -114,7 +137,7 @@ int Rotcf::run(int argc, const char* argv[]) {
         throw CFilesError("Selection must have a size of 2 (either bonds: or pairs:)");
     }
 
-    auto trajectory = Trajectory(options.trajectory, 'r', options.format);
+    TrajectoryReader trajectory(options.trajectory, options.format, options.fast_xyz);
     if (options.custom_cell) {
         trajectory.set_cell(options.cell);
     }
@@ -122,24 +145,43 @@ int Rotcf::run(int argc, const char* argv[]) {
     if (options.topology != "") {
         trajectory.set_topology(options.topology, options.topology_format);
     }
+    trajectory.set_steps(options.steps);
 
-    auto frame = trajectory.read_step(options.steps.first());
-    if (options.guess_bonds) {
-        frame.guess_bonds();
+    auto frame = Frame();
+    {
+        ScopedTimer timer(Phase::Read, options.steps.first());
+        if (!trajectory.read_step(options.steps.first(), frame)) {
+            throw CFilesError("the first step is past the end of the trajectory");
+        }
+        if (options.guess_bonds) {
+            frame.guess_bonds();
+        }
     }
 
-    auto matched = selection.evaluate(frame);
+    auto matched = std::vector<Match>();
+    {
+        ScopedTimer timer(Phase::Select);
+        matched = selection.evaluate(frame);
+    }
     if (matched.empty()) {
         warn("no matching atom in the first frame");
         return 0;
     }
 
     auto vectors = std::vector<std::vector<Vector3D>>(matched.size());
+    // the first frame was already read above, reading it again would
+    // restart the decoding of multiple segments
+    bool first_frame = true;
     for (auto step: options.steps) {
-        if (step >= trajectory.nsteps()) {
-            break;
+        if (!first_frame) {
+            ScopedTimer timer(Phase::Read, step);
+            if (!trajectory.read_step(step, frame)) {
+                break;
+            }
         }
-        auto frame = trajectory.read_step(step);
+        first_frame = false;
+
+        ScopedTimer timer(Phase::Accumulate, step);
         auto positions = frame.positions();
         for (size_t i=0; i<matched.size(); i++) {
             auto& match = matched[i];
@@ -149,6 +191,7 @@ int Rotcf::run(int argc, const char* argv[]) {
             rij /= rij.norm();
             vectors[i].push_back(rij);
         }
+        Timings::count(Counter::Frames);
     }
 
     // Following GROMACS, we compute the P2 autocorrelation using 6 different
@@ -181,6 +224,7 @@ int Rotcf::run(int argc, const char* argv[]) {
         }
     };
 
+    ScopedTimer correlate_timer(Phase::Correlate);
     do_correlation(0, 0);
     do_correlation(1, 1);
     do_correlation(2, 2);
@@ -192,6 +236,7 @@ int Rotcf::run(int argc, const char* argv[]) {
         result[i] -= 0.5;
     }
 
+    ScopedTimer write_timer(Phase::Write);
     std::ofstream output(options.outfile, std::ios::out);
     if (!output.is_open()) {
         throw CFilesError("Could not open the '" + options.outfile + "' file.");
@@ -4,10 +4,13 @@
 #include <iostream>
 
 #include "CommandFactory.hpp"
+#include "Timings.hpp"
+#include "Trace.hpp"
 #include "utils.hpp"
 
 static void list_commands();
 static void print_usage();
+static bool write_trace();
 
 int main(int argc, const char* argv[]) {
     // Check first for version or help flags
@@ -38,13 +41,37 @@ int main(int argc, const char* argv[]) {
 
     try {
         auto command = get_command(argv[1]);
-        return command->run(argc - 1, &argv[1]);
+        auto status = command->run(argc - 1, &argv[1]);
+        if (Timings::enabled()) {
+            Timings::print(std::cerr);
+        }
+        if (!write_trace()) {
+            return 2;
+        }
+        return status;
     } catch (const std::exception& e){
         std::cout << "Error: " << e.what() << std::endl;
+        // the trace is most useful when something went wrong
+        write_trace();
         return 2;
     }
 }
 
+/// Write the recorded events if tracing is enabled, returning `false` if
+/// the trace could not be written
+static bool write_trace() {
+    if (!Trace::enabled()) {
+        return true;
+    }
+    try {
+        Trace::write();
+        return true;
+    } catch (const std::exception& e){
+        std::cout << "Error: " << e.what() << std::endl;
+        return false;
+    }
+}
+
 
 static void print_usage() {
     std::cout << "cfiles: file algorithms for theoretical chemistry\n";
@@ -0,0 +1,80 @@
+// cfiles, an analysis frontend for the Chemfiles library
+// Copyright (C) Guillaume Fraux and contributors -- BSD license
+
+#ifndef CFILES_PARALLEL_HPP
+#define CFILES_PARALLEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <vector>
+
+/// Maximal number of threads returned by `default_threads`, or 0 if there
+/// is no limit
+inline std::atomic<size_t>& threads_limit() {
+    static std::atomic<size_t> limit(0);
+    return limit;
+}
+
+/// Limit the number of threads returned by `default_threads` to `limit`, for
+/// example when running multiple commands at the same time. Use 0 to remove
+/// the limit.
+inline void set_threads_limit(size_t limit) {
+    threads_limit() = limit;
+}
+
+/// Get the default number of threads to use for parallel work
+inline size_t default_threads() {
+    auto n_threads = static_cast<size_t>(std::thread::hardware_concurrency());
+    auto limit = threads_limit().load();
+    if (limit != 0) {
+        n_threads = std::min(n_threads, limit);
+    }
+    return std::max(n_threads, static_cast<size_t>(1));
+}
+
+/// Call `function(i)` for all `i` in `[0, size)`, splitting the work in
+/// contiguous chunks between `n_threads` threads. If any call to `function`
+/// throws, the first exception is re-thrown in the calling thread after all
+/// the threads finished.
+template <typename Function>
+void parallel_for(size_t size, Function function, size_t n_threads = default_threads()) {
+    n_threads = std::min(n_threads, size);
+    if (n_threads <= 1) {
+        for (size_t i=0; i<size; i++) {
+            function(i);
+        }
+        return;
+    }
+
+    auto errors = std::vector<std::exception_ptr>(n_threads);
+    auto threads = std::vector<std::thread>();
+    threads.reserve(n_threads);
+    auto chunk = (size + n_threads - 1) / n_threads;
+    for (size_t thread=0; thread<n_threads; thread++) {
+        auto begin = thread * chunk;
+        auto end = std::min(begin + chunk, size);
+        threads.emplace_back([&function, &errors, thread, begin, end]() {
+            try {
+                for (size_t i=begin; i<end; i++) {
+                    function(i);
+                }
+            } catch (...) {
+                errors[thread] = std::current_exception();
+            }
+        });
+    }
+
+    for (auto& thread: threads) {
+        thread.join();
+    }
+
+    for (auto& error: errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+#endif
@@ -1,8 +1,27 @@
 // cfiles, an analysis frontend for the Chemfiles library
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
+#include <algorithm>
+#include <fstream>
 #include <sstream>
 
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #include <chemfiles.hpp>
 #include <chemfiles.h>
 
@@ -106,6 +125,108 @@ chemfiles::UnitCell parse_cell(const std::string& string) {
     }
 }
 
+#if defined(__linux__)
+/// Close a file descriptor when going out of scope
+class FileDescriptor {
+public:
+    FileDescriptor(int fd, const std::string& path): fd_(fd) {
+        if (fd_ < 0) {
+            throw CFilesError("Could not open the '" + path + "' file: " + std::strerror(errno));
+        }
+    }
+    ~FileDescriptor() {
+        close(fd_);
+    }
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    int get() const {return fd_;}
+
+private:
+    int fd_;
+};
+
+/// Copy `size` bytes from `input` to `output` using read and write
+static void copy_with_buffer(int input, int output, size_t size, const std::string& path) {
+    auto buffer = std::vector<char>(1 << 20);
+    while (size != 0) {
+        auto count = read(input, buffer.data(), std::min(buffer.size(), size));
+        if (count <= 0) {
+            throw CFilesError("failed to read from '" + path + "'");
+        }
+        auto data = buffer.data();
+        auto remaining = static_cast<size_t>(count);
+        while (remaining != 0) {
+            auto written = write(output, data, remaining);
+            if (written < 0) {
+                throw CFilesError("failed to write data: " + std::string(std::strerror(errno)));
+            }
+            data += written;
+            remaining -= static_cast<size_t>(written);
+        }
+        size -= static_cast<size_t>(count);
+    }
+}
+
+void concatenate_files(const std::vector<std::string>& inputs, const std::string& output, bool append) {
+    auto flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+    FileDescriptor out(open(output.c_str(), flags, 0644), output);
+    for (auto& path: inputs) {
+        FileDescriptor in(open(path.c_str(), O_RDONLY), path);
+        struct stat status;
+        if (fstat(in.get(), &status) != 0) {
+            throw CFilesError("could not get the size of '" + path + "'");
+        }
+        auto size = static_cast<size_t>(status.st_size);
+
+#if defined(SYS_copy_file_range)
+        while (size != 0) {
+            auto copied = syscall(SYS_copy_file_range, in.get(), nullptr, out.get(), nullptr, size, 0);
+            if (copied <= 0) {
+                // not supported by the kernel or between these file
+                // systems, use the standard copy for the remaining data
+                break;
+            }
+            size -= static_cast<size_t>(copied);
+        }
+#endif
+        copy_with_buffer(in.get(), out.get(), size, path);
+    }
+}
+#else
+void concatenate_files(const std::vector<std::string>& inputs, const std::string& output, bool append) {
+    std::ofstream out(output, std::ios::binary | (append ? std::ios::app : std::ios::trunc));
+    if (!out.is_open()) {
+        throw CFilesError("Could not open the '" + output + "' file.");
+    }
+    for (auto& path: inputs) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in.is_open()) {
+            throw CFilesError("Could not open the '" + path + "' file.");
+        }
+        out << in.rdbuf();
+    }
+    if (!out) {
+        throw CFilesError("failed to write to '" + output + "'");
+    }
+}
+#endif
+
+void truncate_file(const std::string& path, size_t size) {
+#if defined(_WIN32)
+    auto fd = _open(path.c_str(), _O_WRONLY | _O_BINARY);
+    auto status = fd < 0 ? -1 : _chsize_s(fd, static_cast<__int64>(size));
+    if (fd >= 0) {
+        _close(fd);
+    }
+#else
+    auto status = truncate(path.c_str(), static_cast<off_t>(size));
+#endif
+    if (status != 0) {
+        throw CFilesError("Could not truncate the '" + path + "' file.");
+    }
+}
+
 steps_range steps_range::parse(const std::string& string) {
     steps_range range;
     auto splitted = split(string, ':');
@@ -32,6 +32,15 @@ std::string trim(const std::string& str);
 /// Parse an unit cell string
 chemfiles::UnitCell parse_cell(const std::string& string);
 
+/// Write the content of all the `inputs` files one after the other in the
+/// `output` file, replacing its content or appending to it if `append` is
+/// `true`. On Linux, the data is copied by the kernel with
+/// `copy_file_range` when possible.
+void concatenate_files(const std::vector<std::string>& inputs, const std::string& output, bool append = false);
+
+/// Truncate the file at `path` to `size` bytes
+void truncate_file(const std::string& path, size_t size);
+
 /// Range of steps to use from a trajectory
 class steps_range {
 public:
@@ -82,6 +91,34 @@ public:
         return stride_;
     }
 
+    /// Get a copy of this range starting at `first` instead of the current
+    /// first step
+    steps_range starting_at(size_t first) const {
+        auto range = *this;
+        range.first_ = first;
+        return range;
+    }
+
+    /// Get a copy of this range using `stride` instead of the current stride.
+    /// The last step is adjusted to be reachable from the first step.
+    steps_range with_stride(size_t stride) const {
+        auto range = *this;
+        range.stride_ = stride;
+        if (last_ != static_cast<size_t>(-1)) {
+            auto count = (last_ - first_ + stride - 1) / stride;
+            range.last_ = first_ + count * stride;
+        }
+        return range;
+    }
+
+    /// Get a copy of this range ending at `last` (excluded) instead of the
+    /// current last step. `last` should be reachable from the first step.
+    steps_range ending_at(size_t last) const {
+        auto range = *this;
+        range.last_ = last;
+        return range;
+    }
+
     /// Parse a range `string` of the form `first:last:stride`, which will
     /// generate the steps from first to last (excluded) by a step of stride.
     static steps_range parse(const std::string& string);
@@ -2,16 +2,25 @@
 // Copyright (C) Guillaume Fraux and contributors -- BSD license
 
 #include <iostream>
+#include <mutex>
 #include <set>
 #include "warnings.hpp"
 
+// Warnings can be emitted from multiple threads
+static std::mutex WARNINGS_MUTEX;
+
 void warn(std::string message) {
+    std::lock_guard<std::mutex> lock(WARNINGS_MUTEX);
     std::cerr << "[cfiles] " << message << std::endl;
 }
 
 void warn_once(std::string message) {
     static std::set<std::string> ALREADY_SEEN;
-    auto not_seen = ALREADY_SEEN.insert(message).second;
+    bool not_seen = false;
+    {
+        std::lock_guard<std::mutex> lock(WARNINGS_MUTEX);
+        not_seen = ALREADY_SEEN.insert(message).second;
+    }
     if (not_seen) {
         warn(message);
     }
@@ -0,0 +1,132 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include <catch.hpp>
+#include <chemfiles.hpp>
+
+#include "Averager.hpp"
+#include "commands/Density.hpp"
+#include "commands/Rdf.hpp"
+
+using namespace chemfiles;
+
+// Count all the heap allocations made by the program
+static std::atomic<size_t> ALLOCATIONS(0);
+
+void* operator new(size_t size) {
+    ALLOCATIONS++;
+    auto ptr = std::malloc(size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+/// Count the number of allocations made when calling `function`
+template <typename Function>
+static size_t count_allocations(Function function) {
+    auto before = ALLOCATIONS.load();
+    function();
+    return ALLOCATIONS.load() - before;
+}
+
+static Frame water_frame(size_t n_molecules) {
+    auto frame = Frame(UnitCell({20, 20, 20}));
+    for (size_t i=0; i<n_molecules; i++) {
+        auto x = static_cast<double>(i % 10) * 2.0;
+        auto y = static_cast<double>((i / 10) % 10) * 2.0;
+        auto z = static_cast<double>(i / 100) * 2.0;
+        frame.add_atom(Atom("O"), Vector3D(x, y, z));
+        frame.add_atom(Atom("H"), Vector3D(x + 0.9, y, z));
+        frame.add_atom(Atom("H"), Vector3D(x, y + 0.9, z));
+    }
+    return frame;
+}
+
+/// Run `accumulate` a few times to reach a steady state, and then count the
+/// allocations done for a single frame
+template <typename Command>
+static size_t steady_state_allocations(Command& command, Averager& histogram, const Frame& frame) {
+    for (size_t i=0; i<3; i++) {
+        command.accumulate(frame, histogram);
+        histogram.step();
+    }
+
+    return count_allocations([&](){
+        command.accumulate(frame, histogram);
+        histogram.step();
+    });
+}
+
+TEST_CASE("Histograms") {
+    auto averager = Averager(100, 0, 10, 50, 0, 5);
+    averager.insert(2.3, 1.1);
+    averager.step();
+
+    auto allocations = count_allocations([&](){
+        for (size_t step=0; step<10; step++) {
+            for (size_t i=0; i<1000; i++) {
+                averager.insert(0.01 * static_cast<double>(i), 0.005 * static_cast<double>(i));
+            }
+            averager.normalize([](size_t, double value) {
+                return 2 * value;
+            });
+            averager.step();
+        }
+        averager.average();
+    });
+    CHECK(allocations == 0);
+}
+
+TEST_CASE("Per-frame allocations") {
+    auto small_frame = water_frame(10);
+    auto large_frame = water_frame(300);
+
+    // The selections are evaluated by chemfiles, and allocate depending on
+    // the number of matches. These allocations are counted separately, and
+    // the remaining allocations should not depend on the number of atoms.
+    // The commands run with a single thread, since starting threads also
+    // allocates.
+    SECTION("Rdf") {
+        const char* argv[] = {"rdf", "water.xyz", "--max=8", "--threads=1", "-s", "pairs: name(#1) O and name(#2) H"};
+        auto rdf = Rdf();
+        auto histogram = rdf.setup(6, argv);
+
+        auto selection = Selection("pairs: name(#1) O and name(#2) H");
+        auto select = [&](const Frame& frame) {
+            return count_allocations([&](){
+                selection.evaluate(frame);
+            });
+        };
+
+        auto small = steady_state_allocations(rdf, histogram, small_frame);
+        auto large = steady_state_allocations(rdf, histogram, large_frame);
+        auto own_small = small - select(small_frame);
+        auto own_large = large - select(large_frame);
+        CHECK(own_large == own_small);
+    }
+
+    SECTION("Density") {
+        const char* argv[] = {"density", "water.xyz", "--axis=z", "--max=20", "--threads=1"};
+        auto density = Density();
+        auto histogram = density.setup(5, argv);
+
+        auto selection = Selection("atoms: all");
+        auto select = [&](const Frame& frame) {
+            return count_allocations([&](){
+                selection.list(frame);
+            });
+        };
+
+        auto small = steady_state_allocations(density, histogram, small_frame);
+        auto large = steady_state_allocations(density, histogram, large_frame);
+        auto own_small = small - select(small_frame);
+        auto own_large = large - select(large_frame);
+        CHECK(own_large == own_small);
+    }
+}
@@ -0,0 +1,73 @@
+import os
+import shutil
+import tempfile
+
+from testrun import cfiles
+from testrun.runner import CfilesError
+
+DATA = os.path.join(os.path.dirname(__file__), "data")
+TRAJECTORIES = [os.path.join(DATA, "water.xyz"), os.path.join(DATA, "nt.xyz")]
+
+
+def read_steps(path):
+    with open(path) as fd:
+        for line in fd:
+            if line.startswith("steps = "):
+                return int(line.split()[-1])
+
+
+def batch_info(directory):
+    """Run info on multiple files, writing one output per file"""
+    output = os.path.join(directory, "{stem}-{index}.info")
+    out, err = cfiles("batch", "-j", "2", "info", "-o", output, "--", *TRAJECTORIES)
+    assert out == ""
+    assert err == ""
+
+    for index, name in enumerate(["water", "nt"]):
+        path = os.path.join(directory, "{}-{}.info".format(name, index))
+        expected, _ = cfiles("info", TRAJECTORIES[index])
+        with open(path) as fd:
+            assert fd.read() == expected
+
+
+def batch_failures(directory):
+    """Failures on a file do not prevent processing the other files"""
+    missing = os.path.join(directory, "missing.xyz")
+    output = os.path.join(directory, "{name}.info")
+    try:
+        cfiles("batch", "info", "-o", output, "--", TRAJECTORIES[0], missing, TRAJECTORIES[1])
+        raise AssertionError("batch should fail when a file fails")
+    except CfilesError:
+        pass
+
+    assert read_steps(os.path.join(directory, "water.xyz.info")) == 100
+    assert os.path.exists(os.path.join(directory, "nt.xyz.info"))
+    assert not os.path.exists(os.path.join(directory, "missing.xyz.info"))
+
+
+def batch_timings(directory):
+    """Timings are collected for the whole batch"""
+    # use copies of the trajectories, since --scan saves an index next to them
+    paths = []
+    for path in TRAJECTORIES:
+        paths.append(os.path.join(directory, os.path.basename(path)))
+        shutil.copyfile(path, paths[-1])
+
+    output = os.path.join(directory, "{stem}.info")
+    out, err = cfiles("batch", "--timings", "-j", "2", "info", "--scan", "-o", output, "--", *paths)
+    assert out == ""
+    assert "frames in" in err
+    assert "read" in err
+
+    try:
+        cfiles("batch", "info", "--timings", "-o", output, "--", *TRAJECTORIES)
+        raise AssertionError("--timings should be rejected in the command arguments")
+    except CfilesError:
+        pass
+
+
+if __name__ == "__main__":
+    with tempfile.TemporaryDirectory() as directory:
+        batch_info(directory)
+        batch_failures(directory)
+        batch_timings(directory)
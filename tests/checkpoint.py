@@ -0,0 +1,98 @@
+import os
+import tempfile
+
+from testrun import cfiles
+from testrun.runner import CfilesError
+
+TRAJECTORY = os.path.join(os.path.dirname(__file__), "data", "water.xyz")
+
+
+def read_data(path):
+    with open(path) as fd:
+        return [line for line in fd if not line.startswith("#")]
+
+
+def copy_frames(path, nframes):
+    """Copy the first `nframes` frames of the XYZ trajectory to `path`"""
+    with open(TRAJECTORY) as fd:
+        lines = fd.readlines()
+    natoms = int(lines[0])
+    with open(path, "w") as fd:
+        fd.writelines(lines[:nframes * (natoms + 2)])
+
+
+def rdf_resume(directory):
+    """Resuming from a checkpoint gives the same result as a single run"""
+    trajectory = os.path.join(directory, "water.xyz")
+    output = os.path.join(directory, "rdf.dat")
+    checkpoint = os.path.join(directory, "rdf.checkpoint")
+    args = ["rdf", "-c", "15", "-s", "name O", trajectory, "-o", output]
+
+    copy_frames(trajectory, 100)
+    out, err = cfiles(*args)
+    assert out == ""
+    assert err == ""
+    expected = read_data(output)
+
+    # interrupted run, using only the first half of the trajectory
+    copy_frames(trajectory, 50)
+    out, err = cfiles(*(args + ["--checkpoint=" + checkpoint, "--checkpoint-every=7"]))
+    assert out == ""
+    assert err == ""
+    assert os.path.exists(checkpoint)
+    assert not os.path.exists(checkpoint + ".tmp")
+    assert read_data(output) != expected
+
+    copy_frames(trajectory, 100)
+    out, err = cfiles(*(args + ["--checkpoint=" + checkpoint, "--resume"]))
+    assert out == ""
+    assert err == ""
+    assert read_data(output) == expected
+
+    # resuming a finished run does not use any additional frame
+    out, err = cfiles(*(args + ["--checkpoint=" + checkpoint, "--resume"]))
+    assert out == ""
+    assert err == ""
+    assert read_data(output) == expected
+
+
+def mismatched_steps(directory):
+    """Resuming with different steps is an error"""
+    output = os.path.join(directory, "rdf.dat")
+    checkpoint = os.path.join(directory, "rdf-steps.checkpoint")
+    args = ["rdf", "-c", "15", "-s", "name O", TRAJECTORY, "-o", output, "--checkpoint=" + checkpoint]
+
+    out, err = cfiles(*(args + ["--steps=:50"]))
+    assert out == ""
+    assert err == ""
+
+    for steps in ["--steps=:60", "--steps=::2", "--steps=10:50"]:
+        try:
+            cfiles(*(args + [steps, "--resume"]))
+        except CfilesError:
+            pass
+        else:
+            raise AssertionError("resuming with " + steps + " should fail")
+
+
+def missing_checkpoint(directory):
+    """Resuming without checkpoint starts from the beginning"""
+    output = os.path.join(directory, "angles.dat")
+    checkpoint = os.path.join(directory, "angles.checkpoint")
+    args = ["angles", "-c", "15", "--guess-bonds", TRAJECTORY, "-o", output]
+
+    out, err = cfiles(*args)
+    assert out == ""
+    expected = read_data(output)
+
+    out, err = cfiles(*(args + ["--checkpoint=" + checkpoint, "--resume"]))
+    assert out == ""
+    assert "no checkpoint at" in err
+    assert read_data(output) == expected
+
+
+if __name__ == "__main__":
+    with tempfile.TemporaryDirectory() as directory:
+        rdf_resume(directory)
+        mismatched_steps(directory)
+        missing_checkpoint(directory)
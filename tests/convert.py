@@ -1,6 +1,8 @@
+import gzip
 import os
 
 from testrun import cfiles
+from testrun.runner import CfilesError
 
 PDB_CONTENT = """CRYST1   15.000   15.000   15.000  90.00  90.00  90.00
 ATOM      1  O       X   1       0.417   8.303  11.737  0.00  0.00
@@ -66,6 +68,104 @@ class isolate_files(object):
         except OSError:
             pass
 
+TRAJECTORY = os.path.join(os.path.dirname(__file__), "data", "water.xyz")
+
+
+def frames_order():
+    """Frames are written in the same order as in the input"""
+    out, err = cfiles("convert", TRAJECTORY, "ordered.xyz", "--steps=:30", "-s", "atoms: type O")
+    assert out == ""
+    assert err == ""
+    with open("ordered.xyz") as fd:
+        content = fd.read()
+
+    expected = ""
+    for step in range(30):
+        steps = "--steps={}:{}".format(step, step + 1)
+        out, err = cfiles("convert", TRAJECTORY, "ordered.xyz", steps, "-s", "atoms: type O")
+        assert out == ""
+        assert err == ""
+        with open("ordered.xyz") as fd:
+            expected += fd.read()
+    os.unlink("ordered.xyz")
+
+    assert content == expected
+
+
+def parallel_jobs():
+    """Converting in parallel chunks gives the same output"""
+    args = ["convert", TRAJECTORY, "--steps=5::3", "-s", "atoms: type O"]
+    out, err = cfiles(*(args + ["single.xyz"]))
+    assert out == ""
+    assert err == ""
+
+    out, err = cfiles(*(args + ["chunks.xyz", "--jobs=4"]))
+    assert out == ""
+    assert err == ""
+
+    with open("single.xyz") as fd:
+        expected = fd.read()
+    with open("chunks.xyz") as fd:
+        assert fd.read() == expected
+    assert not any(path.startswith("chunks.xyz.part") for path in os.listdir("."))
+    os.unlink("single.xyz")
+    os.unlink("chunks.xyz")
+
+    try:
+        cfiles(*(args + ["chunks.pdb", "--jobs=4"]))
+        raise AssertionError("--jobs should fail with PDB output")
+    except CfilesError:
+        pass
+
+
+def compressed_jobs():
+    """Compressed XYZ input with --jobs is converted without chunks"""
+    args = ["convert", "--steps=5::3", "-s", "atoms: type O", "--fast-xyz"]
+    out, err = cfiles(*(args + [TRAJECTORY, "single.xyz"]))
+    assert out == ""
+    assert err == ""
+
+    with open(TRAJECTORY, "rb") as fd:
+        content = fd.read()
+    with open("compressed.xyz.gz", "wb") as fd:
+        fd.write(gzip.compress(content))
+
+    out, err = cfiles(*(args + ["compressed.xyz.gz", "chunks.xyz", "--jobs=4"]))
+    assert out == ""
+    assert err == ""
+
+    with open("single.xyz") as fd:
+        expected = fd.read()
+    with open("chunks.xyz") as fd:
+        assert fd.read() == expected
+    os.unlink("single.xyz")
+    os.unlink("chunks.xyz")
+    os.unlink("compressed.xyz.gz")
+
+
+def resume():
+    """--resume continues an interrupted conversion"""
+    args = ["convert", TRAJECTORY, "resumed.xyz", "--steps=::2"]
+    out, err = cfiles(*args)
+    assert out == ""
+    assert err == ""
+    with open("resumed.xyz") as fd:
+        expected = fd.read()
+
+    # simulate an interrupted conversion, with a partially written frame
+    lines = expected.splitlines(True)
+    natoms = int(lines[0])
+    with open("resumed.xyz", "w") as fd:
+        fd.write("".join(lines[: 10 * (natoms + 2) + 5]))
+
+    for _ in range(2):
+        out, err = cfiles(*(args + ["--resume"]))
+        assert out == ""
+        assert err == ""
+        with open("resumed.xyz") as fd:
+            assert fd.read() == expected
+    os.unlink("resumed.xyz")
+
 
 if __name__ == "__main__":
     filename = "convert"
@@ -89,3 +189,31 @@ if __name__ == "__main__":
         assert err == ""
         with open(filename + ".xyz") as fd:
             assert fd.read() == XYZ_SEL_CONTENT
+
+    with isolate_files(filename):
+        out, err = cfiles(
+            "convert",
+            filename + ".pdb",
+            filename + "-sel.pdb",
+            "--guess-bonds",
+            "--selection",
+            "atoms: resid 2 or resid 3",
+        )
+        assert out == ""
+        assert err == ""
+        with open(filename + "-sel.pdb") as fd:
+            lines = fd.readlines()
+        os.unlink(filename + "-sel.pdb")
+
+        atoms = [line for line in lines if line.startswith("HETATM") or line.startswith("ATOM")]
+        assert len(atoms) == 6
+        # bonds are translated to the indexes in the output
+        conect = [list(map(int, line.split()[1:])) for line in lines if line.startswith("CONECT")]
+        assert len(conect) != 0
+        for indexes in conect:
+            assert all(1 <= i <= 6 for i in indexes)
+
+    frames_order()
+    parallel_jobs()
+    compressed_jobs()
+    resume()
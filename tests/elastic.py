@@ -0,0 +1,107 @@
+import os
+import random
+import tempfile
+
+from testrun import cfiles
+from testrun.runner import CfilesError
+
+
+def write_npt(path, n_frames):
+    """Write a trajectory with unit cells fluctuating around a triclinic cell"""
+    rng = random.Random(0)
+    with open(path, "w") as fd:
+        for _ in range(n_frames):
+            lattice = [
+                10 + rng.gauss(0, 0.1), 0, 0,
+                1 + rng.gauss(0, 0.1), 12 + rng.gauss(0, 0.1), 0,
+                0.5 + rng.gauss(0, 0.1), -0.8 + rng.gauss(0, 0.1), 11 + rng.gauss(0, 0.1),
+            ]
+            fd.write("1\n")
+            fd.write('Lattice="{}"\n'.format(" ".join("{:.6f}".format(v) for v in lattice)))
+            fd.write("Ar 0 0 0\n")
+
+
+def read_sections(path):
+    """Read the values in the output, grouped by comment lines"""
+    sections = []
+    with open(path) as fd:
+        for line in fd:
+            if line.startswith("#"):
+                sections.append((line[1:].strip(), []))
+            else:
+                sections[-1][1].append(line)
+    return sections
+
+
+def read_stiffness(lines):
+    """Read the upper triangle of a stiffness tensor"""
+    stiffness = {}
+    for i, line in enumerate(lines):
+        for j, value in enumerate(line.split()):
+            stiffness[(i, i + j)] = float(value)
+    return stiffness
+
+
+def read_values(line):
+    return [float(value) for value in line.split()]
+
+
+def check_error(args, message):
+    try:
+        cfiles(*args)
+    except CfilesError as e:
+        assert message in str(e)
+    else:
+        raise AssertionError("'{}' should fail".format(" ".join(args)))
+
+
+def bootstrap(directory):
+    """--bootstrap gives confidence intervals containing the estimate"""
+    trajectory = os.path.join(directory, "npt.xyz")
+    output = os.path.join(directory, "elastic.dat")
+    write_npt(trajectory, 400)
+
+    args = ["elastic", "-t", "300", "--bootstrap=200", trajectory, "-o", output]
+    out, err = cfiles(*args)
+    assert out == ""
+    assert err == ""
+
+    sections = read_sections(output)
+    assert sections[0][0].startswith("stiffness tensor")
+    estimate = read_stiffness(sections[0][1])
+    averages = [read_values(sections[i][1][0]) for i in [3, 4, 5]]
+
+    assert sections[6][0].startswith("95% confidence intervals from 200 bootstrap samples of 20 blocks")
+    assert sections[7][0].startswith("lower bound")
+    lower = read_stiffness(sections[7][1])
+    assert sections[8][0].startswith("upper bound")
+    upper = read_stiffness(sections[8][1])
+    assert len(estimate) == len(lower) == len(upper) == 21
+    for key, value in estimate.items():
+        assert lower[key] <= value <= upper[key]
+
+    for averaging, values in enumerate(averages):
+        bounds = sections[10 + averaging][1]
+        assert len(bounds) == 2
+        for low, value, high in zip(read_values(bounds[0]), values, read_values(bounds[1])):
+            assert low <= value <= high
+
+    # each sample uses its own seed, the output does not change between runs
+    with open(output) as fd:
+        expected = fd.read()
+    out, err = cfiles(*args)
+    assert out == ""
+    assert err == ""
+    with open(output) as fd:
+        assert fd.read() == expected
+
+    check_error(args + ["--bootstrap-blocks=1"], "'--bootstrap-blocks' must be at least 2")
+    check_error(args + ["--bootstrap=0"], "'--bootstrap' must be positive")
+
+    write_npt(trajectory, 1)
+    check_error(args, "not enough frames in the trajectory for --bootstrap")
+
+
+if __name__ == "__main__":
+    with tempfile.TemporaryDirectory() as directory:
+        bootstrap(directory)
@@ -0,0 +1,132 @@
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include <catch.hpp>
+#include <chemfiles.hpp>
+
+#include "CellFluctuations.hpp"
+
+using namespace chemfiles;
+
+/// Generate cells fluctuating around a triclinic cell, as in a NPT simulation
+static std::vector<Matrix3D> npt_cells(size_t count) {
+    auto rng = std::mt19937(42);
+    auto noise = std::normal_distribution<double>(0, 0.1);
+
+    auto cells = std::vector<Matrix3D>();
+    for (size_t i=0; i<count; i++) {
+        cells.emplace_back(
+            10.0 + noise(rng), 1.5 + noise(rng), 0.5 + noise(rng),
+            0.0, 12.0 + noise(rng), -0.8 + noise(rng),
+            0.0, 0.0, 11.0 + noise(rng)
+        );
+    }
+    return cells;
+}
+
+/// Compute the compliance matrix from the explicit strains of each cell
+/// relative to the average cell, in two passes over the cells
+static Matrix6 strain_compliance(const std::vector<Matrix3D>& cells, double temperature) {
+    auto reference = Matrix3D::zero();
+    for (auto& cell: cells) {
+        reference += cell.invert();
+    }
+    reference /= static_cast<double>(cells.size());
+    auto reference_t = reference.transpose();
+
+    auto epsilons = std::vector<Matrix3D>();
+    for (auto& cell: cells) {
+        epsilons.emplace_back(0.5 * (reference_t * cell.transpose() * cell * reference - Matrix3D::unit()));
+    }
+
+    auto BOLTZMANN = 1.38065e-2;
+    auto v_kt = 1.0 / (reference.determinant() * BOLTZMANN * temperature);
+
+    Matrix6 compliance;
+    for (size_t p=0; p<6; p++) {
+        for (size_t q=0; q<6; q++) {
+            auto i = CARTESIAN_TO_VOIGT[p][0];
+            auto j = CARTESIAN_TO_VOIGT[p][1];
+            auto k = CARTESIAN_TO_VOIGT[q][0];
+            auto l = CARTESIAN_TO_VOIGT[q][1];
+
+            double factor = 1.0;
+            if (i != j) {
+                factor *= 2;
+            }
+            if (k != l) {
+                factor *= 2;
+            }
+
+            double eij = 0;
+            double ekl = 0;
+            double eij_ekl = 0;
+            for (auto& epsilon: epsilons) {
+                eij += epsilon[i][j];
+                ekl += epsilon[k][l];
+                eij_ekl += epsilon[i][j] * epsilon[k][l];
+            }
+            auto n = static_cast<double>(epsilons.size());
+            eij /= n;
+            ekl /= n;
+            eij_ekl /= n;
+
+            compliance(p, q) = factor * v_kt * (eij_ekl - eij * ekl);
+        }
+    }
+    return compliance;
+}
+
+/// Check that `actual` and `expected` are equal, relative to the largest
+/// value in `expected`
+static bool roughly(const Matrix6& actual, const Matrix6& expected, double eps=1e-6) {
+    auto scale = expected.cwiseAbs().maxCoeff();
+    return (actual - expected).cwiseAbs().maxCoeff() < eps * scale;
+}
+
+TEST_CASE("Cell fluctuations") {
+    auto cells = npt_cells(500);
+    auto temperature = 300.0;
+
+    SECTION("Compliance") {
+        auto fluctuations = CellFluctuations();
+        for (auto& cell: cells) {
+            fluctuations.add(cell);
+        }
+        CHECK(fluctuations.count() == 500);
+
+        auto expected = strain_compliance(cells, temperature);
+        auto compliance = fluctuations.compliance(temperature);
+        CHECK(roughly(compliance, expected));
+        // the compliance matrix is symmetric
+        CHECK(roughly(compliance, compliance.transpose(), 1e-12));
+    }
+
+    SECTION("Merge") {
+        auto all = CellFluctuations();
+        auto first = CellFluctuations();
+        auto second = CellFluctuations();
+        for (size_t i=0; i<cells.size(); i++) {
+            all.add(cells[i]);
+            if (i < 200) {
+                first.add(cells[i]);
+            } else {
+                second.add(cells[i]);
+            }
+        }
+
+        auto merged = first;
+        merged.merge(second);
+        CHECK(merged.count() == all.count());
+        CHECK(roughly(merged.compliance(temperature), all.compliance(temperature), 1e-10));
+
+        // merging with an empty accumulator does nothing
+        merged.merge(CellFluctuations());
+        CHECK(roughly(merged.compliance(temperature), all.compliance(temperature), 1e-10));
+
+        auto empty = CellFluctuations();
+        empty.merge(all);
+        CHECK(roughly(empty.compliance(temperature), all.compliance(temperature), 1e-10));
+    }
+}
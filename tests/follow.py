@@ -0,0 +1,76 @@
+import os
+import subprocess
+import tempfile
+import time
+
+from testrun import cfiles
+
+TRAJECTORY = os.path.join(os.path.dirname(__file__), "data", "water.xyz")
+
+
+def read_frames(path):
+    frames = []
+    with open(path) as fd:
+        lines = fd.readlines()
+    start = 0
+    while start < len(lines):
+        end = start + int(lines[start]) + 2
+        frames.append("".join(lines[start:end]))
+        start = end
+    return frames
+
+
+def read_data(path):
+    with open(path) as fd:
+        return [line for line in fd if not line.startswith("#")]
+
+
+def wait_for(condition, timeout=60):
+    start = time.time()
+    while not condition():
+        if time.time() - start > timeout:
+            raise AssertionError("timeout while waiting")
+        time.sleep(0.05)
+
+
+def follow_growing_file(directory):
+    """--follow processes frames as they are added to the trajectory"""
+    output = os.path.join(directory, "rdf.dat")
+    args = ["rdf", "-c", "15", "-s", "name O", "--steps=:100", "-o", output]
+
+    out, err = cfiles(*(args + [TRAJECTORY]))
+    assert out == ""
+    assert err == ""
+    expected = read_data(output)
+    os.remove(output)
+
+    frames = read_frames(TRAJECTORY)
+    growing = os.path.join(directory, "growing.xyz")
+    with open(growing, "w") as fd:
+        fd.write("".join(frames[:50]))
+
+    command = ["./cfiles"] + args + [growing, "--fast-xyz", "--follow", "--follow-interval=0.05"]
+    process = subprocess.Popen(command, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    try:
+        # the output is updated with the frames available so far
+        wait_for(lambda: os.path.exists(output))
+        assert read_data(output) != expected
+
+        with open(growing, "a") as fd:
+            fd.write("".join(frames[50:]))
+
+        # the process stops after the last step in --steps
+        stdout, stderr = process.communicate(timeout=60)
+    finally:
+        if process.poll() is None:
+            process.kill()
+
+    assert process.returncode == 0
+    assert stdout.decode("utf8") == ""
+    assert stderr.decode("utf8") == ""
+    assert read_data(output) == expected
+
+
+if __name__ == "__main__":
+    with tempfile.TemporaryDirectory() as directory:
+        follow_growing_file(directory)
@@ -0,0 +1,93 @@
+import os
+import shutil
+import struct
+import tempfile
+
+from testrun import cfiles
+
+TRAJECTORY = os.path.join(os.path.dirname(__file__), "data", "water.xyz")
+
+
+def read_scan(output):
+    scan = {}
+    in_scan = False
+    for line in output.splitlines():
+        if line == "[scan]":
+            in_scan = True
+        elif in_scan and " = " in line:
+            key, value = line.split(" = ")
+            scan[key] = value
+    return scan
+
+
+def scan_xyz(directory):
+    """--scan reads all frames, and saves an index for XYZ files"""
+    path = os.path.join(directory, "water.xyz")
+    shutil.copyfile(TRAJECTORY, path)
+
+    out, err = cfiles("info", "--scan", path)
+    assert err == ""
+    scan = read_scan(out)
+    assert scan["frames_count"] == "100"
+    assert scan["atoms_count"] == "[297, 297]"
+    assert scan["constant_topology"] == "true"
+    assert scan["frames_steps"] == "[0, 99]"
+    assert "frames_bytes" in scan
+    assert os.path.exists(path + ".cfindex")
+
+    with open(path + ".cfindex", "rb") as fd:
+        index = fd.read()
+
+    # the index is used when opening the file again: an index for the same
+    # file missing the last frame (but otherwise valid) is trusted
+    magic, header, count, frames = index[:8], index[8:32], index[32:40], index[40:]
+    assert struct.unpack("=Q", count)[0] == 100
+    with open(path + ".cfindex", "wb") as fd:
+        fd.write(magic + header + struct.pack("=Q", 99) + frames[:-16])
+
+    out, err = cfiles("info", "--scan", path)
+    assert err == ""
+    assert "steps = 99" in out
+    assert read_scan(out)["frames_count"] == "99"
+
+    # a corrupted index is ignored, and replaced by a new one
+    with open(path + ".cfindex", "wb") as fd:
+        fd.write(magic + b"garbage")
+
+    out, err = cfiles("info", "--scan", path)
+    assert err == ""
+    assert "steps = 100" in out
+    assert read_scan(out)["frames_count"] == "100"
+    with open(path + ".cfindex", "rb") as fd:
+        assert fd.read() == index
+
+
+def scan_time(directory):
+    """--scan reports the time range from extended XYZ files"""
+    path = os.path.join(directory, "time.xyz")
+    with open(TRAJECTORY) as fd:
+        lines = fd.readlines()
+    natoms = int(lines[0])
+    with open(path, "w") as fd:
+        for i in range(0, len(lines), natoms + 2):
+            fd.write(lines[i])
+            fd.write('Lattice="15 0 0 0 15 0 0 0 15" Time={} pbc="T T T"\n'.format(0.5 * (i // (natoms + 2))))
+            fd.writelines(lines[i + 2:i + natoms + 2])
+
+    out, err = cfiles("info", "--scan", path)
+    assert err == ""
+    scan = read_scan(out)
+    assert scan["frames_count"] == "100"
+    time = [float(value) for value in scan["time"].strip("[]").split(",")]
+    assert time == [0.0, 49.5]
+
+    # the time is still there when using the index
+    out_with_index, err = cfiles("info", "--scan", path)
+    assert err == ""
+    assert out_with_index == out
+
+
+if __name__ == "__main__":
+    with tempfile.TemporaryDirectory() as directory:
+        scan_xyz(directory)
+        scan_time(directory)
@@ -0,0 +1,33 @@
+import os
+
+from testrun import cfiles
+
+DATA = os.path.join(os.path.dirname(__file__), "data")
+TRAJECTORIES = [os.path.join(DATA, "water.xyz"), os.path.join(DATA, "nt.xyz")]
+
+
+def resume():
+    """--resume continues an interrupted merge"""
+    args = ["merge", "-c", "40", "-o", "merged.xyz"] + TRAJECTORIES
+    out, err = cfiles(*args)
+    assert out == ""
+    assert err == ""
+    with open("merged.xyz") as fd:
+        expected = fd.read()
+
+    # simulate an interrupted merge, with a partially written frame
+    lines = expected.splitlines(True)
+    natoms = int(lines[0])
+    with open("merged.xyz", "w") as fd:
+        fd.write("".join(lines[: 3 * (natoms + 2) + 7]))
+
+    out, err = cfiles(*(args + ["--resume"]))
+    assert out == ""
+    assert err == ""
+    with open("merged.xyz") as fd:
+        assert fd.read() == expected
+    os.unlink("merged.xyz")
+
+
+if __name__ == "__main__":
+    resume()
@@ -0,0 +1,83 @@
+#include <random>
+#include <set>
+
+#include <catch.hpp>
+#include <chemfiles.hpp>
+
+#include "NeighborList.hpp"
+
+using namespace chemfiles;
+
+/// Check that all the pairs closer than `cutoff` are in the `list`
+static void check_pairs(const Frame& frame, const std::vector<size_t>& atoms, const NeighborList& list, double cutoff) {
+    for (auto i: atoms) {
+        auto neighbors = list.neighbors(i);
+        auto found = std::set<size_t>(neighbors.begin(), neighbors.end());
+        for (auto j: atoms) {
+            if (i != j && frame.distance(i, j) < cutoff) {
+                CHECK(found.count(j) == 1);
+            }
+        }
+    }
+}
+
+TEST_CASE("Neighbor list") {
+    auto rng = std::mt19937(42);
+    auto uniform = std::uniform_real_distribution<double>(0, 1);
+    auto normal = std::normal_distribution<double>(0, 0.05);
+
+    auto cells = std::vector<UnitCell>{
+        UnitCell({30, 25, 40}),
+        UnitCell({30, 25, 40}, {80, 95, 105}),
+        UnitCell(),
+    };
+    for (auto& cell: cells) {
+        auto frame = Frame(cell);
+        for (size_t i=0; i<500; i++) {
+            frame.add_atom(Atom("X"), Vector3D(30 * uniform(rng), 25 * uniform(rng), 40 * uniform(rng)));
+        }
+
+        auto atoms = std::vector<size_t>();
+        for (size_t i=0; i<500; i+=2) {
+            atoms.push_back(i);
+        }
+
+        auto list = NeighborList(6.0, 1.0);
+        for (size_t step=0; step<20; step++) {
+            list.update(frame, atoms);
+            check_pairs(frame, atoms, list, 6.0);
+
+            for (auto& position: frame.positions()) {
+                position = position + Vector3D(normal(rng), normal(rng), normal(rng));
+            }
+        }
+        // small displacements do not need to rebuild the list every step
+        CHECK(list.rebuilds() < 20);
+
+        // atoms not in the list have no neighbors
+        CHECK(list.neighbors(1).size() == 0);
+
+        // changing the atoms rebuilds the list
+        atoms.pop_back();
+        CHECK(list.update(frame, atoms));
+        check_pairs(frame, atoms, list, 6.0);
+    }
+}
+
+TEST_CASE("Neighbor list in small cells") {
+    // the cutoff is larger than half of the cell, all pairs are in the list
+    auto frame = Frame(UnitCell({10, 10, 10}));
+    frame.add_atom(Atom("X"), Vector3D(0, 0, 0));
+    frame.add_atom(Atom("X"), Vector3D(5, 5, 5));
+    frame.add_atom(Atom("X"), Vector3D(9, 1, 3));
+
+    auto list = NeighborList(6.0);
+    CHECK(list.update(frame, {0, 1, 2}));
+    CHECK(list.neighbors(0).size() == 2);
+    CHECK(list.neighbors(1).size() == 2);
+    CHECK(list.neighbors(2).size() == 2);
+
+    // atoms can move as much as they want
+    frame.positions()[1] = Vector3D(1, 2, 3);
+    CHECK_FALSE(list.update(frame, {0, 1, 2}));
+}
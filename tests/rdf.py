@@ -1,3 +1,5 @@
+import gzip
+import lzma
 import os
 import tempfile
 
@@ -203,9 +205,191 @@ def OH_rdf_partial(output):
     check_ho_rdf(data)
 
 
+def fast_xyz(output):
+    """The fast XYZ reader gives the same results as chemfiles"""
+    args = ["rdf", "-c", "15", "-p", "150", "-s", "name O", "--steps", "::3", TRAJECTORY, "-o", output]
+    out, err = cfiles(*args)
+    assert out == ""
+    assert err == ""
+    expected = read_rdf(output)
+
+    out, err = cfiles(*(args + ["--fast-xyz"]))
+    assert out == ""
+    assert err == ""
+    assert read_rdf(output) == expected
+
+    with open(TRAJECTORY, "rb") as fd:
+        content = fd.read()
+
+    for extension, compress in [(".gz", gzip.compress), (".xz", lzma.compress)]:
+        with tempfile.NamedTemporaryFile(suffix=".xyz" + extension) as compressed:
+            compressed.write(compress(content))
+            compressed.flush()
+
+            args[-3] = compressed.name
+            out, err = cfiles(*(args + ["--fast-xyz"]))
+            assert out == ""
+            assert err == ""
+            assert read_rdf(output) == expected
+
+
+def split_xyz(path, directory, n_segments):
+    frames = []
+    with open(path) as fd:
+        lines = fd.readlines()
+    start = 0
+    while start < len(lines):
+        end = start + int(lines[start]) + 2
+        frames.append("".join(lines[start:end]))
+        start = end
+
+    paths = []
+    size = (len(frames) + n_segments - 1) // n_segments
+    for i in range(n_segments):
+        segment = os.path.join(directory, "segment-{}.xyz".format(i))
+        with open(segment, "w") as fd:
+            fd.write("".join(frames[i * size : (i + 1) * size]))
+        paths.append(segment)
+    return paths
+
+
+def segments(output):
+    """Multiple segments are read as a single trajectory"""
+    args = ["rdf", "-c", "15", "-p", "150", "-s", "name O", "--steps", "10::3", TRAJECTORY, "-o", output]
+    out, err = cfiles(*args)
+    assert out == ""
+    assert err == ""
+    expected = read_rdf(output)
+
+    with tempfile.TemporaryDirectory() as directory:
+        paths = split_xyz(TRAJECTORY, directory, 3)
+        for trajectory in [",".join(paths), os.path.join(directory, "segment-*.xyz")]:
+            args[-3] = trajectory
+            out, err = cfiles(*args)
+            assert out == ""
+            assert err == ""
+            assert read_rdf(output) == expected
+
+        # compressed segments are counted when reading them
+        for i in [0, 2]:
+            with open(paths[i], "rb") as fd:
+                content = fd.read()
+            with open(paths[i] + ".gz", "wb") as fd:
+                fd.write(gzip.compress(content))
+            paths[i] += ".gz"
+        args[-3] = ",".join(paths)
+        out, err = cfiles(*(args + ["--fast-xyz"]))
+        assert out == ""
+        assert err == ""
+        assert read_rdf(output) == expected
+
+
+def replicas(output):
+    """Multiple trajectories are averaged as independent replicas"""
+    args = ["rdf", "-c", "15", "-p", "150", "-s", "name O", "--steps", "::5", TRAJECTORY, "-o", output]
+    out, err = cfiles(*args)
+    assert out == ""
+    assert err == ""
+    expected = read_rdf(output)
+
+    out, err = cfiles(*(args + [TRAJECTORY, "--replica-weights=1:3"]))
+    assert out == ""
+    assert err == ""
+
+    data = []
+    with open(output) as fd:
+        for line in fd:
+            if line.startswith("#"):
+                continue
+            data.append(tuple(map(float, line.split())))
+
+    assert len(data) == len(expected)
+    for values, reference in zip(data, expected):
+        assert len(values) == 5
+        for value, ref in zip(values[:4], reference):
+            assert abs(value - ref) <= 1e-5 * max(1, abs(ref))
+        # the spread between identical replicas is zero
+        assert values[4] < 1e-6
+
+
+def windows():
+    """Time-resolved rdf over sliding windows"""
+    with tempfile.TemporaryDirectory() as directory:
+        output = os.path.join(directory, "rdf.dat")
+        args = ["rdf", "-c", "15", "-p", "150", "-s", "name O", TRAJECTORY, "-o", output]
+        out, err = cfiles(*(args + ["--window=25", "--window-every=10"]))
+        assert out == ""
+        assert err == ""
+
+        for step in [24, 34, 44, 54, 64, 74, 84, 94]:
+            assert os.path.exists(os.path.join(directory, "rdf.{}.dat".format(step)))
+        assert not os.path.exists(os.path.join(directory, "rdf.99.dat"))
+
+        windowed = read_rdf(os.path.join(directory, "rdf.44.dat"))
+        out, err = cfiles(*(args + ["--steps=20:45"]))
+        assert out == ""
+        assert err == ""
+        expected = read_rdf(output)
+
+        assert len(windowed) == len(expected)
+        for values, reference in zip(windowed, expected):
+            for value, ref in zip(values, reference):
+                assert abs(value - ref) <= 1e-5 * max(1, abs(ref))
+
+
+def auto_stride(output):
+    """--auto-stride uses the stride estimated from the first frames"""
+    args = ["rdf", "-c", "15", "-p", "150", "-s", "name O", TRAJECTORY, "-o", output]
+    out, err = cfiles(*(args + ["--auto-stride", "--auto-stride-frames=50"]))
+    assert out == ""
+    assert "auto-stride: statistical inefficiency" in err
+    summary = {}
+    for line in err.splitlines()[1:]:
+        name, value = line.rsplit(None, 1)
+        summary[name.strip()] = float(value)
+    stride = int(summary["stride"])
+    assert summary["residual inefficiency"] <= 1
+    assert summary["effective sample size"] <= summary["used frames"]
+    assert stride >= 1
+    data = read_rdf(output)
+
+    out, err = cfiles(*(args + ["--steps=::{}".format(stride)]))
+    assert out == ""
+    assert err == ""
+    assert read_rdf(output) == data
+
+
+def converge(output):
+    """--converge stops the run once the average converged"""
+    args = ["rdf", "-c", "15", "-p", "150", "-s", "name O", TRAJECTORY, "-o", output]
+    out, err = cfiles(*(args + ["--converge=0.5", "--converge-every=10"]))
+    assert out == ""
+    assert err == ""
+
+    step = None
+    with open(output) as fd:
+        for line in fd:
+            if line.startswith("# converged at step "):
+                step = int(line.split()[4])
+    assert step is not None
+    assert step < 99
+    data = read_rdf(output)
+
+    out, err = cfiles(*(args + ["--steps=:{}".format(step + 1)]))
+    assert out == ""
+    assert err == ""
+    assert read_rdf(output) == data
+
+
 if __name__ == "__main__":
     with tempfile.NamedTemporaryFile() as file:
         oxygen_rdf_all(file.name)
         oxygen_rdf_partial(file.name)
         OH_rdf_all(file.name)
         OH_rdf_partial(file.name)
+        fast_xyz(file.name)
+        segments(file.name)
+        replicas(file.name)
+        windows()
+        auto_stride(file.name)
+        converge(file.name)
@@ -14,7 +14,9 @@ def cfiles(*args):
     if process.returncode != 0:
         command = " ".join(command)
         raise CfilesError(
-            "Process '{}' exited with non-zero return code".format(command)
+            "Process '{}' exited with non-zero return code\n{}{}".format(
+                command, stdout.decode("utf8"), stderr.decode("utf8")
+            )
         )
 
     return stdout.decode("utf8"), stderr.decode("utf8")
@@ -0,0 +1,92 @@
+import json
+import os
+import shutil
+import tempfile
+
+from testrun import cfiles
+from testrun.runner import CfilesError
+
+TRAJECTORY = os.path.join(os.path.dirname(__file__), "data", "water.xyz")
+
+
+def rdf_timings(output):
+    out, err = cfiles(
+        "rdf", "-c", "15", "-s", "name O", "--timings", TRAJECTORY, "-o", output
+    )
+    assert out == ""
+
+    assert "100 frames in" in err
+    assert "frames/s" in err
+    for phase in ["read", "select", "accumulate", "step/normalize", "write"]:
+        assert phase in err
+
+    pairs = [line for line in err.splitlines() if "pairs evaluated" in line]
+    assert len(pairs) == 1
+    # 99 oxygen atoms, 100 frames
+    assert int(pairs[0].split()[-1]) == 100 * 99 * 98
+
+
+def no_timings(output):
+    out, err = cfiles("rdf", "-c", "15", "-s", "name O", TRAJECTORY, "-o", output)
+    assert out == ""
+    assert err == ""
+
+
+def info_timings(directory):
+    # use a copy of the trajectory, since --scan saves an index next to it
+    path = os.path.join(directory, "water.xyz")
+    shutil.copyfile(TRAJECTORY, path)
+
+    out, err = cfiles("info", "--scan", "--timings", path)
+    assert "[scan]" in out
+
+    assert "100 frames in" in err
+    for phase in ["read", "accumulate"]:
+        assert phase in err
+
+
+def rdf_trace(output, trace):
+    out, err = cfiles(
+        "rdf", "-c", "15", "-s", "name O", "--trace=" + trace, TRAJECTORY, "-o", output
+    )
+    assert out == ""
+    assert err == ""
+
+    with open(trace) as fd:
+        events = json.load(fd)["traceEvents"]
+
+    begins = [e for e in events if e["ph"] == "B"]
+    ends = [e for e in events if e["ph"] == "E"]
+    assert len(begins) == len(ends)
+
+    reads = [e for e in begins if e["name"] == "read"]
+    assert [e["args"]["step"] for e in reads] == list(range(100))
+    assert len([e for e in begins if e["name"] == "accumulate"]) == 100
+
+
+def trace_on_error(directory):
+    trace = os.path.join(directory, "trace.json")
+    missing = os.path.join(directory, "missing.xyz")
+    try:
+        cfiles("rdf", "-c", "15", "-s", "name O", "--trace=" + trace, missing)
+        raise AssertionError("expected an error")
+    except CfilesError:
+        pass
+
+    # the trace is still written when the command fails
+    with open(trace) as fd:
+        assert "traceEvents" in json.load(fd)
+
+
+if __name__ == "__main__":
+    with tempfile.NamedTemporaryFile() as file:
+        rdf_timings(file.name)
+        no_timings(file.name)
+
+    with tempfile.TemporaryDirectory() as directory:
+        info_timings(directory)
+        trace_on_error(directory)
+
+    with tempfile.NamedTemporaryFile() as file:
+        with tempfile.NamedTemporaryFile() as trace:
+            rdf_trace(file.name, trace.name)
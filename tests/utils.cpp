@@ -46,6 +46,10 @@ TEST_CASE("Steps ranges") {
     CHECK(range.count(100) == 0);
     CHECK(range.count(1001) == 160);
 
+    range = steps_range::parse("10:20:2").with_stride(4);
+    result = std::vector<size_t>(range.begin(), range.end());
+    expected = std::vector<size_t>{10, 14, 18};
+    CHECK(result == expected);
 
     SECTION("Errors") {
         auto bad_ranges = {
@@ -0,0 +1,203 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+
+#include <catch.hpp>
+#include <chemfiles.hpp>
+
+#include "XYZReader.hpp"
+#include "Errors.hpp"
+
+using namespace chemfiles;
+
+static const char* EXTENDED_XYZ = "extended-test.xyz";
+
+static void write_extended_xyz() {
+    std::ofstream file(EXTENDED_XYZ);
+    for (size_t step=0; step<20; step++) {
+        file << "3\n";
+        file << "Lattice=\"10.0 0 0 0 12.5 0 0 0 15.0\" Properties=species:S:1:pos:R:3:charge:R:1:velo:R:3 Time=" << step << "\n";
+        file << "O 1.5 -2.25e-1 3 -0.8 0.1 0.2 0.3\n";
+        file << "H " << step << " 0.0 1.0d2 0.4 -1 -2 -3\n";
+        file << "  H\t0.0 0.0 0.0 0.4 0 0 0\n";
+    }
+}
+
+TEST_CASE("Extended XYZ") {
+    write_extended_xyz();
+    XYZReader reader(EXTENDED_XYZ);
+    REQUIRE(reader.nsteps() == 20);
+
+    auto frame = Frame();
+    REQUIRE(reader.read_step(0, frame));
+    CHECK(frame.step() == 0);
+    REQUIRE(frame.size() == 3);
+    CHECK(frame[0].name() == "O");
+    CHECK(frame[2].name() == "H");
+
+    auto positions = frame.positions();
+    CHECK(positions[0][0] == 1.5);
+    CHECK(positions[0][1] == -0.225);
+    CHECK(positions[0][2] == 3);
+    CHECK(positions[1][2] == 100);
+
+    REQUIRE(frame.velocities());
+    auto velocities = *frame.velocities();
+    CHECK(velocities[0][0] == 0.1);
+    CHECK(velocities[1][2] == -3);
+
+    auto lengths = frame.cell().lengths();
+    CHECK(lengths[0] == 10.0);
+    CHECK(lengths[1] == 12.5);
+    CHECK(lengths[2] == 15.0);
+
+    // read steps with a stride, and out of order
+    for (auto step: {5, 10, 15, 2}) {
+        REQUIRE(reader.read_step(static_cast<size_t>(step), frame));
+        CHECK(frame.step() == static_cast<size_t>(step));
+        CHECK(frame.positions()[1][0] == step);
+        auto time = frame.get("Time");
+        REQUIRE(time);
+        CHECK(time->as_double() == step);
+    }
+    CHECK_FALSE(reader.read_step(20, frame));
+
+    auto cell = UnitCell();
+    REQUIRE(reader.read_cell(7, cell));
+    CHECK(cell.lengths()[1] == 12.5);
+    CHECK_FALSE(reader.read_cell(20, cell));
+
+    reader.set_cell(UnitCell({20, 20, 20}));
+    REQUIRE(reader.read_step(3, frame));
+    CHECK(frame.cell().lengths()[0] == 20);
+    REQUIRE(reader.read_cell(3, cell));
+    CHECK(cell.lengths()[0] == 20);
+
+    std::remove(EXTENDED_XYZ);
+}
+
+TEST_CASE("Invalid XYZ") {
+    {
+        std::ofstream file(EXTENDED_XYZ);
+        file << "2\n\nO 1 2 3\nH 1 2 foo\n";
+    }
+    XYZReader reader(EXTENDED_XYZ);
+    REQUIRE(reader.nsteps() == 1);
+
+    auto frame = Frame();
+    CHECK_THROWS_AS(reader.read_step(0, frame), CFilesError);
+
+    std::remove(EXTENDED_XYZ);
+}
+
+TEST_CASE("Growing XYZ") {
+    static const char* GROWING_XYZ = "growing-test.xyz";
+    auto write_frame = [](std::ofstream& file, size_t step) {
+        file << "2\n\n";
+        file << "O " << step << " 0 0\n";
+        file << "H 0 0 1\n";
+    };
+
+    {
+        std::ofstream file(GROWING_XYZ);
+        write_frame(file, 0);
+        write_frame(file, 1);
+    }
+
+    XYZReader reader(GROWING_XYZ);
+    REQUIRE(reader.nsteps() == 2);
+    CHECK(reader.refresh() == 2);
+
+    auto frame = Frame();
+    CHECK_FALSE(reader.read_step(2, frame));
+
+    {
+        std::ofstream file(GROWING_XYZ, std::ios::app);
+        write_frame(file, 2);
+        // partially written frame
+        file << "2\n\nO 3 0 0\nH 0 0";
+    }
+    REQUIRE(reader.refresh() == 3);
+    REQUIRE(reader.read_step(2, frame));
+    CHECK(frame.positions()[0][0] == 2);
+
+    {
+        std::ofstream file(GROWING_XYZ, std::ios::app);
+        file << " 1\n";
+        write_frame(file, 4);
+    }
+    REQUIRE(reader.refresh() == 5);
+    REQUIRE(reader.read_step(3, frame));
+    CHECK(frame.positions()[0][0] == 3);
+    CHECK(frame.positions()[1][2] == 1);
+    REQUIRE(reader.read_step(4, frame));
+    CHECK(frame.positions()[0][0] == 4);
+
+    {
+        // the last line of the file is still being written when opening it
+        std::ofstream file(GROWING_XYZ);
+        write_frame(file, 0);
+        file << "2\n\nO 1 0 0\nH 0 0 0.12";
+    }
+    XYZReader growing(GROWING_XYZ, true);
+    CHECK(growing.nsteps() == 1);
+
+    {
+        std::ofstream file(GROWING_XYZ, std::ios::app);
+        file << "34\n";
+    }
+    REQUIRE(growing.refresh() == 2);
+    REQUIRE(growing.read_step(1, frame));
+    CHECK(frame.positions()[1][2] == Approx(0.1234));
+
+    std::remove(GROWING_XYZ);
+}
+
+TEST_CASE("XYZ index") {
+    write_extended_xyz();
+    auto index = XYZReader::index_path(EXTENDED_XYZ);
+    {
+        XYZReader reader(EXTENDED_XYZ);
+        reader.save_index();
+    }
+
+    {
+        // change the number of frames in the index to check that it is used
+        std::fstream file(index, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(32);
+        uint64_t count = 19;
+        file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    }
+    {
+        XYZReader reader(EXTENDED_XYZ);
+        CHECK(reader.nsteps() == 19);
+    }
+
+    // the index is ignored if the file was rewritten with the same size
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    write_extended_xyz();
+    {
+        XYZReader reader(EXTENDED_XYZ);
+        CHECK(reader.nsteps() == 20);
+    }
+
+    // the index is ignored if the file changed
+    {
+        std::ofstream file(EXTENDED_XYZ, std::ios::app);
+        file << "1\n\nO 0 0 0 0 0 0 0\n";
+    }
+    {
+        XYZReader reader(EXTENDED_XYZ);
+        CHECK(reader.nsteps() == 21);
+
+        auto frame = Frame();
+        REQUIRE(reader.parse_step(3, frame));
+        CHECK(frame.step() == 3);
+        CHECK(frame.positions()[1][0] == 3);
+    }
+
+    std::remove(EXTENDED_XYZ);
+    std::remove(index.c_str());
+}